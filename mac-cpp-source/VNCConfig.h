@@ -21,9 +21,11 @@
 #define USE_TIGHT_AUTH           1 // Use tight auth and file transfers
 #define USE_TURBO_FEATURES       1 // Use fence and continuous updates
 #define USE_IN_PLACE_COMPRESSION 1
+#define USE_ADAPTIVE_ENCODER     1 // Choose the encoder for each update by measured cost
 
 #define USE_SANITY_CHECKS        0 // Add extra checks for debugging
 #define USE_CODE_PROFILER        0
+#define USE_FILE_FRAMEBUFFER     0 // Serve frames from a file, rather than the screen
 #define LOG_COMPRESSION_STATS    1
 
 /**
@@ -33,6 +35,15 @@
 
 #define VNC_COMPRESSION_LEVEL 4
 
+/**
+ * The largest window, from 4096 to 32768 bytes, to give the fast
+ * deflater that is used when zLibLevel is 11 or when there is not
+ * enough memory for miniz. Smaller windows are tried in turn until
+ * one can be allocated. Levels 0 to 10 select the miniz level.
+ */
+
+#define VNC_ZLIB_MAX_WINDOW 32768L
+
 /**
  * If the following is defined, MiniVNC will automatically
  * start the server if it finds the application is in the
@@ -82,6 +93,9 @@ struct VNCConfig {
     unsigned short autoRestart : 1;
     unsigned short forceVNCAuth : 1;
     unsigned short enableLogging : 1;
+    unsigned short shadowDiff : 1;
+    unsigned short allowTightPNG : 1;
+    unsigned short allowZHextile : 1;
     unsigned short : 0;
     unsigned char  zLibLevel;
     char           sessionName[11];
@@ -91,7 +105,7 @@ struct VNCConfig {
 
 #define VNC_CONFIG_DEFAULTS { \
     1,            /* majorVersion */ \
-    5,            /* minorVersion */ \
+    6,            /* minorVersion */ \
     true,         /* allowStreaming */ \
     true,         /* allowIncremental */ \
     true,         /* allowControl */ \
@@ -105,6 +119,9 @@ struct VNCConfig {
     false,        /* autoRestart */ \
     false,        /* forceVNCAuth */ \
     false,        /* enableLogging */ \
+    false,        /* shadowDiff */ \
+    true,         /* allowTightPNG */ \
+    true,         /* allowZHextile */ \
     5,            /* zLibLevel */ \
     "\pMacintosh",/* sessionName */ \
     5900,         /* tcpPort */ \
@@ -26,6 +26,10 @@
 #define UPDATE_MAX_TILES   7
 #define DEBUG_SUBRECTS     0
 
+#define ZLIBHEX_BUFFER_SIZE   4096
+#define ZLIBHEX_MIN_COMP_SIZE 17 // Shorter tile data is sent uncompressed
+#define ZLIBHEX_OVERHEAD      32 // Length word plus worst case expansion
+
 #define src32 ((unsigned long*)src)
 
 unsigned int lastBg, lastFg;
@@ -34,6 +38,11 @@ Size VNCEncodeHextile::minBufferSize() {
     return UPDATE_BUFFER_SIZE;
 }
 
+Size VNCEncodeHextile::minZlibBufferSize() {
+    // ZlibHex packs more tiles per chunk, since they compress well
+    return ZLIBHEX_BUFFER_SIZE;
+}
+
 void VNCEncodeHextile::begin() {
     lastBg = lastFg = -1;
 }
@@ -44,6 +53,14 @@ void VNCEncodeHextile::begin() {
     #define ForegroundSpecified 4
     #define AnySubrects         8
     #define SubrectsColored     16
+    #define ZlibRaw             32
+    #define ZlibHex             64
+
+    // The ZLib streams used by ZlibHex
+    enum {
+        ZlibHexEncodedStream = 0,
+        ZlibHexRawStream     = 1
+    };
 
     struct Subrect {
         unsigned char c;
@@ -247,29 +264,8 @@ void VNCEncodeHextile::begin() {
             if (rawTileLen <= epb.bytesAvail) {
                 // If we get here, emit a raw tile
                 *dst++ = Raw;
-                const Boolean canEmitNativeTileAsRaw = (fbDepth == 8) && (!fbPixFormat.trueColor);
-                if(canEmitNativeTileAsRaw) {
-                    BlockMove(nativeTile,dst,nativeLen);
-                    dst += nativeLen;
-                } else {
-                    // Emit a raw tile
-                    src = nativeTile;
-                    // Rewrite the tile with expanded colors
-                    const unsigned char rsft = 32 - fbDepth;
-                    const unsigned long lmask = ((unsigned long)-1) << rsft; // Mask for leftmost color in block
-                    unsigned char bitsLeft = 0;
-                    unsigned long packed;
-                    unsigned short pixels = epb.rows * epb.cols;
-                    do {
-                        if(bitsLeft == 0) {
-                            packed = *src32++;
-                            bitsLeft = 32;
-                        }
-                        emitColor(dst, (packed & lmask) >> rsft);
-                        packed <<= fbDepth;
-                        bitsLeft -= fbDepth;
-                    } while(--pixels);
-                }
+                // Expand the tile with the routine chosen for the depth and pixel format
+                dst = VNCPalette::expandTile(nativeTile, dst, epb.rows * epb.cols);
 
                 lastBg = lastFg = -1;
                 #if USE_SANITY_CHECKS
@@ -299,4 +295,51 @@ void VNCEncodeHextile::begin() {
         }
         return 0;
     }
+
+    /* ZlibHex encodes each tile as Hextile, then compresses the data
+     * following the subencoding byte. Raw tiles and tiles with subrects
+     * are compressed on separate streams, as the protocol requires. If
+     * there was no memory for the raw stream, raw tiles are left as is.
+     */
+
+    unsigned long VNCEncodeHextile::encodeZlibTile(const EncoderPB &epb) {
+        // Make sure a tile that is encoded will also fit once compressed
+        if (epb.bytesAvail <= ZLIBHEX_OVERHEAD) {
+            return 0;
+        }
+        EncoderPB tileEpb = epb;
+        tileEpb.bytesAvail -= ZLIBHEX_OVERHEAD;
+        const unsigned long len = encodeTile(tileEpb);
+        if (len <= ZLIBHEX_MIN_COMP_SIZE) {
+            return len;
+        }
+
+        unsigned char *tile = epb.dst;
+        const Boolean isRaw = tile[0] & Raw;
+        const unsigned char stream = isRaw ? ZlibHexRawStream : ZlibHexEncodedStream;
+        if (VNCEncoder::getStream(stream) != stream) {
+            return len;
+        }
+
+        // A compressor which runs out of room leaves its stream in a state
+        // the client cannot follow, so the tile is only compressed when the
+        // worst case fits, and is otherwise sent as plain Hextile
+        unsigned char compressed[1 + 256 * 4 + 256 * 4 / 8 + ZLIBHEX_OVERHEAD];
+        const unsigned long room = min(sizeof(compressed), epb.bytesAvail - 3);
+        if (VNCEncoder::compressBound(len - 1) > room) {
+            return len;
+        }
+        const unsigned long zLen = VNCEncoder::compressStream(stream, tile + 1, len - 1, compressed, room);
+        if (zLen == 0) {
+            dprintf("Failed to compress ZlibHex tile\n");
+            vncState = VNC_ERROR;
+            return len;
+        }
+
+        tile[0] = isRaw ? ZlibRaw : (tile[0] | ZlibHex);
+        tile[1] = zLen >> 8;
+        tile[2] = zLen & 0xFF;
+        BlockMove(compressed, tile + 3, zLen);
+        return 3 + zLen;
+    }
 #endif
@@ -23,9 +23,11 @@
 class VNCEncodeHextile {
     public:
         static Size minBufferSize();
+        static Size minZlibBufferSize();
 
         static void begin();
         static unsigned long encodeSolidTile(const EncoderPB &epb);
         static unsigned long encodeTile(const EncoderPB &epb);
+        static unsigned long encodeZlibTile(const EncoderPB &epb);
 };
 
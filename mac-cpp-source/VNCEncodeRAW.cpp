@@ -30,8 +30,13 @@ void VNCEncodeRaw::begin() {
 }
 
 Boolean VNCEncodeRaw::getChunk(EncoderPB &epb) {
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    // Rows are sent as they are on the screen, at 8 bits or more per pixel
+    const unsigned long rowBytes = (unsigned long)fbUpdateRect.w * fbDepth / 8;
     const unsigned char *src = VNCFrameBuffer::getPixelAddr(fbUpdateRect.x, fbUpdateRect.y + line);
-    BlockMove(src, epb.dst, fbUpdateRect.w);
-    epb.bytesWritten = fbUpdateRect.w;
+    BlockMove(src, epb.dst, rowBytes);
+    epb.bytesWritten = rowBytes;
     return ++line < h;
 }
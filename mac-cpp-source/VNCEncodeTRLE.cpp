@@ -93,6 +93,9 @@
 
 #define UPDATE_BUFFER_SIZE 2050
 
+#define RLE_SCRATCH_SIZE   4096 // Room for the runs, after the native tile
+#define RLE_OVERSHOOT        24 // nativeToRle() may write one run past the stop
+
 #define HAS_LAST_PALETTE  ALLOW_PALETTE_REUSE && (USE_PACKED_PALETTE || USE_RLE_TILES)
 
 #define src32 ((unsigned long*)src)
@@ -175,12 +178,16 @@ void VNCEncodeTRLE::begin() {
     }
 
     unsigned long VNCEncodeTRLE::encodeSolidTile(const EncoderPB &epb) {
-        const unsigned char mask  = ((1 << fbDepth) - 1);
-        const unsigned char color = epb.src[0] & mask;
         unsigned char *dst = epb.dst;
         *dst++ = TileSolid;
         setupCPIXEL();
-        emitColor(dst, color);
+        if (fbDepth > 8) {
+            dst = VNCPalette::emitDirectColor(dst, DIRECT_PIXEL(epb.src, fbDepth == 16));
+        } else {
+            const unsigned char mask  = ((1 << fbDepth) - 1);
+            const unsigned char color = epb.src[0] & mask;
+            emitColor(dst, color);
+        }
         return dst - epb.dst;
     }
 
@@ -190,7 +197,7 @@ void VNCEncodeTRLE::begin() {
         const unsigned char *start = epb.dst;
         unsigned char *dst = epb.dst;
 
-        unsigned char scratchSpace[4096 * 2 + ALIGN_PAD];
+        unsigned char scratchSpace[4096 + RLE_SCRATCH_SIZE + ALIGN_PAD];
         unsigned char *nativeTile = ALIGN_LONG(scratchSpace);
         unsigned char    *rleTile = nativeTile + 4096;
         unsigned char    *rleEnd  = rleTile;
@@ -319,8 +326,11 @@ void VNCEncodeTRLE::begin() {
                     info->colorSize = 1;
                     info->packRuns  = true;
                 }
-                const unsigned long rleLen = nativeToRle(nativeTile, nativeEnd, rleTile, rleTile + shortestLen, fbDepth, info);
-                if ((1 + rleLen) < shortestLen) {
+                // The runs must also fit the scratch space, which is smaller than
+                // a raw 64x64 tile for a true color client
+                const unsigned long rleStop = min(shortestLen, RLE_SCRATCH_SIZE - RLE_OVERSHOOT);
+                const unsigned long rleLen = nativeToRle(nativeTile, nativeEnd, rleTile, rleTile + rleStop, fbDepth, info);
+                if (((1 + rleLen) < shortestLen) && (rleLen <= rleStop)) {
                     rleEnd = rleTile + rleLen;
                     if (emitPlainRLE) {
                         shortestTile = TileRLE;
@@ -425,29 +435,8 @@ void VNCEncodeTRLE::begin() {
 
             switch(shortestTile) {
                 case TileRaw: {
-                    const Boolean canEmitNativeTileAsRaw = (fbDepth == 8) && (!fbPixFormat.trueColor);
-                    if(canEmitNativeTileAsRaw) {
-                        BlockMove(nativeTile,dst,nativeLen);
-                        dst += nativeLen;
-                    } else {
-                        // Emit a raw tile
-                        src = nativeTile;
-                        // Rewrite the tile with expanded colors
-                        const unsigned char rsft = 32 - fbDepth;
-                        const unsigned long lmask = ((unsigned long)-1) << rsft; // Mask for leftmost color in block
-                        unsigned char bitsLeft = 0;
-                        unsigned long packed;
-                        unsigned short pixels = epb.rows * epb.cols;
-                        do {
-                            if(bitsLeft == 0) {
-                                packed = *src32++;
-                                bitsLeft = 32;
-                            }
-                            emitColor(dst, (packed & lmask) >> rsft);
-                            packed <<= fbDepth;
-                            bitsLeft -= fbDepth;
-                        } while(--pixels);
-                    }
+                    // Expand the tile with the routine chosen for the depth and pixel format
+                    dst = VNCPalette::expandTile(nativeTile, dst, epb.rows * epb.cols);
                     break;
                 }
                 case TilePacked:
@@ -485,7 +474,7 @@ void VNCEncodeTRLE::begin() {
                         // Need to scan through the tile emitting true color values
                         for (unsigned char *c = rleTile; c < rleEnd;) {
                             // Write out the color
-                            emitColor(dst, *c);
+                            emitTileColor(dst, *c);
                             c += info->colorSize;
                             // Copy the count bytes
                             while ((*dst++ = *c++) == 255);
@@ -504,7 +493,7 @@ void VNCEncodeTRLE::begin() {
                         for (unsigned char *c = rleTile; c < rleEnd;) {
                             const unsigned char rleVal = *c++;
                             // Write out the color
-                            emitColor(dst, mapColors ? info->colorPal[rleVal & 0x7F] : rleVal & 0x7F);
+                            emitTileColor(dst, mapColors ? info->colorPal[rleVal & 0x7F] : rleVal & 0x7F);
                             #if USE_SANITY_CHECKS
                                 shortestLen += bytesPerColor - 1;
                             #endif
@@ -547,4 +536,188 @@ void VNCEncodeTRLE::begin() {
         return dst - start;
     }
 
+    /* At thousands or millions of colors, the tiles are encoded from the
+     * pixels on the screen, rather than from color indices. The tile is
+     * first copied from the screen, when it fits in the scratch space, so
+     * that video memory is read only once. The colors and runs are then
+     * found, and the shortest of the TRLE tile types is written, with each
+     * color translated by emitDirectColor(). Palettes are not reused.
+     */
+
+    static unsigned char *emitDirectRun(unsigned char *dst, const DirectColorInfo *info, Boolean withPalette, unsigned long color, unsigned short runLen);
+    static unsigned char *emitDirectRun(unsigned char *dst, const DirectColorInfo *info, Boolean withPalette, unsigned long color, unsigned short runLen) {
+        if (!withPalette) {
+            dst = VNCPalette::emitDirectColor(dst, color);
+        } else if (runLen == 1) {
+            *dst++ = findDirectColor(info, color);
+            return dst;
+        } else {
+            *dst++ = findDirectColor(info, color) | 0x80;
+        }
+        // Copy the count bytes
+        runLen--;
+        while (runLen >= 255) {
+            runLen -= 255;
+            *dst++ = 255;
+        }
+        *dst++ = runLen;
+        return dst;
+    }
+
+    unsigned long VNCEncodeTRLE::encodeDirectTile(const EncoderPB &epb) {
+        #ifdef VNC_FB_BITS_PER_PIX
+            const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+        #endif
+        #ifdef VNC_BYTES_PER_LINE
+            const unsigned long fbStride = VNC_BYTES_PER_LINE;
+        #endif
+        const Boolean is16 = (fbDepth == 16);
+        const unsigned char pixBytes = fbDepth / 8;
+        const unsigned short rowBytes = epb.cols * pixBytes;
+        const unsigned long pixels = (unsigned long)epb.cols * epb.rows;
+        unsigned char *dst = epb.dst;
+
+        unsigned char scratchSpace[4096 * 2 + sizeof(unsigned long)];
+        const unsigned char *src = epb.src;
+        unsigned long stride = fbStride;
+        if (pixels * pixBytes <= 4096 * 2) {
+            unsigned char *nativeTile = ALIGN_LONG(scratchSpace);
+            screenToNative(epb.src, nativeTile, epb.rows, epb.cols, 0);
+            src = nativeTile;
+            stride = rowBytes;
+        }
+
+        setupCPIXEL();
+
+        DirectColorInfo info;
+        nativeToDirectColors(src, stride, epb.rows, epb.cols, &info);
+
+        // Work out the shortest tile type
+
+        unsigned char shortestTile = TileRaw;
+        unsigned long shortestLen = 1 + pixels * bytesPerColor;
+        unsigned char tileDepth = 0;
+        const unsigned long paletteLen = info.nColors * bytesPerColor;
+
+        if (info.nColors == 1) {
+            shortestTile = TileSolid;
+            shortestLen  = 1 + bytesPerColor;
+        } else {
+            #if USE_PACKED_PALETTE
+                if (info.nColors <= 16) {
+                    tileDepth = getDepth(info.nColors);
+                    const unsigned long packedTileLen = 1 + paletteLen + ((epb.cols * tileDepth + 7) / 8) * epb.rows;
+                    if (packedTileLen < shortestLen) {
+                        shortestTile = TilePacked;
+                        shortestLen  = packedTileLen;
+                    }
+                }
+            #endif
+            #if USE_RLE_TILES
+                const unsigned long rleTileLen = 1 + info.nRuns * bytesPerColor + info.countBytes;
+                if (rleTileLen < shortestLen) {
+                    shortestTile = TileRLE;
+                    shortestLen  = rleTileLen;
+                }
+                if (info.nColors <= 127) {
+                    const unsigned long rlePaletteLen = 1 + paletteLen + info.nRuns + info.countBytes - info.runsOfOne;
+                    if (rlePaletteLen < shortestLen) {
+                        shortestTile = TileRLEPalette;
+                        shortestLen  = rlePaletteLen;
+                    }
+                }
+            #endif
+        }
+
+        // Abort if there is not enough room in the destination buffer to
+        // write the tile
+
+        if (shortestLen > epb.bytesAvail) {
+            return 0;
+        }
+
+        // Emit the tile header and palette
+
+        if ((shortestTile == TilePacked) || (shortestTile == TileRLEPalette)) {
+            *dst++ = info.nColors | (shortestTile & TileRLE);
+            for (unsigned char i = 0; i < info.nColors; i++) {
+                dst = VNCPalette::emitDirectColor(dst, info.colorPal[i]);
+            }
+        } else {
+            *dst++ = shortestTile;
+        }
+
+        // Emit the pixels
+
+        switch (shortestTile) {
+            case TileSolid:
+                dst = VNCPalette::emitDirectColor(dst, info.colorPal[0]);
+                break;
+            case TileRaw:
+                if (VNCPalette::isNativeLayout() && fbPixFormat.bigEndian && (bytesPerColor == pixBytes)) {
+                    // The client takes the pixels as they are on the screen
+                    for (unsigned char y = 0; y < epb.rows; y++, src += stride) {
+                        BlockMove(src, dst, rowBytes);
+                        dst += rowBytes;
+                    }
+                } else {
+                    for (unsigned char y = 0; y < epb.rows; y++, src += stride) {
+                        const unsigned char *pix = src;
+                        for (unsigned char x = 0; x < epb.cols; x++, pix += pixBytes) {
+                            dst = VNCPalette::emitDirectColor(dst, DIRECT_PIXEL(pix, is16));
+                        }
+                    }
+                }
+                break;
+            case TilePacked:
+                for (unsigned char y = 0; y < epb.rows; y++, src += stride) {
+                    const unsigned char *pix = src;
+                    unsigned char bits = 0, bitsLeft = 8;
+                    for (unsigned char x = 0; x < epb.cols; x++, pix += pixBytes) {
+                        bitsLeft -= tileDepth;
+                        bits |= findDirectColor(&info, DIRECT_PIXEL(pix, is16)) << bitsLeft;
+                        if (bitsLeft == 0) {
+                            *dst++ = bits;
+                            bits = 0;
+                            bitsLeft = 8;
+                        }
+                    }
+                    if (bitsLeft != 8) {
+                        *dst++ = bits;
+                    }
+                }
+                break;
+            case TileRLE:
+            case TileRLEPalette: {
+                const Boolean withPalette = (shortestTile == TileRLEPalette);
+                unsigned long runColor = 0;
+                unsigned short runLen = 0;
+                for (unsigned char y = 0; y < epb.rows; y++, src += stride) {
+                    const unsigned char *pix = src;
+                    for (unsigned char x = 0; x < epb.cols; x++, pix += pixBytes) {
+                        const unsigned long color = DIRECT_PIXEL(pix, is16);
+                        if ((color == runColor) && runLen) {
+                            runLen++;
+                            continue;
+                        }
+                        if (runLen) {
+                            dst = emitDirectRun(dst, &info, withPalette, runColor, runLen);
+                        }
+                        runColor = color;
+                        runLen = 1;
+                    }
+                }
+                dst = emitDirectRun(dst, &info, withPalette, runColor, runLen);
+                break;
+            }
+        }
+
+        #if USE_SANITY_CHECKS
+            if (shortestLen != (dst - epb.dst)) {
+                dprintf("Incorrect direct tile %d length: %ld != %ld\n", epb.dst[0], shortestLen, (dst - epb.dst));
+            }
+        #endif
+        return dst - epb.dst;
+    }
+
 #endif
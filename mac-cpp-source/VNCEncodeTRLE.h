@@ -29,5 +29,6 @@ class VNCEncodeTRLE {
 
         static unsigned long encodeSolidTile(const EncoderPB &epb);
         static unsigned long encodeTile(const EncoderPB &pb);
+        static unsigned long encodeDirectTile(const EncoderPB &epb);
 };
 
@@ -19,25 +19,261 @@
 #include "VNCPalette.h"
 #include "VNCFrameBuffer.h"
 #include "VNCEncodeTight.h"
-
-
-#define ROL(A,B) ((A << B) | (A >> (sizeof(A)*8 - B)))
-#define ROR(A,B) ((A >> B) | (A << (sizeof(A)*8 - B)))
-#define src16 ((unsigned short*)src)
-#define dst16 ((unsigned short*)dst)
-#define src32 ((unsigned long*)src)
+#include "DebugLog.h"
+
+#if !defined(VNC_FB_MONOCHROME)
+
+/* The Tight encoder sends each subrect as a fill when it is a solid color,
+ * as a palette when it has two colors (packed as one bit per pixel) or when
+ * the client uses true color, and otherwise as raw indexed pixels. Each kind
+ * of data goes to its own ZLib stream so that the compression dictionaries
+ * are not mixed. The pixel data for each subrect is gathered in a scratch
+ * area following the output area in the update buffer.
+ *
+ * TightPNG clients take only fills and PNG images, so in that mode, all
+ * subrects that are not a solid color are sent as indexed color PNGs. The
+ * PNG scanlines are packed in a second scratch area.
+ */
+
+#define TIGHT_OUT_SIZE        6144L
+#define TIGHT_MIN_TO_COMPRESS 12
+
+#define TIGHT_PIX_SIZE        (TIGHT_SUBRECT_SIZE * TIGHT_SUBRECT_SIZE)
+#define TIGHT_PNG_SIZE        (TIGHT_SUBRECT_SIZE * TIGHT_SUBRECT_SIZE + TIGHT_SUBRECT_SIZE)
+
+// Tight compression control values
+enum {
+    TightBasic          = 0x00,
+    TightExplicitFilter = 0x40,
+    TightFill           = 0x80,
+    TightPNG            = 0xA0
+};
+
+// Tight filter ids
+enum {
+    TightCopyFilter     = 0,
+    TightPaletteFilter  = 1
+};
+
+// The ZLib stream used for each kind of data
+enum {
+    TightRawStream      = 0,
+    TightMonoStream     = 1,
+    TightPaletteStream  = 2
+};
 
 extern int tile_x, tile_y;
+extern unsigned long *vncTrueColors;
 
 Size VNCEncodeTight::minBufferSize() {
-    return 0;
+    return TIGHT_OUT_SIZE + TIGHT_PIX_SIZE + TIGHT_PNG_SIZE;
 }
 
 void VNCEncodeTight::begin() {
     tile_x = tile_y = 0;
 }
 
-#define src32 ((unsigned long*)src)
+// Packs palette indices for a two color subrect into one bit per pixel,
+// with each row padded to a whole byte. Returns the packed length.
+
+static unsigned long packMono(const unsigned char *data, unsigned char *packed, unsigned int cols, unsigned int rows) {
+    const unsigned char *src = data;
+    unsigned char *dst = packed;
+    for (unsigned int y = 0; y < rows; y++) {
+        unsigned char bits = 0;
+        for (unsigned int x = 0; x < cols; x++) {
+            bits = (bits << 1) | *src++;
+            if ((x & 7) == 7) {
+                *dst++ = bits;
+                bits = 0;
+            }
+        }
+        if (cols & 7) {
+            *dst++ = bits << (8 - (cols & 7));
+        }
+    }
+    return dst - packed;
+}
+
+// Writes the compact length of data that was written three bytes past
+// dst, sliding the data down to follow it. Returns the end of the data.
+
+static unsigned char *emitCompact(unsigned char *dst, unsigned long len) {
+    unsigned char *start = dst + 3;
+    unsigned long remainder = len;
+    for (;;) {
+        *dst = remainder & 0x7F;
+        remainder >>= 7;
+        if (remainder == 0) break;
+        *dst++ |= 0x80;
+    }
+    dst++;
+    BlockMove(start, dst, len);
+    return dst + len;
+}
+
+// Writes data to dst, compressing it if it is long enough for Tight to
+// require it. Returns the end of the written data, or NULL on failure.
+
+static unsigned char *emitData(unsigned char *dst, unsigned char stream, const unsigned char *data, unsigned long len) {
+    if (len < TIGHT_MIN_TO_COMPRESS) {
+        BlockMove(data, dst, len);
+        return dst + len;
+    }
+
+    // Compress leaving room for the longest compact length
+    const unsigned long avail = TIGHT_OUT_SIZE - (dst - fbUpdateBuffer) - 3;
+    const unsigned long compressed = VNCEncoder::compressStream(stream, data, len, dst + 3, avail);
+    if (compressed == 0) {
+        return NULL;
+    }
+    return emitCompact(dst, compressed);
+}
+
+// Writes the subrect using the copy filter on the raw stream, right after
+// the streams were reset. The pixels are converted and compressed a row at
+// a time, as they can take more room than the scratch area. Returns the end
+// of the written data, or NULL on failure.
+
+static unsigned char *emitCopy(unsigned char *dst, const unsigned char *data, const unsigned char *cPal, unsigned int cols, unsigned int rows) {
+    const unsigned char stream = VNCEncoder::getStream(TightRawStream);
+    *dst++ = (stream << 4) | TightBasic | VNCEncoder::takeTightResets();
+
+    unsigned char pixels[TIGHT_SUBRECT_SIZE * 4];
+    unsigned char *pixel = pixels;
+
+    // Data shorter than TIGHT_MIN_TO_COMPRESS must be sent uncompressed
+    emitColor(pixel, cPal[0]);
+    if ((pixel - pixels) * cols * rows < TIGHT_MIN_TO_COMPRESS) {
+        for (unsigned long i = cols * rows; i; i--) {
+            emitColor(dst, cPal[*data++]);
+        }
+        return dst;
+    }
+
+    unsigned long compressed = 0;
+    for (unsigned int y = 0; y < rows; y++) {
+        pixel = pixels;
+        for (unsigned int x = 0; x < cols; x++) {
+            emitColor(pixel, cPal[*data++]);
+        }
+        unsigned char *out = dst + 3 + compressed;
+        const unsigned long len = VNCEncoder::compressStream(stream, pixels, pixel - pixels, out, TIGHT_OUT_SIZE - (out - fbUpdateBuffer));
+        if (len == 0) {
+            return NULL;
+        }
+        compressed += len;
+    }
+    return emitCompact(dst, compressed);
+}
+
+/* PNG writing routines */
+
+static unsigned char *putLong(unsigned char *dst, unsigned long value) {
+    *dst++ = value >> 24;
+    *dst++ = value >> 16;
+    *dst++ = value >> 8;
+    *dst++ = value;
+    return dst;
+}
+
+// Writes the header of a PNG chunk, leaving the length to be filled in
+// by endChunk once the chunk data has been written
+
+static unsigned char *beginChunk(unsigned char *dst, const char *type) {
+    dst = putLong(dst, 0);
+    BlockMove(type, dst, 4);
+    return dst + 4;
+}
+
+static unsigned char *endChunk(unsigned char *chunk, unsigned char *end) {
+    putLong(chunk, end - chunk - 8);
+    return putLong(end, VNCEncoder::checksumPNG(chunk + 4, end - chunk - 4));
+}
+
+// Writes the 8-bit RGB value of a color, as recovered from the true color
+// table, since PNG palettes do not follow the client pixel format
+
+static unsigned char *emitRGB(unsigned char *dst, unsigned char color) {
+    unsigned long c = vncTrueColors[color];
+    if (!fbPixFormat.bigEndian) {
+        c = ((c & 0x000000ff) << 24u) |
+            ((c & 0x0000ff00) << 8u)  |
+            ((c & 0x00ff0000) >> 8u)  |
+            ((c & 0xff000000) >> 24u);
+    }
+    *dst++ = ((c >> fbPixFormat.redShift)   & fbPixFormat.redMax)   * 255 / fbPixFormat.redMax;
+    *dst++ = ((c >> fbPixFormat.greenShift) & fbPixFormat.greenMax) * 255 / fbPixFormat.greenMax;
+    *dst++ = ((c >> fbPixFormat.blueShift)  & fbPixFormat.blueMax)  * 255 / fbPixFormat.blueMax;
+    return dst;
+}
+
+// Writes an indexed color PNG of the palette indices in data, using the
+// smallest bit depth that will hold the palette. Returns the end of the
+// PNG, or NULL on failure.
+
+static unsigned char *emitPNG(unsigned char *dst, const unsigned char *data, unsigned int cols, unsigned int rows, const unsigned char *cPal, unsigned int nColors) {
+    static const unsigned char signature[] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+
+    const unsigned char bitDepth = (nColors <= 2) ? 1 : (nColors <= 4) ? 2 : (nColors <= 16) ? 4 : 8;
+
+    // Pack the scanlines, each preceded by a filter type of none
+
+    unsigned char *lines = fbUpdateBuffer + TIGHT_OUT_SIZE + TIGHT_PIX_SIZE;
+    unsigned char *line  = lines;
+    for (unsigned int y = 0; y < rows; y++) {
+        *line++ = 0;
+        unsigned char bits = 0, nBits = 0;
+        for (unsigned int x = 0; x < cols; x++) {
+            bits = (bits << bitDepth) | *data++;
+            nBits += bitDepth;
+            if (nBits == 8) {
+                *line++ = bits;
+                bits = nBits = 0;
+            }
+        }
+        if (nBits) {
+            *line++ = bits << (8 - nBits);
+        }
+    }
+
+    // Write out the chunks
+
+    BlockMove(signature, dst, sizeof(signature));
+    dst += sizeof(signature);
+
+    unsigned char *chunk = dst;
+    dst = beginChunk(dst, "IHDR");
+    dst = putLong(dst, cols);
+    dst = putLong(dst, rows);
+    *dst++ = bitDepth;
+    *dst++ = 3; // Indexed color
+    *dst++ = 0; // Deflate compression
+    *dst++ = 0; // Adaptive filtering
+    *dst++ = 0; // No interlace
+    dst = endChunk(chunk, dst);
+
+    chunk = dst;
+    dst = beginChunk(dst, "PLTE");
+    for (unsigned int i = 0; i < nColors; i++) {
+        dst = emitRGB(dst, cPal[i]);
+    }
+    dst = endChunk(chunk, dst);
+
+    chunk = dst;
+    dst = beginChunk(dst, "IDAT");
+    // Leave room for the IDAT checksum and the IEND chunk
+    const unsigned long avail = TIGHT_OUT_SIZE - (dst - fbUpdateBuffer) - 16;
+    const unsigned long len = VNCEncoder::compressPNG(lines, line - lines, dst, avail);
+    if (len == 0) {
+        return NULL;
+    }
+    dst = endChunk(chunk, dst + len);
+
+    chunk = dst;
+    dst = beginChunk(dst, "IEND");
+    return endChunk(chunk, dst);
+}
 
 Boolean VNCEncodeTight::getChunk(wdsEntry *wds) {
     #ifdef VNC_FB_BITS_PER_PIX
@@ -47,161 +283,116 @@ Boolean VNCEncodeTight::getChunk(wdsEntry *wds) {
         const unsigned long fbStride = VNC_BYTES_PER_LINE;
     #endif
 
-    const int stripeWidth = 32;
-    const int longsPerRow = stripeWidth * fbDepth / 8 / sizeof(unsigned long);
-
-    const int tile_top = tile_y;
+    const unsigned int cols = min(TIGHT_SUBRECT_SIZE, fbUpdateRect.w - tile_x);
+    const unsigned int rows = min(TIGHT_SUBRECT_SIZE, fbUpdateRect.h - tile_y);
+    const unsigned int x    = fbUpdateRect.x + tile_x;
 
-    const unsigned char numPix = sizeof(unsigned long) * 8 / fbDepth;
-    const unsigned long rmask = (1 << fbDepth) - 1; // Mask for rightmost color in block
+    // Unpack the subrect into palette indices, building the palette
 
-    const unsigned char *src = VNCFrameBuffer::getPixelAddr(fbUpdateRect.x + tile_x, fbUpdateRect.y + tile_y);
-    unsigned long colors = *src32;
-    unsigned char lastColor = ROL(colors,fbDepth) & rmask;
+    unsigned short cMap[256] = {0}; // Palette index plus one for each color
+    unsigned char  cPal[256];
+    unsigned int   nColors = 0;
 
-    unsigned char cMap[256] = {0};
-    unsigned char cPal[256] = {lastColor};
-    unsigned char cIndx = 0;
-    unsigned char extraColors = 0; // Count of colors - 1
+    unsigned char *data = fbUpdateBuffer + TIGHT_OUT_SIZE;
+    unsigned char *pix  = data;
 
-    unsigned char consecutive_rows = 0;
-    unsigned char row_1st_cidx = lastColor;
-    unsigned char row_2nd_cidx = lastColor;
+    const unsigned char mask = (1 << fbDepth) - 1;
+    const unsigned char skip = (x * fbDepth) & 7;
+    const unsigned char *row = VNCFrameBuffer::getPixelAddr(x, fbUpdateRect.y + tile_y);
 
-    const unsigned char* row_src = src;
-    const unsigned char* row_end = src + longsPerRow * sizeof(unsigned long);
-
-restartRow:
-    unsigned short outBits = 1;
-    unsigned char *dst = fbUpdateBuffer;
-    Boolean firstRowPixel = true;
-
-    src = row_src;
-
-    for(;;) {
-        colors = *src32++;
-
-        unsigned char n = numPix - 1;
-        do {
-            // Extract left-most color value
-            colors = ROL(colors, fbDepth);
-            const unsigned char color = colors & rmask;
-
-            // Process the color
-            if (color != lastColor) {
-                lastColor = color;
-
-                // Perform color mapping
-                cIndx = cMap[color];
-                if ((cIndx == 0) && (color != cPal[0])) {
-                    // Add new color to color table
-                    cIndx = ++extraColors;
-                    cMap[color] = cIndx;
-                    cPal[cIndx] = color;
-
-                    // If we have a color we have not seen before...
-                    if (extraColors < 3) {
-                        if (tile_y != tile_top) {
-                            // ...emit previous rows as a solid or two-color tile?
-                            goto emitTile;
-                        } else {
-                            // Re-emit the row
-                            goto restartRow;
-                        }
-                    }
-                }
-
-                // Keep tally of consecutive solid rows
-                if (consecutive_rows && (cIndx != row_1st_cidx) && (cIndx != row_2nd_cidx)) {
-                    if (row_1st_cidx == row_2nd_cidx) {
-                        row_1st_cidx = cIndx;
-                    } else {
-                        consecutive_rows = 0;
-                    }
-                }
+    for (unsigned int y = 0; y < rows; y++, row += fbStride) {
+        const unsigned char *src = row;
+        unsigned char bits = *src++ << skip;
+        unsigned char bitsLeft = 8 - skip;
+        for (unsigned int n = cols; n; n--) {
+            if (bitsLeft == 0) {
+                bits = *src++;
+                bitsLeft = 8;
             }
-
-            if (firstRowPixel) {
-                firstRowPixel = false;
-                // Write out the row of pixels
-                if (consecutive_rows++ == 0) {
-                    row_1st_cidx = cIndx;
-                    row_2nd_cidx = cIndx;
-                }
+            const unsigned char color = (bits >> (8 - fbDepth)) & mask;
+            bits <<= fbDepth;
+            bitsLeft -= fbDepth;
+            if (cMap[color] == 0) {
+                cPal[nColors++] = color;
+                cMap[color] = nColors;
             }
+            *pix++ = cMap[color] - 1;
+        }
+    }
 
-            /* If we have a solid tile, don't write out anything
-               ...if we are a two-color tile, write out a bit per color
-               ...otherwise write out a full byte per color.
-             */
-            if (extraColors != 0) {
-                if (extraColors == 1) {
-                    // Write out colors as bits
-                    outBits = (outBits << 1) | cIndx;
-                    if (outBits & 0x10) {
-                        *dst++ = outBits;
-                        outBits = 1;
-                    }
-                } else {
-                    // Write out indices as bytes
-                    *dst++ = cIndx;
-                }
-            }
-        } while (--n != -1);
+    // Encode the subrect
+
+    setupCPIXEL();
 
-        #if SANITY_CHECK
-            if (outBits != 1) {
-                dprintf("Stripe width not a multiple of 8 pixels\n");
+    unsigned char *dst = fbUpdateBuffer;
+    const unsigned char resets = VNCEncoder::takeTightResets();
+
+    if ((nColors > 1) && (selectedEncoder == mTightPNGEncoding)) {
+        *dst++ = TightPNG | resets;
+        unsigned char *end = emitPNG(dst + 3, data, cols, rows, cPal, nColors);
+        dst = end ? emitCompact(dst, end - (dst + 3)) : NULL;
+    } else if (nColors > 1) {
+        // The palette indices are kept in case the subrect must be resent
+        unsigned char *packed = fbUpdateBuffer + TIGHT_OUT_SIZE + TIGHT_PIX_SIZE;
+        unsigned long len = cols * rows;
+        unsigned char stream;
+        Boolean usePalette = true;
+        if (nColors == 2) {
+            stream = TightMonoStream;
+            len = packMono(data, packed, cols, rows);
+        } else if (fbPixFormat.trueColor) {
+            stream = TightPaletteStream;
+            packed = data;
+        } else {
+            // For indexed clients, the pixels are no larger than palette
+            // indices, so it is best to send them as is
+            stream = TightRawStream;
+            usePalette = false;
+            for (unsigned int i = 0; i < len; i++) {
+                packed[i] = cPal[data[i]];
             }
-        #endif
-
-        if (src == row_end) {
-            // Move to the next row
-            row_src += fbStride;
-            row_end += fbStride;
-            src = row_src;
-            if (++tile_y == fbUpdateRect.h) {
-                break;
+        }
+        stream = VNCEncoder::getStream(stream);
+
+        *dst++ = (stream << 4) | (usePalette ? TightExplicitFilter : TightBasic) | resets;
+        if (usePalette) {
+            *dst++ = TightPaletteFilter;
+            *dst++ = nColors - 1;
+            for (unsigned int i = 0; i < nColors; i++) {
+                emitColor(dst, cPal[i]);
             }
-            firstRowPixel = true;
         }
-    } // for(;;)
 
-emitTile:
-    const size_t pixelDataLen = dst - fbUpdateBuffer;
-
-    if (extraColors == 0) {
-        *dst++ = 0x80;        // Fill compression
-        *dst++ = 255;         // Red
-        *dst++ = 255;         // Green
-        *dst++ = 255;         // Blue
-        return 4;
+        dst = emitData(dst, stream, packed, len);
     } else {
-        // Compute the compact data length represenation
-        unsigned char lenData[4], lenSize = 0;
-        for (size_t remainder = pixelDataLen; remainder; remainder >>= 7) {
-            lenData[lenSize++] = remainder & 0x7F;
-        }
-
-        // Make space for the header
-        const size_t headerSize = 3 + 3 * (extraColors + 1) + lenSize + pixelDataLen;
-        BlockMove (fbUpdateBuffer, fbUpdateBuffer + headerSize, pixelDataLen);
+        *dst++ = TightFill | resets;
+        emitColor(dst, cPal[0]);
+    }
 
-        // Write out the header
+    if ((dst == NULL) && (selectedEncoder != mTightPNGEncoding)) {
+        // The stream can no longer be trusted, so have the client reset
+        // all the streams and send the pixels as they are
+        dprintf("Failed to compress Tight subrect, sending it with the copy filter\n");
+        VNCEncoder::compressReset();
+        dst = emitCopy(fbUpdateBuffer, data, cPal, cols, rows);
+    }
+    if (dst == NULL) {
+        // Nothing fit, or this is TightPNG, which has no copy filter
+        dprintf("Unable to send Tight subrect\n");
+        vncState = VNC_ERROR;
         dst = fbUpdateBuffer;
-        *dst++ = 0x40;        // Basic compression
-        *dst++ = 1;           // PaletteFilter
-        *dst++ = extraColors; // Number of colors minus 1
-        for (int i = 0; i <= extraColors; i++) {
-            emitColor (dst, i);
-        }
-        BlockMove (lenData, dst, lenSize);
     }
 
-    // Prepare to advance to the next tile
-    if (tile_y == fbUpdateRect.h) {
-        tile_y = 0;
-        tile_x += stripeWidth;
+    wds->ptr = (Ptr) fbUpdateBuffer;
+    wds->length = dst - fbUpdateBuffer;
+
+    // Advance to the next subrect
+    tile_x += TIGHT_SUBRECT_SIZE;
+    if (tile_x >= fbUpdateRect.w) {
+        tile_x = 0;
+        tile_y += TIGHT_SUBRECT_SIZE;
     }
-    return tile_x >= fbUpdateRect.h;
+    return tile_y < fbUpdateRect.h;
 }
+
+#endif
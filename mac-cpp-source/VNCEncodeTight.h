@@ -20,6 +20,10 @@
 #include "MacTCP.h"
 #include "VNCEncoder.h"
 
+// Each Tight rectangle is divided into subrects no larger than this
+
+#define TIGHT_SUBRECT_SIZE 64
+
 class VNCEncodeTight {
     public:
         static Size minBufferSize();
@@ -27,4 +31,3 @@ class VNCEncodeTight {
 
         static Boolean getChunk(wdsEntry *wds);
 };
-
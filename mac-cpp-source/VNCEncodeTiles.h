@@ -17,7 +17,9 @@
 
 #pragma once
 
-#define USE_ASM_CODE 1
+#ifndef USE_ASM_CODE
+    #define USE_ASM_CODE 1
+#endif
 
 struct ColorInfo {
     unsigned char colorPal[127];
@@ -28,7 +30,27 @@ struct ColorInfo {
     unsigned char packRuns;
 };
 
+/* At thousands or millions of colors, there are too many colors to tally
+ * with a bit-field, so the colors of a tile are found in a hash table, up
+ * to the 127 colors that a palette can hold. The runs are counted at the
+ * same time, so that the length of each kind of tile can be worked out.
+ */
+
+struct DirectColorInfo {
+    unsigned long colorPal[127];
+    unsigned char colorHash[256];  // One more than the colorPal index, or zero
+    unsigned int  nColors;         // 128 if there are more than 127 colors
+    unsigned int  nRuns;
+    unsigned int  runsOfOne;
+    unsigned int  countBytes;      // Bytes needed for the lengths of all runs
+};
+
+// Reads a pixel at 16 or 32 bits, leaving out the unused top bits
+#define DIRECT_PIXEL(PTR,IS16) ((IS16) ? (*(const unsigned short*)(PTR) & 0x7FFF) : (*(const unsigned long*)(PTR) & 0x00FFFFFF))
+
 unsigned short screenToNative(const unsigned char *src, unsigned char *dst, short rows, short cols, ColorInfo *colorInfo);
 unsigned short nativeToRle(const unsigned char *src, unsigned char *end, unsigned char *dst, const unsigned char *stop, unsigned char depth, ColorInfo *cInfo);
 unsigned short nativeToPacked(const unsigned char *src, unsigned char *dst, const unsigned char* end, const char inDepth, const char outDepth, ColorInfo *colorInfo);
 unsigned short nativeToColors(const unsigned char *start, unsigned char *end, ColorInfo *colorInfo);
+unsigned short nativeToDirectColors(const unsigned char *src, unsigned long stride, short rows, short cols, DirectColorInfo *info);
+unsigned char  findDirectColor(const DirectColorInfo *info, unsigned long color);
@@ -26,7 +26,7 @@
  * change is done to the color values, i.e. they are stored exactly as in the "native" framebuffer.
  * The tile size in pixels is "rows" and "cols", but this function requires that each row be multiple
  * of 2 bytes -- i.e. a tile must be at least 16 pixels across in 1-bit mode, but may be as few as
- * two pixels across in 8-bit mode.
+ * two pixels across in 8-bit mode. Rows may be up to 256 bytes, or 64 pixels in 32-bit mode.
  *
  * The colorInfo argument is ignored.
  *
@@ -104,7 +104,9 @@ asm unsigned short screenToNative(const unsigned char *src, unsigned char *dst,
     move.w wordsInRow,tmp
     bclr #0,tmp
     neg.w tmp
-    lea lastMove(tmp), copyEntry
+    // The table is too long for an 8-bit index displacement
+    lea lastMove, copyEntry
+    adda.w tmp, copyEntry
 
     // Do we have an odd word left over?
     #define hasOddWord wordsInRow
@@ -118,7 +120,55 @@ copyTileRow:
     // Jump to address to copy the appropriate number of bytes
     jmp (copyEntry)
 
-    // A tile can have a max of 64 bytes per row
+    // A tile can have a max of 256 bytes per row
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
+    move.l (src)+,(dst)+
     move.l (src)+,(dst)+
     move.l (src)+,(dst)+
     move.l (src)+,(dst)+
@@ -309,12 +359,14 @@ wcrFindNextBit:
 
 // Add color to the colormap
 
+    // Only the index is masked, as nColors must count all 256 colors
+    move.w nCols,tmp
+    andi.w #0x7F,tmp
     // colorInfo->colorMap[color] = nColors & 0x7F;
-    move.b nCols, struct(ColorInfo.colorMap)(cInfo,color.w)
+    move.b tmp, struct(ColorInfo.colorMap)(cInfo,color.w)
     //colorInfo->colorPal[nColors & 0x7F] = color;
-    move.b color, struct(ColorInfo.colorPal)(cInfo,nCols.w)
+    move.b color, struct(ColorInfo.colorPal)(cInfo,tmp.w)
     addq.w #1,   nCols
-    andi.b #0x7F,nCols
 
     cmp.b immed32,offset // Have we tested all 32 color bits?
     bne wcrFindNextBit
@@ -871,16 +923,15 @@ writeRleReturn:
 writeRleLast:
     move.l dst, stop // done = true
 
-    // Adjustment for when we end up with 16 zero pixels as padding.
+    // Adjustment for when we end up with 16 zero pixels as padding. If
+    // the last run is made up of only the padding, it is left out.
     btst #30,pad_b30
     beq writeRle
 
-    cmp.w #15,rleCnt            // if(rleCnt < 15) goto skipLastRLEPair;
+    cmp.w #16,rleCnt            // if(rleCnt < 16) goto skipLastRLEPair;
     bcs skipLastRLEPair
 
     subi.w  #16,rleCnt
-    bne writeRle                // if(rleCnt == 0) runsOfOne--;
-    sub.l #0x0100,runsofOne
 
 writeRle:
     swap loopPair
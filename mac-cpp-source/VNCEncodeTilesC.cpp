@@ -17,6 +17,7 @@
 
 #include "VNCFrameBuffer.h"
 #include "VNCEncodeTiles.h"
+#include "DebugLog.h"
 
 #if !USE_ASM_CODE
 
@@ -24,7 +25,16 @@
 #define ROR(A,B) ((A >> B) | (A << (sizeof(A)*8 - B)))
 #define src16 ((unsigned short*)src)
 #define dst16 ((unsigned short*)dst)
-#define src32 ((unsigned long*)src)
+
+/* Longs are read and written in the byte order of the 68000. The host
+ * test harness, which may run on a machine that stores the least
+ * significant byte first, provides its own versions of these.
+ */
+
+#ifndef GET_LONG
+    #define GET_LONG(PTR)     (*(const unsigned long*)(PTR))
+    #define PUT_LONG(PTR,VAL) (*(unsigned long*)(PTR) = (VAL))
+#endif
 
 /**
  * With "src" pointing to the first byte of a tile on the screen, this function will copy the data
@@ -32,7 +42,7 @@
  * change is done to the color values, i.e. they are stored exactly as in the "native" framebuffer.
  * The tile size in pixels is "rows" and "cols", but this function requires that each row be multiple
  * of 2 bytes -- i.e. a tile must be at least 16 pixels across in 1-bit mode, but may be as few as
- * two pixels across in 8-bit mode.
+ * two pixels across in 8-bit mode. Rows may be up to 256 bytes, or 64 pixels in 32-bit mode.
  *
  * If colorInfo is provided, this function will also tally the colors. It operates four bytes at a time,
  * so when counting colors, this function may append up to two bytes of padding to the dst data buffer,
@@ -61,7 +71,9 @@ unsigned short screenToNative(const unsigned char *src, unsigned char *dst, shor
         char wordsLeftInRow = wordsInRow - 1;
         const unsigned short stride = fbStride - wordsInRow * sizeof(unsigned short);
         do {
-            *dst16++ = *src16++;
+            *dst16 = *src16;
+            dst += sizeof(unsigned short);
+            src += sizeof(unsigned short);
             if (--wordsLeftInRow == -1) {
                 src += stride;
                 wordsLeftInRow = wordsInRow - 1;
@@ -79,13 +91,14 @@ unsigned short screenToNative(const unsigned char *src, unsigned char *dst, shor
         if((dst - src) % sizeof(unsigned long)) {
             // Add padding
             *dst16 = *(dst16-1);
-            dst16++;
+            dst += sizeof(unsigned short);
         }
-        unsigned long colors, lastColors = ~*src32;
-        const unsigned char oneLessNumPix = sizeof(colors) * 8 / fbDepth - 1;
+        unsigned long lastColors = ~GET_LONG(src);
+        const unsigned char oneLessNumPix = sizeof(unsigned long) * 8 / fbDepth - 1;
         const unsigned long rmask = (1 << fbDepth) - 1; // Mask for rightmost color in block
         do {
-            unsigned long colors = *src32++;
+            unsigned long colors = GET_LONG(src);
+            src += sizeof(unsigned long);
             if(colors != lastColors) {
                 lastColors = colors;
                 // XOR the word with itself to see whether all colors are equal
@@ -161,10 +174,11 @@ unsigned short nativeToColors(const unsigned char *src, unsigned char *end, Colo
     if((end - src) % sizeof(unsigned long)) {
         // Add padding
         *end16 = *(end16-1);
-        end16++;
+        end += sizeof(unsigned short);
     }
     do {
-        unsigned long colors = *src32++;
+        unsigned long colors = GET_LONG(src);
+        src += sizeof(unsigned long);
         char n = oneLessNumPix;
         do {
             // Rotate the left-most color from the most
@@ -182,7 +196,7 @@ unsigned short nativeToColors(const unsigned char *src, unsigned char *end, Colo
      * Stage 2: Write out color table and color mapping table           *
      ********************************************************************/
 
-    unsigned char nColors = 0;
+    unsigned short nColors = 0; // A tile may have all 256 colors
     for(unsigned short color = 0; color < 256; color++) {
         const unsigned long bit = 1L << (color >> 3);
         if( tally[color & 7] & bit ) {
@@ -223,13 +237,13 @@ unsigned short nativeToColors(const unsigned char *src, unsigned char *end, Colo
 unsigned short nativeToRle(const unsigned char *src, unsigned char *end, unsigned char *dst, const unsigned char *stop, unsigned char depth, ColorInfo *cInfo) {
     #define ROL(A,B) ((A << B) | (A >> (sizeof(A)*8 - B)))
     #define ROR(A,B) ((A >> B) | (A << (sizeof(A)*8 - B)))
-    #define src32 ((unsigned long*)src)
 
     const unsigned char *start = dst;
     const unsigned char npix = 32 / depth;
     const unsigned char rsft = 32 - depth;
     const unsigned long lmask = ((unsigned long)-1) << rsft; // Mask for leftmost color in block
-    unsigned long curr = *src32, test, tmp;
+    const unsigned long rmask = (1 << depth) - 1;             // Mask for rightmost color in block
+    unsigned long curr = GET_LONG(src), test, tmp;
     unsigned long carry = curr & lmask;
     unsigned short rleCnt = -1, rleVal = curr >> rsft, rleSiz = cInfo->colorSize;
     unsigned short runsOfOne = 0;
@@ -242,7 +256,7 @@ unsigned short nativeToRle(const unsigned char *src, unsigned char *end, unsigne
         *end++ = 0;
         *end++ = 0;
     } else if(gotPadding) {
-        printf("Unexpected padding value in RLE from native! %d\n", gotPadding);
+        dprintf("Unexpected padding value in RLE from native! %d\n", gotPadding);
         return 0;
     }
 
@@ -254,9 +268,13 @@ unsigned short nativeToRle(const unsigned char *src, unsigned char *end, unsigne
         dprintf("Nothing to do!\n");
     }
 
+    // Declared here, as the gotos below would otherwise jump past them
     Boolean done = false;
+    unsigned char color;
+    char n;
     for(;;) {
-        curr = *src32++;
+        curr = GET_LONG(src);
+        src += sizeof(unsigned long);
         if(src > end) {
             goto writeLastRle;
         }
@@ -275,7 +293,7 @@ unsigned short nativeToRle(const unsigned char *src, unsigned char *end, unsigne
         carry = curr & rmask;
         carry = ROR(carry, depth);
         // Not pixels all are equal, test each individually
-        char n = npix - 1;
+        n = npix - 1;
         do {
             test = ROL(test, depth);
             tmp = test & rmask;
@@ -296,19 +314,17 @@ unsigned short nativeToRle(const unsigned char *src, unsigned char *end, unsigne
 
 writeLastRle:
     done = true; // Could also make stop = dst
-    // Adjustment for when we end up with 16 zero pixels as padding.
+    // Adjustment for when we end up with 16 zero pixels as padding. If
+    // the last run is made up of only the padding, it is left out.
     if(gotPadding) {
-        if(rleCnt < 15) {
+        if(rleCnt < 16) {
             goto skipLastRLEPair;
         }
         rleCnt -= 16;
-        if(rleCnt == 0) {
-            runsOfOne--;
-        }
     }
 writeRle:
     /*** Write RLE Pair ***/
-    const unsigned char color = mapColors ? cInfo->colorMap[rleVal] : rleVal;
+    color = mapColors ? cInfo->colorMap[rleVal] : rleVal;
     if((rleCnt == 0) && cInfo->packRuns) {
         *dst++ = color;
         runsOfOne++;
@@ -346,9 +362,6 @@ skipLastRLEPair:
 unsigned short nativeToPacked(const unsigned char *src, unsigned char *dst, const unsigned char* end, const char inDepth, const char outDepth, ColorInfo *colorInfo) {
     const unsigned char *start = src;
 
-    #define src32 ((unsigned long*)src)
-    #define dst32 ((unsigned long*)dst)
-
     unsigned long inBits, outBits = 0;
     unsigned char inLeft = 0, outLeft = sizeof(unsigned long) * 8;
 
@@ -358,10 +371,12 @@ unsigned short nativeToPacked(const unsigned char *src, unsigned char *dst, cons
         if (inLeft == 0) {
             if (src >= end)
                 break;
-            inBits = *src32++;
+            inBits = GET_LONG(src);
+            src += sizeof(unsigned long);
             inLeft = sizeof(unsigned long) * 8;
             if (outLeft == 0) {
-                *dst32++ = outBits;
+                PUT_LONG(dst, outBits);
+                dst += sizeof(unsigned long);
                 outBits = 0;
                 outLeft = sizeof(unsigned long) * 8;
             }
@@ -373,8 +388,87 @@ unsigned short nativeToPacked(const unsigned char *src, unsigned char *dst, cons
         outBits |= (unsigned long)mapped << outLeft;
     }
     // Write the remaining bits
-    *dst32++ = outBits;
+    PUT_LONG(dst, outBits);
 
     return (end - start) * outDepth / inDepth;
 }
 #endif // !USE_ASM_CODE
+
+#define DIRECT_HASH(C) ((unsigned char)((C) ^ ((C) >> 8) ^ ((C) >> 16)))
+
+/**
+ * With "src" pointing to the first pixel of a tile in 16 or 32-bit color,
+ * and "stride" being the distance between rows, this function will find
+ * the colors and runs of the tile and populate the DirectColorInfo structure.
+ * The colors are only found up to the first 127; past this, nColors is 128
+ * but the runs continue to be counted. Returns nColors.
+ *
+ * This is used with both the C and the assembly versions of the other tile
+ * routines.
+ */
+unsigned short nativeToDirectColors(const unsigned char *src, unsigned long stride, short rows, short cols, DirectColorInfo *info) {
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    const Boolean is16 = (fbDepth == 16);
+    const unsigned char pixBytes = fbDepth / 8;
+
+    unsigned long *hash = (unsigned long*) info->colorHash;
+    for (unsigned short i = 0; i < sizeof(info->colorHash) / sizeof(unsigned long); i++) {
+        *hash++ = 0;
+    }
+
+    unsigned short nColors = 0, nRuns = 0, runsOfOne = 0, countBytes = 0;
+    unsigned short runLen = 0;
+    unsigned long runColor = 0;
+    for (short y = 0; y < rows; y++, src += stride) {
+        const unsigned char *pix = src;
+        for (short x = 0; x < cols; x++, pix += pixBytes) {
+            const unsigned long color = DIRECT_PIXEL(pix, is16);
+            if ((color == runColor) && runLen) {
+                runLen++;
+                continue;
+            }
+            // End the last run...
+            if (runLen) {
+                nRuns++;
+                if (runLen == 1) runsOfOne++;
+                countBytes += (runLen < 256) ? 1 : (runLen - 1) / 255 + 1;
+            }
+            // ...and start a new run, adding the color if it is new
+            runColor = color;
+            runLen = 1;
+            if (nColors < 128) {
+                unsigned char h = DIRECT_HASH(color);
+                while (info->colorHash[h] && (info->colorPal[info->colorHash[h] - 1] != color)) h++;
+                if (!info->colorHash[h]) {
+                    if (nColors < 127) {
+                        info->colorPal[nColors++] = color;
+                        info->colorHash[h] = nColors;
+                    } else {
+                        nColors = 128;
+                    }
+                }
+            }
+        }
+    }
+    nRuns++;
+    if (runLen == 1) runsOfOne++;
+    countBytes += (runLen < 256) ? 1 : (runLen - 1) / 255 + 1;
+
+    info->nColors    = nColors;
+    info->nRuns      = nRuns;
+    info->runsOfOne  = runsOfOne;
+    info->countBytes = countBytes;
+    return nColors;
+}
+
+/**
+ * Returns the index of a color found by "nativeToDirectColors", which
+ * must be one of the first 127 colors of the tile.
+ */
+unsigned char findDirectColor(const DirectColorInfo *info, unsigned long color) {
+    unsigned char h = DIRECT_HASH(color);
+    while (info->colorPal[info->colorHash[h] - 1] != color) h++;
+    return info->colorHash[h] - 1;
+}
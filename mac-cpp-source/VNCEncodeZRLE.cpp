@@ -15,6 +15,8 @@
  *   location: <http://www.gnu.org/licenses/>.                              *
  ****************************************************************************/
 
+#include "VNCServer.h"
+#include "VNCPalette.h"
 #include "VNCEncoder.h"
 #include "VNCEncodeTRLE.h"
 #include "VNCEncodeZRLE.h"
@@ -27,6 +29,15 @@
     #endif
 
     Size VNCEncodeZRLE::minBufferSize() {
-        return UPDATE_BUFFER_SIZE;
+        // Tiles are staged at the end of the buffer prior to compression,
+        // and there must be room for at least one tile's worst case output
+        return max(UPDATE_BUFFER_SIZE, VNCEncoder::compressBound(maxTileSize()) + 32) + maxTileSize();
+    }
+
+    // The largest tile is a raw tile, which is a subencoding byte followed
+    // by a CPIXEL of at most one pixel's worth of bytes for each pixel
+
+    Size VNCEncodeZRLE::maxTileSize() {
+        return 1 + 64L * 64 * max(1, fbPixFormat.bitsPerPixel / 8);
     }
 #endif
\ No newline at end of file
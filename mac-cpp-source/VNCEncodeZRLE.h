@@ -23,5 +23,6 @@
 class VNCEncodeZRLE {
     public:
         static Size minBufferSize();
+        static Size maxTileSize();
 };
 
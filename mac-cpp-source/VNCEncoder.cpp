@@ -33,12 +33,180 @@
 #define USE_FAST_MONO_ENCODER            0 // Force use of monochrome encoder when depth = 1
 #define USE_TILE_OVERLAY                 0 // For debugging
 
-unsigned char selectedEncoder = -1, lastSelectedEncoder = -1;
+long selectedEncoder = -1, lastSelectedEncoder = -1; // Signed, as pseudo-encodings are negative
 unsigned char *fbUpdateBuffer = 0;
 unsigned long  fbUpdateBufferSize;
 int tile_x, tile_y;
 
+// The rectangles of the current update, which are encoded one after the other
+
+static const VNCRect *rectList;
+static unsigned char rectCount, rectIndex;
+
+// The ZRLE subrect size for the current update, which is chosen so that
+// the worst case output of a subrect fits the update buffer
+
+#define ZRLE_DEFAULT_SUBRECT 64 // Used until the first update header
+
+static unsigned int  ZRLESubrectSize = ZRLE_DEFAULT_SUBRECT;
+
+#if !defined(VNC_FB_MONOCHROME)
+    // The encoders to choose from, in order of priority when the choice
+    // is not adaptive
+
+    static const long encoderChain[] = {
+        mTRLEEncoding,
+        mTightPNGEncoding,
+        mZHextileEncoding,
+        mHextileEncoding,
+        mZRLEEncoding,
+        mTightEncoding,
+        mRawEncoding
+    };
+
+    #define NUM_ENCODERS (sizeof(encoderChain) / sizeof(encoderChain[0]))
+
+    static Boolean encoderAllowed(long encoder);
+    static Size bufferSize(long encoder);
+#endif
+
+#if USE_ADAPTIVE_ENCODER && !defined(VNC_FB_MONOCHROME)
+    /* The adaptive encoder selection keeps, for each encoder, a smoothed
+     * measure of the bytes it produces and the time it takes to encode a
+     * thousand pixels, along with a smoothed measure of the link speed.
+     * Each update goes to the encoder with the least estimated transfer
+     * plus encode time, while every ADAPT_PROBE_INTERVAL updates, the
+     * encoder whose measurements are the oldest is given a trial.
+     *
+     * ZRLE and ZlibHex cannot reset the client's ZLib streams, so once
+     * another encoder has used the shared ZLib stream, they drop out.
+     */
+
+    #define ADAPT_PROBE_INTERVAL 32
+    #define ADAPT_MIN_KPIX       4     // Smaller updates are not measured
+    #define ADAPT_LINK_DEFAULT   10000 // Microseconds per KB before measured
+
+    struct EncoderStats {
+        unsigned long bytesPerKPix;
+        unsigned long microsPerKPix;
+        unsigned char samples;
+        unsigned char age;
+    };
+
+    static EncoderStats  adaptStats[NUM_ENCODERS];
+    static unsigned char clientOrder[NUM_ENCODERS];
+    static unsigned char clientOrderCount;
+    static unsigned char updatesToProbe;
+    static unsigned char zlibUsed;
+    static long          zlibOwner;
+    static unsigned long linkMicrosPerKB;
+    static unsigned long updateStartTicks, updatePixels, updateBytes, updateMicros;
+    static Boolean       hasMicroseconds;
+
+    static int adaptIndex(long encoder) {
+        for (unsigned char i = 0; i < NUM_ENCODERS; i++) {
+            if (encoderChain[i] == encoder) return i;
+        }
+        return -1;
+    }
+
+    static unsigned long adaptMicros() {
+        UnsignedWide now;
+        if (!hasMicroseconds) return 0;
+        Microseconds(&now);
+        return now.lo;
+    }
+
+    // Returns whether an encoder may use the shared ZLib stream
+
+    static Boolean zlibAvailable(unsigned char i) {
+        switch (encoderChain[i]) {
+            case mZRLEEncoding:
+            case mZHextileEncoding:
+                return (zlibOwner == encoderChain[i]) || !(zlibUsed & (1 << i));
+            default:
+                return true;
+        }
+    }
+
+    // Returns the estimated microseconds to encode and send 1024 pixels
+
+    static unsigned long encoderCost(const EncoderStats &s) {
+        return ((s.bytesPerKPix * (linkMicrosPerKB >> 4)) >> 6) + s.microsPerKPix;
+    }
+
+    static void adaptClear() {
+        for (unsigned char i = 0; i < NUM_ENCODERS; i++) {
+            adaptStats[i].samples = 0;
+            adaptStats[i].age = 255;
+        }
+        clientOrderCount = 0;
+        updatesToProbe = ADAPT_PROBE_INTERVAL;
+        zlibUsed = 0;
+        zlibOwner = -1;
+        linkMicrosPerKB = ADAPT_LINK_DEFAULT;
+    }
+
+    static long chooseEncoder() {
+        // Visit the candidates in the client's order of preference, so that
+        // an encoder the client prefers is only displaced by a clear win
+        int first = -1, best = -1, stalest = -1;
+        unsigned long bestCost = 0;
+        for (unsigned char n = 0; n < clientOrderCount; n++) {
+            const unsigned char i = clientOrder[n];
+            if (!encoderAllowed(encoderChain[i]) || !zlibAvailable(i)) continue;
+            const EncoderStats &s = adaptStats[i];
+            if (first == -1) {
+                first = i;
+            }
+            if (s.samples) {
+                const unsigned long cost = encoderCost(s);
+                if ((best == -1) || (cost + cost / 16 < bestCost)) {
+                    best = i;
+                    bestCost = cost;
+                }
+            }
+            if ((stalest == -1) || (s.age > adaptStats[stalest].age)) {
+                stalest = i;
+            }
+        }
+        if (best == -1) {
+            best = first;
+        }
+        if (best == -1) {
+            return -1;
+        }
+
+        // Periodically give the encoder with the oldest measurements a trial
+        if (--updatesToProbe == 0) {
+            updatesToProbe = ADAPT_PROBE_INTERVAL;
+            best = stalest;
+        }
+
+        // Hand the shared ZLib stream over to the encoder, resetting it in
+        // case another encoder, possibly in an earlier session, had used it
+        const long encoder = encoderChain[best];
+        switch (encoder) {
+            case mZRLEEncoding:
+            case mZHextileEncoding:
+            case mTightEncoding:
+            case mTightPNGEncoding:
+                if (zlibOwner != encoder) {
+                    VNCEncoder::compressReset();
+                    zlibOwner = encoder;
+                    zlibUsed |= 1 << best;
+                }
+        }
+        return encoder;
+    }
+#endif
+
 OSErr VNCEncoder::setup() {
+    #if USE_ADAPTIVE_ENCODER && !defined(VNC_FB_MONOCHROME)
+        hasMicroseconds = TrapAvailable(0xA193); // _Microseconds
+        adaptClear();
+    #endif
+    return noErr;
 }
 
 OSErr VNCEncoder::destroy() {
@@ -66,43 +234,90 @@ void VNCEncoder::clear() {
     #endif
     vncFlags.clientTakesRaw      = false;
     vncFlags.clientTakesHextile  = false;
+    vncFlags.clientTakesZHextile = false;
     vncFlags.clientTakesTRLE     = false;
     vncFlags.clientTakesZRLE     = false;
+    vncFlags.clientTakesTightPNG = false;
     vncFlags.clientTakesCursor   = false;
     vncFlags.clientTakesContUpdt = false;
     vncFlags.clientTakesFence    = false;
+    vncFlags.clientTakesCopyRect = false;
+    vncFlags.clientTakesLastRect = false;
     selectedEncoder = -1;
+    #if USE_ADAPTIVE_ENCODER && !defined(VNC_FB_MONOCHROME)
+        adaptClear();
+    #endif
 }
 
+#if !defined(VNC_FB_MONOCHROME)
+    // Returns whether an encoder is enabled, supported by the client and
+    // able to handle the client's pixel format
+
+    static Boolean encoderAllowed(long encoder) {
+        #ifdef VNC_FB_BITS_PER_PIX
+            const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+        #endif
+        if (fbDepth > 8) {
+            // Only TRLE and ZRLE can encode thousands or millions of colors,
+            // aside from Raw, when the client takes the screen's pixels as is
+            switch (encoder) {
+                case mTRLEEncoding: return vncConfig.allowTRLE && vncFlags.clientTakesTRLE;
+                case mZRLEEncoding: return vncConfig.allowZRLE && vncFlags.clientTakesZRLE;
+                case mRawEncoding:  return vncConfig.allowRaw && vncFlags.clientTakesRaw && VNCPalette::isNativeLayout() && fbPixFormat.bigEndian;
+                default:            return false;
+            }
+        }
+        switch (encoder) {
+            case mTRLEEncoding:     return vncConfig.allowTRLE && vncFlags.clientTakesTRLE;
+            case mTightPNGEncoding: return vncConfig.allowTightPNG && vncFlags.clientTakesTightPNG && fbPixFormat.trueColor;
+            case mZHextileEncoding: return vncConfig.allowZHextile && vncFlags.clientTakesZHextile;
+            case mHextileEncoding:  return vncConfig.allowHextile && vncFlags.clientTakesHextile;
+            case mZRLEEncoding:     return vncConfig.allowZRLE && vncFlags.clientTakesZRLE;
+            case mTightEncoding:    return vncConfig.allowTightEnc && vncFlags.clientTakesTightEnc;
+            case mRawEncoding:      return vncConfig.allowRaw && vncFlags.clientTakesRaw && (!fbPixFormat.trueColor) && (fbDepth == 8);
+            default:                return false;
+        }
+    }
+#endif
+
 int VNCEncoder::begin() {
     // Select the most appropriate encoder
 
     #if defined(VNC_FB_MONOCHROME)
-        if (vncFlags.clientTakesTRLE && (!fbPixFormat.trueColor)) {
-            selectedEncoder = mTRLEEncoding;
-        }
+        selectedEncoder = (vncFlags.clientTakesTRLE && (!fbPixFormat.trueColor)) ? mTRLEEncoding : -1;
+    #elif USE_ADAPTIVE_ENCODER
+        selectedEncoder = chooseEncoder();
     #else
-        if (vncConfig.allowTRLE && vncFlags.clientTakesTRLE) {
-            selectedEncoder = mTRLEEncoding;
-        } else if (vncConfig.allowHextile && vncFlags.clientTakesHextile) {
-            selectedEncoder = mHextileEncoding;
-        } else if (vncConfig.allowZRLE && vncFlags.clientTakesZRLE) {
-            selectedEncoder = mZRLEEncoding;
-        } else if (vncConfig.allowTightEnc && vncFlags.clientTakesTightEnc) {
-            selectedEncoder = mTightEncoding;
-        } else if (vncConfig.allowRaw && vncFlags.clientTakesRaw && (!fbPixFormat.trueColor) && (fbDepth == 8)) {
-            selectedEncoder = mRawEncoding;
+        selectedEncoder = -1;
+        for (unsigned char i = 0; i < NUM_ENCODERS; i++) {
+            if (encoderAllowed(encoderChain[i])) {
+                selectedEncoder = encoderChain[i];
+                break;
+            }
         }
     #endif
-        else {
-            dprintf("No suitable encoding found!\n");
-            selectedEncoder = lastSelectedEncoder = -1;
-            return false;
-        }
+    if (selectedEncoder == -1) {
+        dprintf("No suitable encoding found!\n");
+        selectedEncoder = lastSelectedEncoder = -1;
+        return false;
+    }
 
+    rectIndex = 0;
+    if (rectCount) {
+        fbUpdateRect = rectList[0];
+    } else {
+        fbUpdateRect.w = fbUpdateRect.h = 0;
+    }
     tile_x = 0;
     tile_y = 0;
 
+    #if USE_ADAPTIVE_ENCODER && !defined(VNC_FB_MONOCHROME)
+        updateStartTicks = TickCount();
+        updatePixels = (unsigned long)fbUpdateRect.w * fbUpdateRect.h;
+        updateBytes = 0;
+        updateMicros = 0;
+    #endif
+
     // Decide whether to defer to the main thread for initialization.
     // This will need to happen whenever memory needs to be allocated,
     // before the first call to any encoder routines which might cause
@@ -122,10 +337,27 @@ int VNCEncoder::begin() {
     return encoderSetup();
 }
 
+// Called by the server prior to begin() with the rectangles to be encoded
+
+void VNCEncoder::setRects(const VNCRect *rects, unsigned int nRects) {
+    rectList = rects;
+    rectCount = nRects;
+}
+
+// Called prior to encoding each additional rectangle in an update
+
+void VNCEncoder::beginRect() {
+    tile_x = 0;
+    tile_y = 0;
+    encoderSetup();
+}
+
 Boolean VNCEncoder::encoderNeedsZLib() {
     switch(selectedEncoder) {
         case mZRLEEncoding:
+        case mZHextileEncoding:
         case mTightEncoding:
+        case mTightPNGEncoding:
             return true;
         default:
             return false;
@@ -133,14 +365,24 @@ Boolean VNCEncoder::encoderNeedsZLib() {
 }
 
 int VNCEncoder::encoderSetup() {
+    #if !defined(VNC_FB_MONOCHROME)
+        // Choose the tile routines for the depth and the pixel format,
+        // which is CPIXEL for all but Raw and the Hextile encoders
+        const Boolean isCPIXEL = (selectedEncoder != mRawEncoding) &&
+                                 (selectedEncoder != mHextileEncoding) &&
+                                 (selectedEncoder != mZHextileEncoding);
+        VNCPalette::prepareTileRoutines(isCPIXEL);
+    #endif
     switch(selectedEncoder) {
         case mTRLEEncoding: VNCEncodeTRLE::begin(); break;
         #if !defined(VNC_FB_MONOCHROME)
             case mRawEncoding:     VNCEncodeRaw::begin(); break;
             case mHextileEncoding: VNCEncodeHextile::begin(); break;
+            case mZHextileEncoding: VNCEncodeHextile::begin(); break;
             //case mZLibEncoding:  VNCEncodeZLib::begin(); break;
             case mZRLEEncoding:    VNCEncodeTRLE::begin(); break;
             case mTightEncoding:   VNCEncodeTight::begin(); break;
+            case mTightPNGEncoding: VNCEncodeTight::begin(); break;
         #endif
     }
 
@@ -209,32 +451,98 @@ char *VNCEncoder::getEncoderName(unsigned long encoding) {
         }
 }
 
+// Called at the end of each update, to update the measurements used
+// to choose an encoder
+
+void VNCEncoder::endUpdate() {
+    #if USE_ADAPTIVE_ENCODER && !defined(VNC_FB_MONOCHROME)
+        const int i = adaptIndex(selectedEncoder);
+        const unsigned long kpix = updatePixels / 1024;
+        if ((i == -1) || (kpix < ADAPT_MIN_KPIX)) {
+            return;
+        }
+
+        // Time left over from encoding is taken to be transfer time
+        const unsigned long kbytes = updateBytes / 1024;
+        const unsigned long ticks = TickCount() - updateStartTicks;
+        const unsigned long encodeTicks = updateMicros / 16667;
+        if (kbytes && (ticks > encodeTicks + 1)) {
+            const unsigned long sample = (ticks - encodeTicks) * 16667 / kbytes;
+            linkMicrosPerKB = (linkMicrosPerKB * 3 + sample) / 4;
+        }
+
+        EncoderStats &s = adaptStats[i];
+        const unsigned long bytes  = updateBytes / kpix;
+        const unsigned long micros = updateMicros / kpix;
+        if (s.samples == 0) {
+            s.bytesPerKPix  = bytes;
+            s.microsPerKPix = micros;
+        } else {
+            s.bytesPerKPix  = (s.bytesPerKPix  * 3 + bytes)  / 4;
+            s.microsPerKPix = (s.microsPerKPix * 3 + micros) / 4;
+        }
+        if (s.samples < 255) {
+            s.samples++;
+        }
+        for (unsigned char j = 0; j < NUM_ENCODERS; j++) {
+            if (adaptStats[j].age < 255) {
+                adaptStats[j].age++;
+            }
+        }
+        s.age = 0;
+
+        #if LOG_COMPRESSION_STATS
+            dprintf("%s: %ld bytes and %ld usec per kpixel, link %ld usec per KB\n",
+                getEncoderName(selectedEncoder), s.bytesPerKPix, s.microsPerKPix, linkMicrosPerKB);
+        #endif
+    #endif
+}
+
 void VNCEncoder::clientEncoding(unsigned long encoding, Boolean hasMore) {
+    #if USE_ADAPTIVE_ENCODER && !defined(VNC_FB_MONOCHROME)
+        // Remember the client's order of preference
+        const int i = adaptIndex(encoding);
+        if (i != -1) {
+            unsigned char n = 0;
+            while ((n < clientOrderCount) && (clientOrder[n] != i)) n++;
+            if (n == clientOrderCount) {
+                clientOrder[clientOrderCount++] = i;
+            }
+        }
+    #endif
     switch(encoding) {
         case mRawEncoding:      vncFlags.clientTakesRaw     = true; break;
+        case mCopyRectEncoding: vncFlags.clientTakesCopyRect = true; break;
         case mHextileEncoding:  vncFlags.clientTakesHextile = true; break;
+        case mZHextileEncoding: vncFlags.clientTakesZHextile = true; break;
         //case mZLibEncoding:     vncFlags.clientTakesZLib     = true; break;
         case mTRLEEncoding:     vncFlags.clientTakesTRLE     = true; break;
         case mZRLEEncoding:     vncFlags.clientTakesZRLE     = true; break;
         case mTightEncoding:    vncFlags.clientTakesTightEnc = true; break;
+        case mTightPNGEncoding: vncFlags.clientTakesTightPNG = true; break;
         case mCursorEncoding:   vncFlags.clientTakesCursor   = true; break;
         case mContUpdtEncoding: vncFlags.clientTakesContUpdt = true; break;
         case mFenceEncoding:    vncFlags.clientTakesFence    = true; break;
+        case mLastRectEncoding: vncFlags.clientTakesLastRect = true; break;
     };
 }
 
 OSErr VNCEncoder::fbSyncTasks() {
     // Make sure the update buffer is allocated and the right size
-    Size size;
-    switch(selectedEncoder) {
-        case mTRLEEncoding:        size = VNCEncodeTRLE::minBufferSize(); break;
-        #if !defined(VNC_FB_MONOCHROME)
-            case mRawEncoding:     size = VNCEncodeRaw::minBufferSize(); break;
-            case mHextileEncoding: size = VNCEncodeHextile::minBufferSize(); break;
-            case mZRLEEncoding:    size = VNCEncodeZRLE::minBufferSize(); break;
-            case mTightEncoding:    size = VNCEncodeTight::minBufferSize(); break;
-        #endif
-    }
+    #if defined(VNC_FB_MONOCHROME)
+        Size size = VNCEncodeTRLE::minBufferSize();
+    #else
+        Size size = bufferSize(selectedEncoder);
+    #endif
+    #if USE_ADAPTIVE_ENCODER && !defined(VNC_FB_MONOCHROME)
+        // Make room for any encoder that may be chosen, so that switching
+        // encoders does not free the buffers along with the ZLib streams
+        for (unsigned char i = 0; i < NUM_ENCODERS; i++) {
+            if (encoderAllowed(encoderChain[i])) {
+                size = max(size, bufferSize(encoderChain[i]));
+            }
+        }
+    #endif
     size = max(size, max(VNCPalette::minBufferSize(), VNCEncodeCursor::minBufferSize()));
 
     if ((fbUpdateBuffer != NULL) && (GetPtrSize((Ptr)fbUpdateBuffer) != size)) {
@@ -257,7 +565,9 @@ OSErr VNCEncoder::fbSyncTasks() {
     // Initialize the encoders and associated modules
 
     #if !defined(VNC_FB_MONOCHROME)
-        if(encoderNeedsZLib() && !vncFlags.zLibLoaded) {
+        if(encoderNeedsZLib()) {
+            // Allocates the compressor, as well as any streams the
+            // encoder needs that are not yet allocated
             compressSetup();
         }
     #endif
@@ -267,10 +577,32 @@ OSErr VNCEncoder::fbSyncTasks() {
     return noErr;
 }
 
+#if !defined(VNC_FB_MONOCHROME)
+    static Size bufferSize(long encoder) {
+        switch(encoder) {
+            case mTRLEEncoding:     return VNCEncodeTRLE::minBufferSize();
+            case mRawEncoding:      return VNCEncodeRaw::minBufferSize();
+            case mHextileEncoding:  return VNCEncodeHextile::minBufferSize();
+            case mZHextileEncoding: return VNCEncodeHextile::minZlibBufferSize();
+            case mZRLEEncoding:     return VNCEncodeZRLE::minBufferSize();
+            case mTightEncoding:
+            case mTightPNGEncoding: return VNCEncodeTight::minBufferSize();
+            default:                return 0;
+        }
+    }
+#endif
+
 static unsigned long encodeTile(EncoderPB &epb);
 static unsigned long encodeTile(EncoderPB &epb) {
-    if (selectedEncoder == mHextileEncoding) {
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    if (fbDepth > 8) {
+        return VNCEncodeTRLE::encodeDirectTile(epb);
+    } else if (selectedEncoder == mHextileEncoding) {
         return VNCEncodeHextile::encodeTile(epb);
+    } else if (selectedEncoder == mZHextileEncoding) {
+        return VNCEncodeHextile::encodeZlibTile(epb);
     } else {
         return VNCEncodeTRLE::encodeTile(epb);
     }
@@ -278,7 +610,7 @@ static unsigned long encodeTile(EncoderPB &epb) {
 
 static unsigned long encodeSolidTile(EncoderPB &epb);
 static unsigned long encodeSolidTile(EncoderPB &epb) {
-    if (selectedEncoder == mHextileEncoding) {
+    if ((selectedEncoder == mHextileEncoding) || (selectedEncoder == mZHextileEncoding)) {
         return VNCEncodeHextile::encodeSolidTile(epb);
     } else {
         return VNCEncodeTRLE::encodeSolidTile(epb);
@@ -337,23 +669,127 @@ static unsigned long encodeSolidTile(EncoderPB &epb) {
  * a rectangle comprising the entire screen, this would require a large
  * buffer.  When using ZRLE, we divide each framebuffer update into multiple
  * subrectangles, each compressed individually, to reduce the buffer use.
+ * Tight has the same requirement, and also limits the size of rectangles
+ * that may be compressed, so it is divided into smaller subrectangles.
+ *
+ * Since each subrectangle costs a header and a ZLib flush, the ZRLE
+ * subrectangle size is chosen for each update to be as large as will
+ * fit the room left for compressed output, and no larger than the
+ * update's rectangles. A subrectangle cannot be cut short once its
+ * header is sent, so the size must allow for every tile being raw and
+ * not compressing at all, rather than for the output of recent updates.
+ *
+ * When the client takes LastRect, rects of any shape may be added to the
+ * update after the size is chosen, and the size cannot change while the
+ * update is being encoded. The size must then fit a subrect of a rect as
+ * large as the screen, which is as many tiles as any subrect can hold.
  */
 
-const unsigned int ZRLESubrectSize = 192;
+#define ZRLE_MAX_SUBRECT 1024
 
-unsigned int VNCEncoder::numOfSubrects() {
-    // Multiple rectangles for ZRLE, one for Hextile and TRLE.
-    return (selectedEncoder != mZRLEEncoding) ? 1 :
-           (((fbUpdateRect.w + ZRLESubrectSize - 1) / ZRLESubrectSize) *
-           ((fbUpdateRect.h + ZRLESubrectSize - 1) / ZRLESubrectSize));
+#if !defined(VNC_FB_MONOCHROME)
+    // Returns the number of tiles in the largest subrect of a rectangle
+
+    static unsigned long tilesPerSubrect(const VNCRect &rect, unsigned int size) {
+        return ((min(size, rect.w) + 63) / 64) * ((min(size, rect.h) + 63) / 64);
+    }
+
+    static void chooseZRLESubrectSize() {
+        #ifdef VNC_FB_WIDTH
+            const unsigned int fbWidth  = VNC_FB_WIDTH;
+            const unsigned int fbHeight = VNC_FB_HEIGHT;
+        #endif
+        // The room for output ahead of the tile staging area, and the most
+        // tiles for which the worst case output is sure to fit in it
+        const unsigned long tileMax = VNCEncodeZRLE::maxTileSize();
+        const unsigned long stage = min(tileMax, fbUpdateBufferSize / 2);
+        const unsigned long room = min(fbUpdateBufferSize - stage - 32, 0xFFFFL);
+        unsigned long maxTiles = 1;
+        while (VNCEncoder::compressBound((maxTiles + 1) * tileMax) <= room) {
+            maxTiles++;
+        }
+
+        // The rects which the size must fit
+        VNCRect screen;
+        screen.x = screen.y = 0;
+        screen.w = fbWidth;
+        screen.h = fbHeight;
+        const Boolean openEnded = vncFlags.clientTakesLastRect;
+        const VNCRect *rects = openEnded ? &screen : rectList;
+        const unsigned char nRects = openEnded ? 1 : rectCount;
+
+        unsigned int extent = 64;
+        for (unsigned char i = 0; i < nRects; i++) {
+            extent = max(extent, max(rects[i].w, rects[i].h));
+        }
+
+        unsigned int size = 64;
+        while ((size < extent) && (size < ZRLE_MAX_SUBRECT)) {
+            Boolean fits = true;
+            for (unsigned char i = 0; i < nRects; i++) {
+                if (tilesPerSubrect(rects[i], size + 64) > maxTiles) {
+                    fits = false;
+                    break;
+                }
+            }
+            if (!fits) break;
+            size += 64;
+        }
+        #if LOG_COMPRESSION_STATS
+            if (size != ZRLESubrectSize) {
+                dprintf("ZRLE subrect size is now %d (%ld tiles fit)\n", size, maxTiles);
+            }
+        #endif
+        ZRLESubrectSize = size;
+    }
+#endif
+
+// Returns the subrect size for the current encoder, or zero if the
+// encoder sends each rectangle whole.
+
+static unsigned int subrectSize() {
+    switch(selectedEncoder) {
+        case mZRLEEncoding:  return ZRLESubrectSize;
+        case mTightEncoding:
+        case mTightPNGEncoding: return TIGHT_SUBRECT_SIZE;
+        default:             return 0;
+    }
+}
+
+// Returns the number of rectangles the update will have on the wire
+
+unsigned int VNCEncoder::numOfRects() {
+    // This is called when the update header is sent, once the update
+    // buffer is allocated, so this is where the ZRLE subrect size is
+    // settled for the update
+    #if !defined(VNC_FB_MONOCHROME)
+        if (selectedEncoder == mZRLEEncoding) {
+            chooseZRLESubrectSize();
+        }
+    #endif
+
+    unsigned int numRects = 0;
+    for (unsigned char i = 0; i < rectCount; i++) {
+        numRects += numOfSubrects(rectList[i]);
+    }
+    return numRects;
+}
+
+unsigned int VNCEncoder::numOfSubrects(const VNCRect &rect) {
+    // Multiple rectangles for ZRLE and Tight, one for Hextile and TRLE.
+    const unsigned int size = subrectSize();
+    return (size == 0) ? 1 :
+           (((rect.w + size - 1) / size) *
+           ((rect.h + size - 1) / size));
 }
 
 Boolean VNCEncoder::isNewSubrect() {
     // This tells the server code to emit a new subrectangle header,
     // and the compression code to release the data. In the case,
     // of TRLE or Hextile, only emit a subrect at the very start.
-    if (selectedEncoder == mZRLEEncoding) {
-        return ((tile_x % ZRLESubrectSize) == 0) && ((tile_y % ZRLESubrectSize) == 0);
+    const unsigned int size = subrectSize();
+    if (size) {
+        return ((tile_x % size) == 0) && ((tile_y % size) == 0);
     } else {
         return (tile_x == 0) && (tile_y == 0);
     }
@@ -361,14 +797,14 @@ Boolean VNCEncoder::isNewSubrect() {
 
 void VNCEncoder::getSubrect(VNCRect *rect) {
     // Called by the server when writing the subrectangle header.
-    if (selectedEncoder == mZRLEEncoding) {
-        const unsigned int tileMask = ZRLESubrectSize - 1;
-        const unsigned int sub_x = tile_x / ZRLESubrectSize * ZRLESubrectSize;
-        const unsigned int sub_y = tile_y / ZRLESubrectSize * ZRLESubrectSize;
+    const unsigned int size = subrectSize();
+    if (size) {
+        const unsigned int sub_x = tile_x / size * size;
+        const unsigned int sub_y = tile_y / size * size;
         rect->x = fbUpdateRect.x + sub_x;
         rect->y = fbUpdateRect.y + sub_y;
-        rect->w = min(sub_x + ZRLESubrectSize, fbUpdateRect.w) - sub_x;
-        rect->h = min(sub_y + ZRLESubrectSize, fbUpdateRect.h) - sub_y;
+        rect->w = min(sub_x + size, fbUpdateRect.w) - sub_x;
+        rect->h = min(sub_y + size, fbUpdateRect.h) - sub_y;
     } else {
         *rect = fbUpdateRect;
     }
@@ -485,6 +921,39 @@ Boolean VNCEncoder::getUncompressedChunk(EncoderPB &epb) {
 }
 
 Boolean VNCEncoder::getChunk(wdsEntry *wds) {
+    #if USE_ADAPTIVE_ENCODER && !defined(VNC_FB_MONOCHROME)
+        const unsigned long start = adaptMicros();
+        const Boolean gotMore = getRectChunk(wds);
+        updateMicros += adaptMicros() - start;
+        for (const wdsEntry *w = wds; w->length; w++) {
+            updateBytes += w->length;
+        }
+    #else
+        const Boolean gotMore = getRectChunk(wds);
+    #endif
+    if (gotMore) {
+        return true;
+    }
+    rectIndex++;
+    return nextRect();
+}
+
+// Moves on to the next rectangle in the update, if there is one
+
+Boolean VNCEncoder::nextRect() {
+    if (rectIndex < rectCount) {
+        fbUpdateRect = rectList[rectIndex];
+        #if USE_ADAPTIVE_ENCODER && !defined(VNC_FB_MONOCHROME)
+            updatePixels += (unsigned long)fbUpdateRect.w * fbUpdateRect.h;
+        #endif
+        beginRect();
+        return true;
+    }
+    fbUpdateRect.w = fbUpdateRect.h = 0;
+    return false;
+}
+
+Boolean VNCEncoder::getRectChunk(wdsEntry *wds) {
     #ifdef VNC_FB_BITS_PER_PIX
         const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
     #endif
@@ -499,6 +968,7 @@ Boolean VNCEncoder::getChunk(wdsEntry *wds) {
         Boolean gotMore;
         switch(selectedEncoder) {
             case mHextileEncoding:
+            case mZHextileEncoding:
             case mTRLEEncoding:
                 gotMore = getUncompressedChunk(epb);
                 break;
@@ -513,6 +983,7 @@ Boolean VNCEncoder::getChunk(wdsEntry *wds) {
                 #endif
                 break;
             case mTightEncoding:
+            case mTightPNGEncoding:
                 return VNCEncodeTight::getChunk(wds);
         }
         wds->length = epb.bytesWritten;
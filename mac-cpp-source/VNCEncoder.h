@@ -42,11 +42,13 @@ class VNCEncoder {
 
         static void clear();
         static int begin();
+        static void endUpdate();
         static void clientEncoding(unsigned long encoding, Boolean hasMore);
         static unsigned long getEncoding();
         static char *getEncoderName(unsigned long encoding);
         static Boolean getUncompressedChunk(EncoderPB &epb);
         static Boolean getChunk(wdsEntry *wds);
+        static Boolean getRectChunk(wdsEntry *wds);
         static OSErr fbSyncTasks();
 
         static int encoderSetup();
@@ -55,8 +57,18 @@ class VNCEncoder {
         static void compressBegin();
         static void compressReset();
         static void compressDestroy();
+        static unsigned char getStream(unsigned char preferred);
+        static unsigned char takeTightResets();
+        static unsigned long compressBound(unsigned long len);
+        static unsigned long compressStream(unsigned char stream, const unsigned char *src, unsigned long srcLen, unsigned char *dst, unsigned long dstLen);
+        static unsigned long compressPNG(const unsigned char *src, unsigned long srcLen, unsigned char *dst, unsigned long dstLen);
+        static unsigned long checksumPNG(const unsigned char *src, unsigned long srcLen);
 
-        static unsigned int numOfSubrects();
+        static void setRects(const VNCRect *rects, unsigned int nRects);
+        static void beginRect();
+        static Boolean nextRect();
+        static unsigned int numOfRects();
+        static unsigned int numOfSubrects(const VNCRect &rect);
         static void getSubrect(VNCRect *rect);
         static Boolean isNewSubrect();
         static Boolean encoderNeedsZLib();
@@ -65,8 +77,8 @@ class VNCEncoder {
         static Boolean getCompressedChunk(wdsEntry *wds);
 };
 
-extern unsigned char selectedEncoder;
+extern long selectedEncoder;
 extern unsigned char *fbUpdateBuffer;
 
 #define ALIGN_PAD 3
-#define ALIGN_LONG(PTR) (PTR) + (sizeof(unsigned long) - (unsigned long)(PTR) % sizeof(unsigned long))
+#define ALIGN_LONG(PTR) (PTR) + ((sizeof(unsigned long) - (unsigned long)(PTR) % sizeof(unsigned long)) % sizeof(unsigned long))
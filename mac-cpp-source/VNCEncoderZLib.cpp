@@ -20,6 +20,7 @@
 #include "VNCTypes.h"
 #include "VNCServer.h"
 #include "VNCEncoder.h"
+#include "VNCEncodeZRLE.h"
 #include "DebugLog.h"
 
 #define MINIZ_NO_ARCHIVE_APIS
@@ -35,8 +36,26 @@
 #include "miniz.h"
 
 // tdefl_compressor contains all the state needed by the low-level compressor so it's a pretty big struct (~300k).
-// This example makes it a global vs. putting it on the stack, of course in real-world usage you'll probably malloc() or new it.
-static tdefl_compressor *g_deflator = 0;
+// A stream only gets one if it will leave ZLIB_HEADROOM bytes free in the heap, otherwise it gets a fast deflater.
+
+#define ZLIB_HEADROOM 32768L
+
+// Tight allows a client up to four ZLib streams, and ZlibHex uses two.
+// Stream 0 is the ZRLE stream, while the others are only allocated when
+// an encoder that uses them is selected and there is memory for them. A
+// bit is set in g_tightResets for each stream that has been initialized
+// since a Tight client was last told to reset it.
+
+#define TIGHT_STREAMS 4
+
+struct FastStream;
+
+static tdefl_compressor *g_tightStreams[TIGHT_STREAMS] = {0};
+static FastStream       *g_fastStreams[TIGHT_STREAMS] = {0};
+static unsigned char g_tightResets = 0;
+
+static void initStream(tdefl_compressor *d);
+static void initFastStream(FastStream *f);
 
 #if !USE_IN_PLACE_COMPRESSION
     // COMP_OUT_BUF_SIZE is the size of the output buffer used during compression.
@@ -45,15 +64,126 @@ static tdefl_compressor *g_deflator = 0;
     static unsigned char *s_outbuf = 0;
 #endif
 
+/* When zLibLevel is set to FAST_DEFLATE_LEVEL, which is one past the
+ * highest miniz level, or when there is not enough memory for miniz,
+ * a stream is compressed by a minimal deflater. It uses fixed Huffman
+ * codes only, so there are no code tables to build for each block, and
+ * a greedy matcher that tries a single hash candidate and a run of the
+ * prior byte. The uncompressed data is copied into a
+ * window, so that matches can reach back into earlier tiles. The window
+ * starts at VNC_ZLIB_MAX_WINDOW and is halved down to FAST_MIN_WINDOW
+ * until it can be allocated. This is much faster than miniz on a 68000,
+ * and much smaller, at the cost of some compression.
+ */
+
+#define FAST_DEFLATE_LEVEL  11
+#define FAST_MIN_WINDOW     4096L
+#define FAST_MAX_MATCH      258
+#define FAST_BLOCK_OVERHEAD 16  // Header, block bits and flush or trailer
+
+struct FastStream {
+    unsigned char  *window;
+    unsigned short *hash;       // Window position plus one, or zero
+    unsigned long   windowSize;
+    unsigned long   windowLen;
+    unsigned long   bitBuf;
+    unsigned short  hashMask;
+    unsigned char   bitCount;
+    Boolean         headerSent;
+};
+
+static Boolean         s_fastTables = false;
+static unsigned short  s_litCode[288];
+static unsigned char   s_litLen[288];
+static unsigned char   s_lenSym[256];
+static unsigned char   s_distSymSmall[512];
+static unsigned char   s_distSymLarge[128];
+static unsigned char   s_distCode[30];
+
+static const unsigned short s_lenBase[29]   = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const unsigned char  s_lenExtra[29]  = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const unsigned short s_distBase[30]  = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const unsigned char  s_distExtra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+static void fastDeflateTables();
+
+// Returns the number of bytes reserved for a stream
+
+static unsigned long streamFootprint(unsigned char i) {
+    if (g_tightStreams[i]) {
+        return sizeof(tdefl_compressor);
+    }
+    if (g_fastStreams[i]) {
+        return sizeof(FastStream) + g_fastStreams[i]->windowSize + (g_fastStreams[i]->hashMask + 1UL) * sizeof(unsigned short);
+    }
+    return 0;
+}
+
+// Allocates a fast deflater for a stream, with the largest window that
+// will fit. The hash table has one entry for every eight window bytes.
+
+static Boolean newFastStream(unsigned char i) {
+    if (!s_fastTables) {
+        fastDeflateTables();
+        s_fastTables = true;
+    }
+    for (unsigned long size = VNC_ZLIB_MAX_WINDOW; size >= FAST_MIN_WINDOW; size /= 2) {
+        const unsigned long hashSize = size / 8;
+        FastStream *f = (FastStream*)NewPtr(sizeof(FastStream) + size + hashSize * sizeof(unsigned short));
+        if (MemError() == noErr) {
+            f->window = (unsigned char*)(f + 1);
+            f->hash = (unsigned short*)(f->window + size);
+            f->windowSize = size;
+            f->hashMask = hashSize - 1;
+            g_fastStreams[i] = f;
+            dprintf("Reserved %ld bytes for fast deflater with %ld byte window on ZLib stream %d\n", streamFootprint(i), size, i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Allocates a stream, preferring miniz unless the fast deflater was
+// selected or miniz would leave too little memory
+
+static Boolean newStream(unsigned char i) {
+    if (vncConfig.zLibLevel != FAST_DEFLATE_LEVEL) {
+        if (MaxBlock() > sizeof(tdefl_compressor) + ZLIB_HEADROOM) {
+            tdefl_compressor *d = (tdefl_compressor*)NewPtr(sizeof(tdefl_compressor));
+            if (MemError() == noErr) {
+                dprintf("Reserved %ld bytes for ZLib stream %d\n", sizeof(tdefl_compressor), i);
+                g_tightStreams[i] = d;
+                return true;
+            }
+        }
+        dprintf("Not enough memory for miniz on ZLib stream %d, will use fast deflater\n", i);
+    }
+    return newFastStream(i);
+}
+
 OSErr VNCEncoder::compressSetup() {
-    // Make sure the compression buffer is allocated
-    if (g_deflator == NULL) {
-        g_deflator = (tdefl_compressor*)NewPtr(sizeof(tdefl_compressor));
-        dprintf("Reserved %ld bytes for ZLib compressor object\n", sizeof(tdefl_compressor));
-        if (MemError() != noErr) {
-            dprintf("Failed to allocate compressor\n");
-            return MemError();
+    // Allocate the streams, if possible
+    const unsigned char nStreams = (selectedEncoder == mTightEncoding) ? TIGHT_STREAMS :
+                                   (selectedEncoder == mZHextileEncoding) ? 2 : 1;
+    Boolean allocated = false;
+    for (unsigned char i = 0; i < nStreams; i++) {
+        if ((g_tightStreams[i] == NULL) && (g_fastStreams[i] == NULL)) {
+            if (!newStream(i)) {
+                if (i == 0) {
+                    dprintf("Failed to allocate compressor\n");
+                    return memFullErr;
+                }
+                dprintf("Not enough memory for ZLib stream %d, falling back to stream 0\n", i);
+                break;
+            }
+            initStream(g_tightStreams[i]);
+            initFastStream(g_fastStreams[i]);
+            g_tightResets |= 1 << i;
+            allocated = true;
         }
+    }
+
+    if (!vncFlags.zLibLoaded) {
         compressReset();
         vncFlags.zLibLoaded = true;
     }
@@ -70,6 +200,17 @@ OSErr VNCEncoder::compressSetup() {
         }
     #endif
 
+    if (allocated) {
+        unsigned long footprint = 0;
+        for (unsigned char i = 0; i < TIGHT_STREAMS; i++) {
+            footprint += streamFootprint(i);
+        }
+        #if !USE_IN_PLACE_COMPRESSION
+            footprint += COMP_OUT_BUF_SIZE;
+        #endif
+        dprintf("ZLib footprint is %ld bytes, %ld bytes remain free\n", footprint, FreeMem());
+    }
+
     // Make sure the "ANSI Libraries" segment is loaded
     strlen("");
 
@@ -77,19 +218,34 @@ OSErr VNCEncoder::compressSetup() {
 }
 
 void VNCEncoder::compressDestroy() {
-    DisposePtr((Ptr)g_deflator);
+    for (unsigned char i = 0; i < TIGHT_STREAMS; i++) {
+        if (g_tightStreams[i]) {
+            DisposePtr((Ptr)g_tightStreams[i]);
+        }
+        if (g_fastStreams[i]) {
+            DisposePtr((Ptr)g_fastStreams[i]);
+        }
+        g_tightStreams[i] = NULL;
+        g_fastStreams[i] = NULL;
+    }
     #if !USE_IN_PLACE_COMPRESSION
         DisposePtr((Ptr)s_outbuf);
-    #endif
-    g_deflator = NULL;
-    #if !USE_IN_PLACE_COMPRESSION
         s_outbuf = NULL;
     #endif
     vncFlags.zLibLoaded = false;
 }
 
 void VNCEncoder::compressReset() {
-    if (g_deflator) {
+    dprintf("Initializing ZLib at compression level %d [ResEdit]\n", vncConfig.zLibLevel);
+    for (unsigned char i = 0; i < TIGHT_STREAMS; i++) {
+        initStream(g_tightStreams[i]);
+        initFastStream(g_fastStreams[i]);
+    }
+    g_tightResets = (1 << TIGHT_STREAMS) - 1;
+}
+
+static void initStream(tdefl_compressor *d) {
+    if (d) {
         const int level = vncConfig.zLibLevel;
 
         // The number of dictionary probes to use at each compression level (0-10). 0=implies fastest/minimal possible probing.
@@ -104,8 +260,7 @@ void VNCEncoder::compressReset() {
         }
 
         // Initialize the low-level compressor.
-        dprintf("Initializing ZLib at compression level %d [ResEdit]\n", level);
-        tdefl_status status = tdefl_init(g_deflator, NULL, NULL, comp_flags);
+        tdefl_status status = tdefl_init(d, NULL, NULL, comp_flags);
         if (status != TDEFL_STATUS_OKAY) {
             dprintf("tdefl_init() failed!\n");
             return;
@@ -113,106 +268,319 @@ void VNCEncoder::compressReset() {
     }
 }
 
+static void initFastStream(FastStream *f) {
+    if (f) {
+        f->headerSent = false;
+        f->windowLen = 0;
+        f->bitBuf = 0;
+        f->bitCount = 0;
+        for (unsigned long i = 0; i <= f->hashMask; i++) {
+            f->hash[i] = 0;
+        }
+    }
+}
 
-#if USE_IN_PLACE_COMPRESSION
-    Boolean VNCEncoder::getCompressedChunk(EncoderPB &epb) {
-        // Write the uncompressed data slightly ahead of the
-        // compressed data, to leave room for zLib to work:
 
-        const unsigned long zLibScratchSpace = 1024;
+// Deflate sends Huffman codes starting with the most significant bit
 
-        // Compress the data
-        unsigned char *max = epb.dst + epb.bytesAvail;
-        unsigned char *next_out = epb.dst + sizeof(unsigned long); // Leave space for the zLib length
-        unsigned char *next_in;
+static unsigned short reverseBits(unsigned short code, unsigned char len) {
+    unsigned short rev = 0;
+    while (len--) {
+        rev = (rev << 1) | (code & 1);
+        code >>= 1;
+    }
+    return rev;
+}
 
-        size_t avail_out;
-        size_t avail_in = 0;
-        size_t total_in = 0;
-        size_t total_out = 0;
-        Boolean gotMoreAfterwards = true;
-        Boolean gotMore = true;
+static void fastDeflateTables() {
+    unsigned int i;
+    for (i = 0; i < 288; i++) {
+        unsigned short code;
+        if (i < 144)      {code = 0x030 + i;         s_litLen[i] = 8;}
+        else if (i < 256) {code = 0x190 + (i - 144); s_litLen[i] = 9;}
+        else if (i < 280) {code = i - 256;           s_litLen[i] = 7;}
+        else              {code = 0x0C0 + (i - 280); s_litLen[i] = 8;}
+        s_litCode[i] = reverseBits(code, s_litLen[i]);
+    }
+    for (i = 0; i < 29; i++) {
+        for (unsigned int len = s_lenBase[i]; (len < s_lenBase[i] + (1 << s_lenExtra[i])) && (len <= FAST_MAX_MATCH); len++) {
+            s_lenSym[len - 3] = i;
+        }
+    }
+    for (i = 0; i < 30; i++) {
+        s_distCode[i] = reverseBits(i, 5);
+        for (unsigned long dist = s_distBase[i]; dist < s_distBase[i] + (1UL << s_distExtra[i]); dist++) {
+            if (dist <= 512) {
+                s_distSymSmall[dist - 1] = i;
+            } else {
+                s_distSymLarge[(dist - 1) >> 8] = i;
+            }
+        }
+    }
+}
 
-        // Compression.
-        for (;;) {
-            // ZLib compressed all previous tile data, so get more to compress
-            if (gotMore && (avail_in == 0)) {
-                next_in = next_out + zLibScratchSpace;
-                if (next_in >= max) {
-                    dprintf("Temp buffer insufficient for uncompressed data. Aborting!\n");
-                    break;
-                }
+#define PUT_BITS(CODE, LEN) {                         \
+    bitBuf |= (unsigned long)(CODE) << bitCount;      \
+    bitCount += (LEN);                                \
+    while (bitCount >= 8) {                           \
+        *out++ = bitBuf;                              \
+        bitBuf >>= 8;                                 \
+        bitCount -= 8;                                \
+    }                                                 \
+}
 
-                EncoderPB epb2 = epb;
-                epb2.dst = next_in;
-                epb2.bytesAvail = max - next_in;
+// Starts a fixed Huffman block, preceded by the ZLib header at the
+// start of the stream
 
-                gotMoreAfterwards  = VNCEncoder::getUncompressedChunk(epb2);
-                gotMore = gotMoreAfterwards && !VNCEncoder::isNewSubrect();
+static unsigned char *fastBeginBlock(FastStream *f, unsigned char *out, Boolean final) {
+    unsigned long bitBuf = 0;
+    unsigned char bitCount = 0;
+    if (!f->headerSent) {
+        *out++ = 0x78;
+        *out++ = 0x01;
+        f->headerSent = true;
+    }
+    PUT_BITS(final ? 3 : 2, 3); // Fixed Huffman codes
+    f->bitBuf = bitBuf;
+    f->bitCount = bitCount;
+    return out;
+}
+
+// Ends the block and does the equivalent of a ZLib sync flush
+
+static unsigned char *fastEndBlock(FastStream *f, unsigned char *out) {
+    unsigned long bitBuf = f->bitBuf;
+    unsigned char bitCount = f->bitCount;
+    PUT_BITS(s_litCode[256], s_litLen[256]); // End of block
+    PUT_BITS(0, 3);                          // Empty stored block
+    if (bitCount) {
+        *out++ = bitBuf;
+    }
+    *out++ = 0x00;
+    *out++ = 0x00;
+    *out++ = 0xFF;
+    *out++ = 0xFF;
+    f->bitBuf = 0;
+    f->bitCount = 0;
+    return out;
+}
+
+// Ends the final block and the ZLib stream, which needs the Adler-32
+// checksum of all the uncompressed data
 
-                avail_in  = epb2.bytesWritten;
-                avail_out = next_in - next_out;
+static unsigned char *fastFinishBlock(FastStream *f, unsigned char *out, unsigned long adler) {
+    unsigned long bitBuf = f->bitBuf;
+    unsigned char bitCount = f->bitCount;
+    PUT_BITS(s_litCode[256], s_litLen[256]); // End of block
+    if (bitCount) {
+        *out++ = bitBuf;
+    }
+    *out++ = adler >> 24;
+    *out++ = adler >> 16;
+    *out++ = adler >> 8;
+    *out++ = adler;
+    f->bitBuf = 0;
+    f->bitCount = 0;
+    return out;
+}
+
+// Compresses data into the current block, returning the end of the output.
+// The output may overwrite the input, as the input is first copied into
+// the window. The input must be no more than half the window.
+
+static unsigned char *fastDeflateWindow(FastStream *f, unsigned char *out, const unsigned char *src, unsigned long len) {
+    // Make room in the window by discarding the oldest data
+    if (f->windowLen + len > f->windowSize) {
+        const unsigned long keep = min(f->windowLen, min(f->windowSize / 2, f->windowSize - len));
+        const unsigned long shift = f->windowLen - keep;
+        BlockMove(f->window + shift, f->window, keep);
+        f->windowLen = keep;
+        for (unsigned long i = 0; i <= f->hashMask; i++) {
+            f->hash[i] = (f->hash[i] > shift) ? f->hash[i] - shift : 0;
+        }
+    }
+    BlockMove(src, f->window + f->windowLen, len);
+
+    const unsigned char *win = f->window;
+    unsigned short *hash = f->hash;
+    const unsigned short hashMask = f->hashMask;
+    unsigned long p = f->windowLen;
+    const unsigned long end = p + len;
+    f->windowLen = end;
+
+    unsigned long bitBuf = f->bitBuf;
+    unsigned char bitCount = f->bitCount;
+
+    while (p < end) {
+        const unsigned long maxLen = min(FAST_MAX_MATCH, end - p);
+        unsigned long matchLen = 0, dist = 0;
+        if (maxLen >= 3) {
+            const unsigned short h = (((unsigned short)win[p] << 8) ^ ((unsigned short)win[p + 1] << 4) ^ win[p + 2]) & hashMask;
+            const unsigned long cand = hash[h];
+            hash[h] = p + 1;
+            if (cand) {
+                const unsigned char *a = win + cand - 1, *b = win + p;
+                while ((matchLen < maxLen) && (a[matchLen] == b[matchLen])) matchLen++;
+                dist = p + 1 - cand;
             }
+            if ((matchLen < 3) && p && (win[p - 1] == win[p])) {
+                // Try a run of the prior byte
+                const unsigned char c = win[p];
+                matchLen = 1;
+                while ((matchLen < maxLen) && (win[p + matchLen] == c)) matchLen++;
+                dist = 1;
+            }
+        }
+        if (matchLen >= 3) {
+            const unsigned char ls = s_lenSym[matchLen - 3];
+            PUT_BITS(s_litCode[257 + ls], s_litLen[257 + ls]);
+            PUT_BITS(matchLen - s_lenBase[ls], s_lenExtra[ls]);
+            const unsigned char ds = (dist <= 512) ? s_distSymSmall[dist - 1] : s_distSymLarge[(dist - 1) >> 8];
+            PUT_BITS(s_distCode[ds], 5);
+            PUT_BITS(dist - s_distBase[ds], s_distExtra[ds]);
+            p += matchLen;
+        } else {
+            PUT_BITS(s_litCode[win[p]], s_litLen[win[p]]);
+            p++;
+        }
+    }
 
-            // Compress as much of the input as possible (or all of it) to the output buffer.
+    f->bitBuf = bitBuf;
+    f->bitCount = bitCount;
+    return out;
+}
 
-            size_t in_bytes  = avail_in;
-            size_t out_bytes = avail_out;
-            tdefl_status status = tdefl_compress(g_deflator, next_in, &in_bytes, next_out, &out_bytes, gotMore ? TDEFL_NO_FLUSH : TDEFL_SYNC_FLUSH);
+#undef PUT_BITS
 
-            next_in  += in_bytes;
-            avail_in -= in_bytes;
-            total_in += in_bytes;
+// Compresses data into the current block, in pieces that fit the window.
+// At worst, fixed Huffman codes take nine bits per byte, so the output
+// can overtake the input by an eighth of the total.
 
-            next_out  += out_bytes;
-            avail_out -= out_bytes;
-            total_out += out_bytes;
+static unsigned char *fastDeflate(FastStream *f, unsigned char *out, const unsigned char *src, unsigned long len) {
+    const unsigned long piece = f->windowSize / 2;
+    while (len > piece) {
+        out = fastDeflateWindow(f, out, src, piece);
+        src += piece;
+        len -= piece;
+    }
+    return fastDeflateWindow(f, out, src, len);
+}
 
-            if ((status == TDEFL_STATUS_OKAY) && (avail_out != 0) && !gotMore ) {
-                // Compression completed successfully.
-                #if LOG_COMPRESSION_STATS
-                    dprintf("Deflated %ld bytes to %ld (%ld%%)\n", total_in, total_out, (total_out * 100) / total_in);
-                #endif
-                break;
-            }
-            else if (status != TDEFL_STATUS_OKAY) {
-                // Compression somehow failed.
-                dprintf("tdefl_compress() failed with status %d!\n", status);
+// Compresses a buffer as one block, returning the compressed length or
+// zero if the output might not fit. As the worst case is checked before
+// anything is written, the stream is left as is when the output does not fit.
+
+static unsigned long fastCompress(FastStream *f, const unsigned char *src, unsigned long srcLen, unsigned char *dst, unsigned long dstLen, Boolean final) {
+    if (VNCEncoder::compressBound(srcLen) > dstLen) {
+        dprintf("Output buffer full!\n");
+        return 0;
+    }
+    unsigned char *out = fastBeginBlock(f, dst, final);
+    out = fastDeflate(f, out, src, srcLen);
+    out = final ? fastFinishBlock(f, out, mz_adler32(MZ_ADLER32_INIT, src, srcLen)) : fastEndBlock(f, out);
+    return out - dst;
+}
+
+// Returns the most that compressing a number of bytes with a flush can
+// produce. Fixed Huffman codes take at most nine bits per byte, while
+// miniz sends a stored block in place of any block that would expand.
+
+unsigned long VNCEncoder::compressBound(unsigned long len) {
+    return len + len / 8 + FAST_BLOCK_OVERHEAD;
+}
+
+#if USE_IN_PLACE_COMPRESSION
+    /* Each ZRLE tile is encoded into a staging area at the end of the update
+     * buffer, which holds the largest possible tile, and is compressed from
+     * there straight into the output at the start of the buffer. The output
+     * may use all the space up to the staging area, and since the two never
+     * overlap, nothing has to be moved out of the way of the compressor.
+     */
+
+    Boolean VNCEncoder::getCompressedChunk(EncoderPB &epb) {
+        FastStream *f = g_fastStreams[0];
+        tdefl_compressor *d = g_tightStreams[0];
+
+        unsigned char *max = epb.dst + epb.bytesAvail;
+        unsigned char *stage = max - min(VNCEncodeZRLE::maxTileSize(), epb.bytesAvail / 2);
+        unsigned char *start = epb.dst + sizeof(unsigned long); // Leave space for the zLib length
+        unsigned char *next_out = f ? fastBeginBlock(f, start, false) : start;
+
+        // The subrect size is chosen so that the worst case for all of its
+        // tiles fits ahead of the staging area, and within the 64K length
+        const unsigned long room = min((unsigned long)(stage - start), 0xFFFFL);
+        const unsigned long tileMax = VNCEncodeZRLE::maxTileSize();
+
+        size_t total_in = 0;
+        Boolean gotMoreAfterwards = true;
+        Boolean gotMore = true;
+        Boolean failed = false;
+
+        while (gotMore) {
+            // Make sure the worst case still fits before taking another tile
+            if (compressBound(total_in + tileMax) > room) {
+                dprintf("Output buffer insufficient for compressed stream!\n");
+                failed = true;
                 break;
             }
 
-            /* Because we are compressing in-place, adjust avail_out to be the
-             * gap between where the last compressed data was written, and
-             * the start of the uncompressed data.
-             */
-            avail_out = next_in - next_out;
-
-            if (avail_out == 0) {
-                // Try to move the remaining uncompressed data to the end of
-                // the buffer to make room for further compression
-                unsigned char* copy_to = max - avail_in;
-                if (copy_to <= next_in) {
-                    dprintf("Output buffer insufficient for compressed stream. Aborting!\n");
+            EncoderPB epb2 = epb;
+            epb2.dst = stage;
+            epb2.bytesAvail = max - stage;
+
+            gotMoreAfterwards  = VNCEncoder::getUncompressedChunk(epb2);
+            gotMore = gotMoreAfterwards && !VNCEncoder::isNewSubrect();
+
+            const size_t avail_in = epb2.bytesWritten;
+            if (f) {
+                next_out = fastDeflate(f, next_out, stage, avail_in);
+            } else {
+                size_t in_bytes  = avail_in;
+                size_t out_bytes = stage - next_out;
+                tdefl_status status = tdefl_compress(d, stage, &in_bytes, next_out, &out_bytes, TDEFL_NO_FLUSH);
+                next_out += out_bytes;
+                if ((status != TDEFL_STATUS_OKAY) || (in_bytes != avail_in)) {
+                    // Compression somehow failed.
+                    dprintf("tdefl_compress() failed with status %d!\n", status);
+                    failed = true;
                     break;
                 }
-                if (avail_in) {
-                    dprintf("Moved %ld bytes of data to free up %ld bytes of space in compression buffer!\n", avail_in, copy_to - next_out);
-                    BlockMove((Ptr)next_in, (Ptr)copy_to, avail_in);
-                }
-                next_in = copy_to;
-                avail_out = next_in - next_out;
             }
+            total_in += avail_in;
+        }
+
+        // End the chunk on a tile boundary with a sync flush
+        if (f) {
+            next_out = fastEndBlock(f, next_out);
+        } else if (!failed) {
+            size_t in_bytes  = 0;
+            size_t out_bytes = stage - next_out;
+            tdefl_status status = tdefl_compress(d, NULL, &in_bytes, next_out, &out_bytes, TDEFL_SYNC_FLUSH);
+            next_out += out_bytes;
+            if ((status != TDEFL_STATUS_OKAY) || (next_out == stage)) {
+                dprintf("tdefl_compress() failed to flush with status %d!\n", status);
+                failed = true;
+            }
+        }
+
+        const size_t total_out = next_out - start;
+        #if LOG_COMPRESSION_STATS
+            dprintf("Deflated %ld bytes to %ld (%ld%%)\n", total_in, total_out, (total_out * 100) / max(total_in, 1));
+        #endif
+
+        if (failed || (total_out > 0xFFFF)) {
+            // The subrect cannot be completed, so the connection cannot go on
+            dprintf("too much data to send!\n");
+            vncState = VNC_ERROR;
+            epb.bytesWritten = 0;
+            return false;
         }
 
         // Write the length byte
         *((unsigned long*)epb.dst) = total_out;
 
         // Send the data
-        if(total_out > 0xFFFF) {
-            dprintf("too much data to send!\n");
-        } else {
-            epb.bytesWritten = total_out + sizeof(unsigned long);
-        }
+        epb.bytesWritten = total_out + sizeof(unsigned long);
         return gotMoreAfterwards;
     }
 #else
@@ -230,8 +598,31 @@ void VNCEncoder::compressReset() {
         Boolean gotMoreAfterwards = true;
         Boolean gotMore = true;
 
+        // The fast deflater compresses each tile into the output buffer
+        FastStream *f = g_fastStreams[0];
+        if (f) {
+            next_out = fastBeginBlock(f, next_out, false);
+            while (gotMore) {
+                EncoderPB epb;
+                epb.dst = fbUpdateBuffer;
+                epb.bytesAvail = fbUpdateBufferSize;
+                gotMoreAfterwards = getUncompressedChunk(epb);
+                gotMore = gotMoreAfterwards && !VNCEncoder::isNewSubrect();
+
+                avail_in = epb.bytesWritten;
+                if (next_out + compressBound(avail_in) > s_outbuf + COMP_OUT_BUF_SIZE) {
+                    dprintf("Output buffer full!\n");
+                    break;
+                }
+                next_out = fastDeflate(f, next_out, fbUpdateBuffer, avail_in);
+                total_in += avail_in;
+            }
+            next_out = fastEndBlock(f, next_out);
+            total_out = next_out - s_outbuf - sizeof(unsigned long);
+        }
+
         // Compression.
-        for (;;) {
+        while (!f) {
             if (!avail_in && gotMore) {
                 EncoderPB epb;
                 epb.dst = fbUpdateBuffer;
@@ -246,7 +637,7 @@ void VNCEncoder::compressReset() {
 
             size_t in_bytes  = avail_in;
             size_t out_bytes = avail_out;
-            tdefl_status status = tdefl_compress(g_deflator, next_in, &in_bytes, next_out, &out_bytes, gotMore ? TDEFL_NO_FLUSH : TDEFL_SYNC_FLUSH);
+            tdefl_status status = tdefl_compress(g_tightStreams[0], next_in, &in_bytes, next_out, &out_bytes, gotMore ? TDEFL_NO_FLUSH : TDEFL_SYNC_FLUSH);
 
             next_in  += in_bytes;
             avail_in -= in_bytes;
@@ -282,10 +673,85 @@ void VNCEncoder::compressReset() {
         // Send the data
         if(total_out > 0xFFFF) {
             dprintf("too much data to send!\n");
-        } else {
-            wds->length = total_out + sizeof(unsigned long);
-            wds->ptr = (Ptr) s_outbuf;
+            vncState = VNC_ERROR;
+            wds->length = 0;
+            return false;
         }
+        wds->length = total_out + sizeof(unsigned long);
+        wds->ptr = (Ptr) s_outbuf;
         return gotMoreAfterwards;
     }
 #endif
+
+// Returns the stream to use for a kind of data, which is the preferred
+// one if it could be allocated, or else stream 0
+
+unsigned char VNCEncoder::getStream(unsigned char preferred) {
+    return (g_tightStreams[preferred] || g_fastStreams[preferred]) ? preferred : 0;
+}
+
+// Returns the reset bits for the Tight compression control byte
+
+unsigned char VNCEncoder::takeTightResets() {
+    const unsigned char resets = g_tightResets;
+    g_tightResets = 0;
+    return resets;
+}
+
+// Compresses a block of data on a stream with a sync flush, returning
+// the compressed length or zero if the output did not fit
+
+unsigned long VNCEncoder::compressStream(unsigned char stream, const unsigned char *src, unsigned long srcLen, unsigned char *dst, unsigned long dstLen) {
+    if (g_fastStreams[stream]) {
+        return fastCompress(g_fastStreams[stream], src, srcLen, dst, dstLen, false);
+    }
+    unsigned long total_out = 0;
+    for (;;) {
+        size_t in_bytes  = srcLen;
+        size_t out_bytes = dstLen - total_out;
+        tdefl_status status = tdefl_compress(g_tightStreams[stream], src, &in_bytes, dst + total_out, &out_bytes, TDEFL_SYNC_FLUSH);
+
+        src       += in_bytes;
+        srcLen    -= in_bytes;
+        total_out += out_bytes;
+
+        if (status != TDEFL_STATUS_OKAY) {
+            dprintf("tdefl_compress() failed with status %d!\n", status);
+            return 0;
+        }
+        if (total_out == dstLen) {
+            dprintf("Output buffer full!\n");
+            return 0;
+        }
+        if (srcLen == 0) {
+            // The flush is complete once there is space left over
+            return total_out;
+        }
+    }
+}
+
+// Compresses the image data of a PNG as a complete ZLib stream, returning
+// the compressed length or zero if the output did not fit. Stream 0 is
+// restarted for each image, as TightPNG has no use for it otherwise.
+
+unsigned long VNCEncoder::compressPNG(const unsigned char *src, unsigned long srcLen, unsigned char *dst, unsigned long dstLen) {
+    if (g_fastStreams[0]) {
+        initFastStream(g_fastStreams[0]);
+        return fastCompress(g_fastStreams[0], src, srcLen, dst, dstLen, true);
+    }
+    initStream(g_tightStreams[0]);
+    size_t in_bytes  = srcLen;
+    size_t out_bytes = dstLen;
+    tdefl_status status = tdefl_compress(g_tightStreams[0], src, &in_bytes, dst, &out_bytes, TDEFL_FINISH);
+    if (status != TDEFL_STATUS_DONE) {
+        dprintf("tdefl_compress() failed with status %d!\n", status);
+        return 0;
+    }
+    return out_bytes;
+}
+
+// Returns the CRC of a PNG chunk
+
+unsigned long VNCEncoder::checksumPNG(const unsigned char *src, unsigned long srcLen) {
+    return mz_crc32(MZ_CRC32_INIT, src, srcLen);
+}
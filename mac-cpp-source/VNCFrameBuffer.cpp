@@ -21,6 +21,8 @@
 #include "VNCServer.h"
 #include "VNCPalette.h"
 #include "VNCFrameBuffer.h"
+#include "VNCScreenHash.h"
+#include "DebugLog.h"
 
 const unsigned long &ScrnBase = *(unsigned long*) 0x824;
 
@@ -35,8 +37,64 @@ BitMap vncBits = {0};
     unsigned long fbDepth;
 #endif
 
+#if USE_FILE_FRAMEBUFFER
+    /**
+     * For repeatable measurements, the framebuffer can be loaded from
+     * a raw image file in the application folder rather than taken from
+     * the screen. The file holds one or more frames which match the
+     * geometry and depth of the screen, or of the build when it is built
+     * for a fixed one, so the monochrome build serves them on a color Mac
+     * as well. Successive frames are shown, one after the other, so that
+     * clients see a repeatable sequence of screen updates. This is for
+     * measuring on a Mac or in an emulator. The host build only covers
+     * the encoders and the screen hash, since the server runs on MacTCP
+     * completion routines and sends its messages as they sit in memory,
+     * which is only in network byte order on the 68k.
+     */
+
+    static StringPtr     fileFrameName  = "\pMiniVNC Framebuffer";
+    static unsigned char *fileFrames    = 0;
+    static unsigned int  fileFrameCount = 0;
+    static unsigned int  fileFrame      = 0;
+    static unsigned long fileFrameTicks = 0;
+
+    #define FILE_FRAME_TICKS 30 // Minimum ticks between frames
+
+    static OSErr loadFileFrames();
+#endif
+
+#if defined(VNC_FB_MONOCHROME)
+    /**
+     * On a color Mac, the monochrome build serves a virtual B&W copy of
+     * the screen. Rather than redoing the CopyBits for the whole screen on
+     * every pass, the source pixmap is hashed in bands of SRC_BAND_ROWS
+     * rows and only the bands whose hashes changed are copied. This is
+     * only done while a client is connected.
+     */
+
+    #define SRC_BAND_ROWS 16
+
+    static unsigned long *srcBandHashes = 0;
+
+    static void copyChangedBands(Boolean copyAll);
+#endif
+
 OSErr VNCFrameBuffer::setup() {
-    if (checkScreenResolution()) {
+    const Boolean isMatch = checkScreenResolution();
+    #if USE_FILE_FRAMEBUFFER
+        #if defined(VNC_FB_MONOCHROME)
+            const Boolean useFile = loadFileFrames() == noErr;
+        #else
+            const Boolean useFile = isMatch && (loadFileFrames() == noErr);
+        #endif
+    #else
+        const Boolean useFile = false;
+    #endif
+    if (useFile) {
+        #if USE_FILE_FRAMEBUFFER
+            vncBits.baseAddr = (Ptr) fileFrames;
+        #endif
+    } else if (isMatch) {
         vncBits.baseAddr = (Ptr) ScrnBase;
     }
     #if defined(VNC_FB_MONOCHROME)
@@ -54,6 +112,14 @@ OSErr VNCFrameBuffer::setup() {
             OSErr err = MemError();
             if (err != noErr)
                 return err;
+
+            const unsigned long hashSize = (fbHeight + SRC_BAND_ROWS - 1) / SRC_BAND_ROWS * sizeof(unsigned long);
+            srcBandHashes = (unsigned long*) NewPtr(hashSize);
+            err = MemError();
+            if (err != noErr)
+                return err;
+            dprintf("Reserved %ld bytes for virtual B&W screen hashes\n", hashSize);
+            copyChangedBands(true);
         }
     #endif
 
@@ -68,10 +134,24 @@ OSErr VNCFrameBuffer::setup() {
 }
 
 OSErr VNCFrameBuffer::destroy() {
+    #if USE_FILE_FRAMEBUFFER
+        if (fileFrames) {
+            DisposePtr((Ptr)fileFrames);
+            vncBits.baseAddr = 0;
+            fileFrames = 0;
+            fileFrameCount = 0;
+        }
+    #endif
     if(vncBits.baseAddr && vncBits.baseAddr != (Ptr) ScrnBase) {
         DisposePtr((Ptr)vncBits.baseAddr);
         vncBits.baseAddr = 0;
     }
+    #if defined(VNC_FB_MONOCHROME)
+        if (srcBandHashes) {
+            DisposePtr((Ptr)srcBandHashes);
+            srcBandHashes = 0;
+        }
+    #endif
     VNCPalette::destroy();
     return noErr;
 }
@@ -107,9 +187,9 @@ Boolean VNCFrameBuffer::checkScreenResolution() {
             ShowAlert('ERR', 128, "This build of Mini VNC will only work with %d colors.", VNC_FB_PALETTE_SIZE);
         }
     #else
-        Boolean isMatch = (gdDepth == 1) || (gdDepth == 2) || (gdDepth == 4) || (gdDepth == 8);
+        Boolean isMatch = (gdDepth == 1) || (gdDepth == 2) || (gdDepth == 4) || (gdDepth == 8) || (gdDepth == 16) || (gdDepth == 32);
         if (!isMatch) {
-            ShowAlert('ERR', 128, "Please set your monitor to Black & White, 4, 16 or 256 grays or colors.");
+            ShowAlert('ERR', 128, "Please set your monitor to Black & White, 4, 16 or 256 grays or colors, thousands or millions of colors.");
         }
     #endif
 
@@ -127,14 +207,136 @@ Boolean VNCFrameBuffer::checkScreenResolution() {
 }
 
 void VNCFrameBuffer::idleTask() {
+    #if USE_FILE_FRAMEBUFFER
+        if (fileFrames) {
+            // Advance to the next frame, but not while an update is being sent
+            if ((fileFrameCount > 1) && !vncFlags.fbUpdateInProgress && ((TickCount() - fileFrameTicks) >= FILE_FRAME_TICKS)) {
+                #ifndef VNC_FB_WIDTH
+                    const unsigned long frameSize = (unsigned long)fbStride * fbHeight;
+                #else
+                    const unsigned long frameSize = (unsigned long)VNC_BYTES_PER_LINE * VNC_FB_HEIGHT;
+                #endif
+                fileFrame = (fileFrame + 1) % fileFrameCount;
+                fileFrameTicks = TickCount();
+                vncBits.baseAddr = (Ptr) (fileFrames + frameSize * fileFrame);
+            }
+            return;
+        }
+    #endif
     #if defined(VNC_FB_MONOCHROME)
-        if (vncBits.baseAddr && (vncBits.baseAddr != (Ptr) ScrnBase)) {
-            // We are on a color Mac, do a dithered copy
-            CopyBits(&qd.screenBits, &vncBits, &vncBits.bounds, &vncBits.bounds, srcCopy, NULL);
+        if (srcBandHashes && vncServerActive()) {
+            // We are on a color Mac, do a dithered copy of what changed
+            copyChangedBands(false);
         }
     #endif
 }
 
+#if defined(VNC_FB_MONOCHROME)
+    static void copyChangedBands(Boolean copyAll) {
+        #ifdef VNC_FB_WIDTH
+            const unsigned int fbWidth = VNC_FB_WIDTH;
+        #endif
+        #ifdef VNC_FB_HEIGHT
+            const unsigned int fbHeight = VNC_FB_HEIGHT;
+        #endif
+        PixMapPtr gpx = *((*GetMainDevice())->gdPMap);
+        const unsigned long srcStride = gpx->rowBytes & 0x3FFF;
+        const unsigned long srcLongs  = srcStride / sizeof(unsigned long);
+        const unsigned char *srcRow   = (unsigned char*) gpx->baseAddr;
+
+        int copyTop = -1;
+        for (unsigned int y = 0, band = 0; y < fbHeight; band++) {
+            const unsigned int bandTop    = y;
+            const unsigned int bandBottom = min(y + SRC_BAND_ROWS, fbHeight);
+
+            // Mix the longs of the band into a hash, as for the screen hashes
+            unsigned long hash = 0;
+            for (; y < bandBottom; y++, srcRow += srcStride) {
+                const unsigned long *src = (const unsigned long*) srcRow;
+                for (unsigned long i = srcLongs; i--;) {
+                    HASH_MIX(hash, *src++);
+                }
+                if (srcStride & 2) {
+                    HASH_MIX(hash, *(const unsigned short*) src);
+                }
+            }
+
+            const Boolean changed = copyAll || (hash != srcBandHashes[band]);
+            srcBandHashes[band] = hash;
+
+            // Copy each run of changed bands in one go
+            if (changed && (copyTop < 0)) {
+                copyTop = bandTop;
+            }
+            if ((!changed || (bandBottom == fbHeight)) && (copyTop >= 0)) {
+                Rect r;
+                SetRect(&r, 0, copyTop, fbWidth, changed ? bandBottom : bandTop);
+                CopyBits(&qd.screenBits, &vncBits, &r, &r, srcCopy, NULL);
+                copyTop = -1;
+            }
+        }
+    }
+#endif
+
 unsigned char *VNCFrameBuffer::getBaseAddr() {
     return (unsigned char*) vncBits.baseAddr;
-}
\ No newline at end of file
+}
+
+#if USE_FILE_FRAMEBUFFER
+    static OSErr loadFileFrames() {
+        #ifndef VNC_FB_WIDTH
+            const unsigned long frameSize = (unsigned long)fbStride * fbHeight;
+        #else
+            const unsigned long frameSize = (unsigned long)VNC_BYTES_PER_LINE * VNC_FB_HEIGHT;
+        #endif
+
+        FSSpec fsSpec;
+        short refNum;
+        OSErr err = FSMakeFSSpec(0, 0, fileFrameName, &fsSpec);
+        if (err == noErr) {
+            err = FSpOpenDF(&fsSpec, fsRdPerm, &refNum);
+        }
+        if (err != noErr) {
+            dprintf("No \"%#s\" file, serving the screen\n", fileFrameName);
+            return err;
+        }
+
+        long fileSize;
+        err = GetEOF(refNum, &fileSize);
+        if ((err == noErr) && (fileSize < frameSize)) {
+            dprintf("\"%#s\" is smaller than one %ld byte frame\n", fileFrameName, frameSize);
+            err = eofErr;
+        }
+
+        // Load as many frames as will fit in memory
+
+        if (err == noErr) {
+            for (fileFrameCount = fileSize / frameSize; fileFrameCount; fileFrameCount--) {
+                fileFrames = (unsigned char*) NewPtr(frameSize * fileFrameCount);
+                if (MemError() == noErr) break;
+            }
+            err = fileFrameCount ? noErr : memFullErr;
+        }
+
+        if (err == noErr) {
+            long bytesRead = frameSize * fileFrameCount;
+            err = FSRead(refNum, &bytesRead, fileFrames);
+        }
+        FSClose(refNum);
+
+        if (err != noErr) {
+            dprintf("Failed to load \"%#s\" (OSErr:%d)\n", fileFrameName, err);
+            if (fileFrames) {
+                DisposePtr((Ptr)fileFrames);
+                fileFrames = 0;
+            }
+            fileFrameCount = 0;
+            return err;
+        }
+
+        dprintf("Reserved %ld bytes for %d frames from \"%#s\"\n", frameSize * fileFrameCount, fileFrameCount, fileFrameName);
+        fileFrame = 0;
+        fileFrameTicks = TickCount();
+        return noErr;
+    }
+#endif
@@ -32,6 +32,9 @@ VNCPixelFormat fbPixFormat;
 VNCPixelFormat pendingPixFormat;
 
 unsigned long *vncTrueColors = 0;
+unsigned char *vncTileColors = 0;
+unsigned long  vncTileColorsSize;
+unsigned char  tileColorBytes = 0;
 
 OSErr VNCPalette::setup() {
     ctSeed = 10;
@@ -43,6 +46,11 @@ OSErr VNCPalette::destroy() {
         DisposePtr((Ptr)vncTrueColors);
         vncTrueColors = 0;
     }
+    if (vncTileColors) {
+        DisposePtr((Ptr)vncTileColors);
+        vncTileColors = 0;
+    }
+    tileColorBytes = 0;
     return noErr;
 }
 
@@ -60,6 +68,55 @@ void VNCPalette::setPixelFormat(const VNCPixelFormat &format) {
     BlockMove(&format, &pendingPixFormat, sizeof(VNCPixelFormat));
 }
 
+// Returns the pixel format which is offered to the client on connection.
+// At thousands or millions of colors, this is the format of the screen.
+
+void VNCPalette::getNativeFormat(VNCPixelFormat &format) {
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    format.bigEndian = 1;
+    if (fbDepth > 8) {
+        const unsigned char bits = (fbDepth == 16) ? 5 : 8;
+        format.trueColor = 1;
+        format.bitsPerPixel = fbDepth;
+        format.depth = bits * 3;
+        format.redMax = (1 << bits) - 1;
+        format.greenMax = (1 << bits) - 1;
+        format.blueMax = (1 << bits) - 1;
+        format.redShift = bits * 2;
+        format.greenShift = bits;
+        format.blueShift = 0;
+    } else {
+        format.trueColor = 0;
+        format.bitsPerPixel = 8;
+        format.depth = fbDepth;
+        format.redMax = 3;    // 2 bits
+        format.greenMax = 7;  // 3 bits
+        format.blueMax = 3;   // 2 bits
+        format.redShift = 5;
+        format.greenShift = 2;
+        format.blueShift = 0;
+    }
+}
+
+// Returns whether the client's pixels are laid out as on the screen, so
+// that they can be sent without translation, other than the byte order
+
+Boolean VNCPalette::isNativeLayout() {
+    VNCPixelFormat native;
+    getNativeFormat(native);
+    return native.trueColor &&
+           fbPixFormat.trueColor &&
+           (fbPixFormat.bitsPerPixel == native.bitsPerPixel) &&
+           (fbPixFormat.redMax       == native.redMax) &&
+           (fbPixFormat.greenMax     == native.greenMax) &&
+           (fbPixFormat.blueMax      == native.blueMax) &&
+           (fbPixFormat.redShift     == native.redShift) &&
+           (fbPixFormat.greenShift   == native.greenShift) &&
+           (fbPixFormat.blueShift    == native.blueShift);
+}
+
 Boolean VNCPalette::hasChangesPending() {
     return VNCPalette::hasWaitingColorMapUpdate() || pendingPixFormat.bitsPerPixel;
 }
@@ -90,7 +147,11 @@ void VNCPalette::setIndexedColor(unsigned int i, int red, int green, int blue) {
 
 void VNCPalette::idleTask() {
     #if !defined(VNC_FB_MONOCHROME)
-        if (hasColorQD) {
+        #ifdef VNC_FB_BITS_PER_PIX
+            const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+        #endif
+        // Thousands or millions of colors do not use the color table
+        if (hasColorQD && (fbDepth <= 8)) {
             checkColorTable();
         }
     #endif
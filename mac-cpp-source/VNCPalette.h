@@ -20,8 +20,12 @@
 #include "VNCTypes.h"
 
 extern unsigned char bytesPerColor;
+extern unsigned char tileColorBytes;
+extern unsigned char *vncTileColors;
 extern VNCPixelFormat fbPixFormat;
 
+typedef unsigned char *(*ExpandTileProc)(const unsigned char *src, unsigned char *dst, unsigned short pixels);
+
 class VNCPalette {
     public:
         static unsigned char black, white;
@@ -41,6 +45,9 @@ class VNCPalette {
         static void beginNewSession(const VNCPixelFormat &format);
         static void setPixelFormat(const VNCPixelFormat &format);
 
+        static void getNativeFormat(VNCPixelFormat &format);
+        static Boolean isNativeLayout();
+
         static void setIndexedColor(unsigned int i, int red, int green, int blue);
 
         static void prepareColorRoutines(Boolean isCPIXEL);
@@ -50,9 +57,18 @@ class VNCPalette {
 
         static void prepareTrueColorRoutines(Boolean isCPIXEL);
         static unsigned char *emitTrueColor(unsigned char *dst, unsigned char color);
+        static unsigned char *emitDirectColor(unsigned char *dst, unsigned long pixel);
+
+        static void prepareTileRoutines(Boolean isCPIXEL);
+        static ExpandTileProc expandTile;
 
         #define setupPIXEL()   {VNCPalette::prepareColorRoutines(false);}
         #define setupCPIXEL()  {VNCPalette::prepareColorRoutines(true);}
 
         #define emitColor(A,B)  {if (!fbPixFormat.trueColor) {*A++ = B;} else {A = VNCPalette::emitTrueColor(A, B);}  }
+
+        // Emits a color from the lookup tables when they are ready for the
+        // tile encoder's pixel format, or else as emitColor()
+        #define emitTileColor(A,B) {if (tileColorBytes) {const unsigned char *p = vncTileColors + ((unsigned short)(B) << 2); \
+                                    unsigned char n = tileColorBytes; do {*A++ = *p++;} while (--n);} else emitColor(A,B);}
 };
\ No newline at end of file
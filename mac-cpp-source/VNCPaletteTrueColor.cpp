@@ -26,13 +26,23 @@
 #include "VNCTypes.h"
 
 static unsigned char pixelShift;
+static Boolean lastIsCPIXEL; // As last given to prepareTileRoutines()
+static Boolean tablesValid;  // Whether vncTileColors holds the current colors
 static unsigned long pixelMask;
 
 unsigned long ctSeed;
 extern unsigned long *vncTrueColors;
+extern unsigned long  vncTileColorsSize;
 
 extern VNCPixelFormat pendingPixFormat;
 
+static unsigned long swapBytes(unsigned long color) {
+    return ((color & 0x000000ff) << 24u) |
+           ((color & 0x0000ff00) << 8u)  |
+           ((color & 0x00ff0000) >> 8u)  |
+           ((color & 0xff000000) >> 24u);
+}
+
 static void setTrueColor(unsigned int i, int red, int green, int blue) {
     const unsigned long r = ((unsigned long)red)   * fbPixFormat.redMax   / 0xFFFF;
     const unsigned long g = ((unsigned long)green) * fbPixFormat.greenMax / 0xFFFF;
@@ -41,13 +51,62 @@ static void setTrueColor(unsigned int i, int red, int green, int blue) {
     if(fbPixFormat.bigEndian) {
         vncTrueColors[i] = color;
     } else {
-        vncTrueColors[i] = ((color & 0x000000ff) << 24u) |
-                           ((color & 0x0000ff00) << 8u)  |
-                           ((color & 0x00ff0000) >> 8u)  |
-                           ((color & 0xff000000) >> 24u);
+        vncTrueColors[i] = swapBytes(color);
     }
 }
 
+#if !defined(VNC_FB_MONOCHROME)
+    /* At thousands or millions of colors there is no color table. Instead,
+     * vncTrueColors holds black and white, for the cursor, followed by a
+     * table for each of red, green and blue which gives the client's color
+     * for each level of that component on the screen. A pixel is translated
+     * by OR'ing together the colors for its three components, or is sent
+     * as it is, when the client's pixels are laid out as on the screen.
+     */
+
+    #define DIRECT_TABLES 2 // Index of the red table in vncTrueColors
+
+    static unsigned char nativeBits;   // Bits per color component on the screen
+    static unsigned long nativeMask;
+    static Boolean       directMatch;  // As given by isNativeLayout()
+
+    static OSErr updateDirectColors() {
+        #ifdef VNC_FB_BITS_PER_PIX
+            const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+        #endif
+        if (vncTrueColors == NULL) {
+            const unsigned long size = (DIRECT_TABLES + 256 * 3) * sizeof(unsigned long);
+            vncTrueColors = (unsigned long *) NewPtr(size);
+            if (MemError() != noErr) {
+                dprintf("Failed to allocate true color table\n");
+                return MemError();
+            }
+            dprintf("Reserved %ld bytes for true color table\n", size);
+        }
+
+        nativeBits = (fbDepth == 16) ? 5 : 8;
+        nativeMask = (1 << nativeBits) - 1;
+        for (unsigned int i = 0; i <= nativeMask; i++) {
+            // Round up, so that levels come out unchanged where the client
+            // has as many levels as the screen
+            const unsigned long level = (i * 0xFFFFL + nativeMask - 1) / nativeMask;
+            setTrueColor(DIRECT_TABLES +       i, level, 0, 0);
+            setTrueColor(DIRECT_TABLES + 256 + i, 0, level, 0);
+            setTrueColor(DIRECT_TABLES + 512 + i, 0, 0, level);
+        }
+        setTrueColor(0, 0, 0, 0);
+        setTrueColor(1, 0xFFFF, 0xFFFF, 0xFFFF);
+        VNCPalette::black = 0;
+        VNCPalette::white = 1;
+
+        directMatch = VNCPalette::isNativeLayout();
+        vncFlags.fbColorMapNeedsUpdate = false;
+
+        dprintf("Direct color ready (%d bits, %s)\n", fbDepth, directMatch ? "native layout" : "translated");
+        return noErr;
+    }
+#endif
+
 void VNCPalette::checkColorTable() {
     // Find the color table associated with the device
     GDHandle gdh = GetMainDevice();
@@ -77,6 +136,9 @@ OSErr VNCPalette::updateColorTable() {
             #ifdef VNC_FB_BITS_PER_PIX
                 const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
             #endif
+            if (fbDepth > 8) {
+                return fbPixFormat.trueColor ? updateDirectColors() : noErr;
+            }
             const unsigned int nColors = 1 << fbDepth;
 
             // Allocate the color table, if necessary
@@ -85,12 +147,29 @@ OSErr VNCPalette::updateColorTable() {
                 const unsigned long size = nColors * sizeof(unsigned long);
                 vncTrueColors = (unsigned long *) NewPtr(size);
                 if (MemError() != noErr) {
-                    dprintf("Failed to allocate true color table\n", size);
+                    dprintf("Failed to allocate %ld bytes for true color table\n", size);
                     return MemError();
                 }
                 dprintf("Reserved %ld bytes for true color table\n", size);
             }
 
+            // Allocate the lookup tables for expanding tiles, which hold
+            // up to four bytes for each color, followed by the pixels for
+            // each byte of native pixels, if there is more than one to a
+            // byte. These are optional, so failure is not an error.
+
+            if (fbPixFormat.trueColor && (vncTileColors == NULL)) {
+                const unsigned long size = nColors * 4 + ((fbDepth < 8) ? 256L * (8 / fbDepth) * 4 : 0);
+                vncTileColors = (unsigned char *) NewPtr(size);
+                if (MemError() != noErr) {
+                    dprintf("Not enough memory for color lookup tables\n");
+                    vncTileColors = NULL;
+                } else {
+                    vncTileColorsSize = size;
+                    dprintf("Reserved %ld bytes for color lookup tables\n", size);
+                }
+            }
+
             // Find the color table associated with the device
             GDHandle gdh = GetMainDevice();
             PixMapHandle gpx = (*gdh)->gdPMap;
@@ -119,6 +198,10 @@ OSErr VNCPalette::updateColorTable() {
                     SetPort(savedPort);
 
                     dprintf("Color palette ready (size:%d b:%d w:%d)\n", nColors, VNCPalette::black, VNCPalette::white);
+
+                    // Rebuild the lookup tables for the new colors
+                    tablesValid = false;
+                    prepareTileRoutines(lastIsCPIXEL);
                 } else {
                     dprintf("Palette size mismatch!\n");
                 }
@@ -158,6 +241,227 @@ unsigned char *VNCPalette::emitTrueColor(unsigned char *dst, unsigned char color
     return dst + bytesPerColor;
 }
 
+#if !defined(VNC_FB_MONOCHROME)
+    unsigned char *VNCPalette::emitDirectColor(unsigned char *dst, unsigned long pixel) {
+        unsigned long color;
+        if (directMatch) {
+            color = fbPixFormat.bigEndian ? pixel : swapBytes(pixel);
+        } else {
+            const unsigned long *table = vncTrueColors + DIRECT_TABLES;
+            color = table[      ((pixel >> (nativeBits * 2)) & nativeMask)] |
+                    table[256 + ((pixel >>  nativeBits)      & nativeMask)] |
+                    table[512 + ( pixel                      & nativeMask)];
+        }
+        const unsigned long packed = color << pixelShift;
+        *(unsigned long *)dst = (((*(unsigned long *)dst) ^ packed) & pixelMask) ^ packed;
+        return dst + bytesPerColor;
+    }
+#endif
+
 #pragma optimize_for_size reset
 #pragma a6frames reset
 #pragma code68020 reset
+
+#if !defined(VNC_FB_MONOCHROME)
+    /* Raw tiles are written by expanding native pixels, packed at the screen
+     * depth, into indexed or true color pixels. A variant is generated for
+     * each pair of depth and pixel size, so that the shifts and the pixel
+     * size are constants in the inner loop. The variant is chosen when the
+     * encoder is set up, rather than for each pixel as with emitColor().
+     */
+
+    ExpandTileProc VNCPalette::expandTile = 0;
+
+    // As in "VNCEncodeTilesC.cpp", which the host test harness overrides
+    #ifndef GET_LONG
+        #define GET_LONG(PTR) (*(const unsigned long*)(PTR))
+    #endif
+
+    static unsigned char expandShift; // Moves the true color to the top bytes
+
+    #define EXPAND_INDEXED(DST,C)  {*DST++ = C;}
+    #define EXPAND_TRUE_1(DST,C)   {const unsigned long v = vncTrueColors[C] << shift; \
+                                    *DST++ = v >> 24;}
+    #define EXPAND_TRUE_2(DST,C)   {const unsigned long v = vncTrueColors[C] << shift; \
+                                    *DST++ = v >> 24; *DST++ = v >> 16;}
+    #define EXPAND_TRUE_3(DST,C)   {const unsigned long v = vncTrueColors[C] << shift; \
+                                    *DST++ = v >> 24; *DST++ = v >> 16; *DST++ = v >> 8;}
+    #define EXPAND_TRUE_4(DST,C)   {const unsigned long v = vncTrueColors[C]; \
+                                    *DST++ = v >> 24; *DST++ = v >> 16; *DST++ = v >> 8; *DST++ = v;}
+
+    #define DEFINE_EXPAND_TILE(NAME, DEPTH, EMIT)                                                 \
+        static unsigned char *NAME(const unsigned char *src, unsigned char *dst, unsigned short pixels) { \
+            const unsigned long *src32 = (const unsigned long*)src;                                 \
+            const unsigned char shift = expandShift;                                                \
+            while (pixels) {                                                                        \
+                unsigned long packed = GET_LONG(src32++);                                           \
+                unsigned char n = min(pixels, 32 / DEPTH);                                          \
+                pixels -= n;                                                                        \
+                do {                                                                                \
+                    const unsigned char color = packed >> (32 - DEPTH);                             \
+                    packed <<= DEPTH;                                                               \
+                    EMIT(dst, color);                                                               \
+                } while (--n);                                                                      \
+            }                                                                                       \
+            return dst;                                                                             \
+        }
+
+    #define DEFINE_EXPAND_DEPTH(DEPTH)                                       \
+        DEFINE_EXPAND_TILE(expandIndexed_##DEPTH, DEPTH, EXPAND_INDEXED)     \
+        DEFINE_EXPAND_TILE(expandTrue1_##DEPTH,   DEPTH, EXPAND_TRUE_1)      \
+        DEFINE_EXPAND_TILE(expandTrue2_##DEPTH,   DEPTH, EXPAND_TRUE_2)      \
+        DEFINE_EXPAND_TILE(expandTrue3_##DEPTH,   DEPTH, EXPAND_TRUE_3)      \
+        DEFINE_EXPAND_TILE(expandTrue4_##DEPTH,   DEPTH, EXPAND_TRUE_4)
+
+    DEFINE_EXPAND_DEPTH(1)
+    DEFINE_EXPAND_DEPTH(2)
+    DEFINE_EXPAND_DEPTH(4)
+    DEFINE_EXPAND_DEPTH(8)
+
+    // Native 8-bit pixels are already in the indexed format
+
+    static unsigned char *copyIndexed_8(const unsigned char *src, unsigned char *dst, unsigned short pixels) {
+        BlockMove(src, dst, pixels);
+        return dst + pixels;
+    }
+
+    #define EXPAND_ROW(DEPTH) {expandIndexed_##DEPTH, expandTrue1_##DEPTH, expandTrue2_##DEPTH, expandTrue3_##DEPTH, expandTrue4_##DEPTH}
+
+    static const ExpandTileProc expandProcs[4][5] = {
+        EXPAND_ROW(1),
+        EXPAND_ROW(2),
+        EXPAND_ROW(4),
+        {copyIndexed_8, expandTrue1_8, expandTrue2_8, expandTrue3_8, expandTrue4_8}
+    };
+
+    /* When the lookup tables could be allocated, true color tiles are
+     * expanded by copying the client's bytes for each byte of native pixels
+     * from a table, which holds the 8, 4 or 2 pixels that byte stands for.
+     * At 8 bits, each pixel is copied from the table of colors.
+     */
+
+    static unsigned char *lookupTable; // Pixels for each byte of native pixels
+
+    #define DEFINE_LOOKUP_TILE(NAME, DEPTH, BYTES)                                                \
+        static unsigned char *NAME(const unsigned char *src, unsigned char *dst, unsigned short pixels) { \
+            const unsigned char *table = lookupTable;                                               \
+            const unsigned short stride = (8 / DEPTH) * BYTES;                                      \
+            for (unsigned short bytes = pixels / (8 / DEPTH); bytes; bytes--) {                     \
+                const unsigned char *t = table + *src++ * stride;                                   \
+                unsigned char n = stride;                                                           \
+                do {*dst++ = *t++;} while (--n);                                                    \
+            }                                                                                       \
+            unsigned char n = (pixels % (8 / DEPTH)) * BYTES;                                       \
+            if (n) {                                                                                \
+                const unsigned char *t = table + *src * stride;                                     \
+                do {*dst++ = *t++;} while (--n);                                                    \
+            }                                                                                       \
+            return dst;                                                                             \
+        }
+
+    #define DEFINE_LOOKUP_8(NAME, BYTES)                                                          \
+        static unsigned char *NAME(const unsigned char *src, unsigned char *dst, unsigned short pixels) { \
+            const unsigned char *table = vncTileColors;                                             \
+            do {                                                                                    \
+                const unsigned char *t = table + ((unsigned short)*src++ << 2);                     \
+                unsigned char n = BYTES;                                                            \
+                do {*dst++ = *t++;} while (--n);                                                    \
+            } while (--pixels);                                                                     \
+            return dst;                                                                             \
+        }
+
+    #define DEFINE_LOOKUP_DEPTH(DEPTH)                                       \
+        DEFINE_LOOKUP_TILE(lookupTrue1_##DEPTH, DEPTH, 1)                    \
+        DEFINE_LOOKUP_TILE(lookupTrue2_##DEPTH, DEPTH, 2)                    \
+        DEFINE_LOOKUP_TILE(lookupTrue3_##DEPTH, DEPTH, 3)                    \
+        DEFINE_LOOKUP_TILE(lookupTrue4_##DEPTH, DEPTH, 4)
+
+    DEFINE_LOOKUP_DEPTH(1)
+    DEFINE_LOOKUP_DEPTH(2)
+    DEFINE_LOOKUP_DEPTH(4)
+    DEFINE_LOOKUP_8(lookupTrue1_8, 1)
+    DEFINE_LOOKUP_8(lookupTrue2_8, 2)
+    DEFINE_LOOKUP_8(lookupTrue3_8, 3)
+    DEFINE_LOOKUP_8(lookupTrue4_8, 4)
+
+    #define LOOKUP_ROW(DEPTH) {lookupTrue1_##DEPTH, lookupTrue2_##DEPTH, lookupTrue3_##DEPTH, lookupTrue4_##DEPTH}
+
+    static const ExpandTileProc lookupProcs[4][4] = {
+        LOOKUP_ROW(1),
+        LOOKUP_ROW(2),
+        LOOKUP_ROW(4),
+        LOOKUP_ROW(8)
+    };
+
+    // Fills in the lookup tables for the current colors and pixel size,
+    // returning false if they are too small for the screen depth
+
+    static Boolean buildLookupTables(unsigned char bytes) {
+        #ifdef VNC_FB_BITS_PER_PIX
+            const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+        #endif
+        const unsigned int nColors = 1 << fbDepth;
+        const unsigned char perByte = 8 / fbDepth;
+        const unsigned long size = nColors * 4 + ((fbDepth < 8) ? 256L * perByte * bytes : 0);
+        if (size > vncTileColorsSize) {
+            return false;
+        }
+
+        // The client's bytes for each color
+        for (unsigned int c = 0; c < nColors; c++) {
+            const unsigned long v = vncTrueColors[c] << expandShift;
+            unsigned char *p = vncTileColors + (c << 2);
+            p[0] = v >> 24;
+            p[1] = v >> 16;
+            p[2] = v >> 8;
+            p[3] = v;
+        }
+
+        // The pixels for each byte of native pixels
+        if (fbDepth < 8) {
+            const unsigned char mask = nColors - 1;
+            unsigned char *dst = lookupTable = vncTileColors + nColors * 4;
+            for (unsigned int b = 0; b < 256; b++) {
+                for (unsigned char i = 1; i <= perByte; i++) {
+                    const unsigned char *t = vncTileColors + (((b >> (8 - fbDepth * i)) & mask) << 2);
+                    for (unsigned char n = 0; n < bytes; n++) {
+                        *dst++ = t[n];
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    void VNCPalette::prepareTileRoutines(Boolean isCPIXEL) {
+        #ifdef VNC_FB_BITS_PER_PIX
+            const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+        #endif
+        lastIsCPIXEL = isCPIXEL;
+        prepareColorRoutines(isCPIXEL);
+        if (fbDepth > 8) {
+            // Direct color tiles are written by the TRLE encoder itself
+            expandTile = 0;
+            tileColorBytes = 0;
+            return;
+        }
+        const unsigned char depthIndex = (fbDepth == 1) ? 0 : (fbDepth == 2) ? 1 : (fbDepth == 4) ? 2 : 3;
+        const unsigned char sizeIndex = fbPixFormat.trueColor ? min(bytesPerColor, 4) : 0;
+        expandShift = fbPixFormat.bigEndian ? (sizeof(unsigned long) - bytesPerColor) * 8 : 0;
+        expandTile = expandProcs[depthIndex][sizeIndex];
+
+        // Use the lookup tables if they are ready, or can be made ready
+        if (sizeIndex && vncTileColors && vncTrueColors) {
+            if (!tablesValid || (tileColorBytes != bytesPerColor)) {
+                tileColorBytes = 0;
+                tablesValid = buildLookupTables(bytesPerColor);
+            }
+            if (tablesValid) {
+                tileColorBytes = bytesPerColor;
+                expandTile = lookupProcs[depthIndex][sizeIndex - 1];
+            }
+        } else {
+            tileColorBytes = 0;
+        }
+    }
+#endif
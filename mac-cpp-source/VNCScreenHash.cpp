@@ -15,6 +15,8 @@
  *   location: <http://www.gnu.org/licenses/>.                              *
  ****************************************************************************/
 
+#include "OSUtilities.h"
+
 #include "VNCServer.h"
 #include "VNCFrameBuffer.h"
 #include "VNCScreenHash.h"
@@ -26,9 +28,106 @@
     #define ROW_HASH_SIZE (VNC_FB_HEIGHT)
 #else
     #define COL_HASH_SIZE ((fbStride + sizeof(unsigned long) - 1)/sizeof(unsigned long))
-    #define ROW_HASH_SIZE fbHeight;
+    #define ROW_HASH_SIZE fbHeight
 #endif
 
+/* The column hashes are kept separately for each horizontal band of
+ * HASH_BAND_ROWS rows, so that changes in different parts of the screen
+ * (e.g. the menu bar clock and a blinking caret) can be reported as
+ * separate rectangles, rather than one rectangle enclosing both.
+ */
+
+#define HASH_BAND_ROWS 32
+#define NUM_HASH_BANDS ((ROW_HASH_SIZE + HASH_BAND_ROWS - 1) / HASH_BAND_ROWS)
+
+/* Scroll detection looks for runs of rows in a dirty rectangle which
+ * match rows that were previously sent to the client, but at a vertical
+ * offset. To guard against false matches, a run must be at least
+ * MIN_SCROLL_ROWS long and contain MIN_DISTINCT_ROWS rows which differ
+ * from the row above.
+ */
+
+#define MIN_SCROLL_ROWS   16
+#define MIN_DISTINCT_ROWS 4
+#define SCROLL_ANCHORS    8
+
+/* The hashes of the TILE_SIZE x TILE_SIZE tiles the client was last sent
+ * are kept, so that unchanged tiles can be trimmed from the dirty rects.
+ *
+ * Window moves are also detected using these tile hashes. A few tiles which
+ * vanished from their old location are searched for in the dirty rects, and
+ * the largest block of tiles which moved by the same amount is sent as a
+ * CopyRect. Since the search proceeds by bytes, this only works at eight
+ * bits per pixel or more.
+ */
+
+#define TILE_SIZE         16
+#define MOVE_ANCHORS      4
+#define MIN_MOVE_TILES    4
+#define MAX_TILE_CHECKS   32
+
+/* Rather than hashing every tile at once when the saved hashes are lost,
+ * or the tiles under a CopyRect, the tiles are marked with a sum that no
+ * tile can have, and are hashed a few at a time with what is left of the
+ * analysis budget after each report. Until then, they count as changed.
+ */
+
+#define TILE_HASH_INVALID 0xFFFFFFFFUL
+
+#ifdef VNC_FB_WIDTH
+    #define TILE_COLS (VNC_FB_WIDTH / TILE_SIZE)
+    #define TILE_ROWS (VNC_FB_HEIGHT / TILE_SIZE)
+#else
+    #define TILE_COLS (fbWidth / TILE_SIZE)
+    #define TILE_ROWS (fbHeight / TILE_SIZE)
+#endif
+
+/* The number of rows hashed on each tick adapts to the measured hashing
+ * time, so that hashing takes about HASH_BUSY_USEC per tick while the
+ * screen is changing, and about HASH_IDLE_USEC once QUIET_SCANS scans in
+ * a row have found nothing. While the screen is static, the wait between
+ * scans doubles, up to MAX_IDLE_TICKS.
+ */
+
+#define HASH_BUSY_USEC    4000
+#define HASH_IDLE_USEC    1000
+#define QUIET_SCANS       4
+#define MAX_IDLE_TICKS    32
+#define MIN_ROWS_PER_TICK 8
+
+/* For HOT_TICKS ticks after the client sends a key or pointer event, the
+ * bands around the pointer are hashed on every tick, ahead of the full
+ * scan, and any change found there is reported right away.
+ */
+
+#define HOT_TICKS         30
+
+/* Each full scan starts with the bands around the pointer when there has
+ * been recent input, or else with the bands which changed last, and wraps
+ * around the bottom of the screen to finish. Once the first PRIORITY_BANDS
+ * bands are hashed, any change in them is reported without waiting for
+ * the rest of the screen.
+ */
+
+#define PRIORITY_BANDS    3
+
+/* Scroll and move detection and the trimming of the dirty rects run in
+ * the VBL task as the dirt is reported, and so must not run for too long.
+ * Each step is skipped when the bytes it would read do not fit within
+ * what is left of ANALYSIS_TICKS ticks' worth of hashing. The same bound
+ * applies to checking the rows which were sent to the client.
+ */
+
+#define ANALYSIS_TICKS    2
+
+/* When shadowDiff is set in the preferences and there is memory to spare,
+ * the screen is compared word by word against a shadow copy of itself
+ * rather than hashed. Each changed span is copied into the shadow, merged
+ * into the dirt right away and marked in the tile map, so the dirty rects
+ * can be trimmed to exactly the tiles which changed. Row hashes are not
+ * kept in this mode, so scrolls and window moves are not detected.
+ */
+
 //#define TEST_HASH
 
 typedef pascal void (*VBLProcPtr)(VBLTaskPtr recPtr);
@@ -39,31 +138,95 @@ struct ExtendedVBLTaskRec {
     VBLTask    vblTask;  // VBLTask record
 } evbl;
 
+struct BandDirt {
+    unsigned short     x1, x2;  // Dirty columns, in column hash units
+    unsigned short     y1, y2;  // Dirty rows
+};
+
+struct TileHash {
+    unsigned long      sum;     // Sum of the bytes, which can be computed incrementally
+    unsigned long      mix;     // Rotate and XOR of the bytes, to verify matches
+};
+
+// Values of tileState
+
+enum {
+    TileUnknown = 0,
+    TileSame,
+    TileChanged
+};
+
 struct MonoHashData {
     unsigned long     *rowHashPrev;
     unsigned long     *rowHashNext;
     unsigned long     *colHashPrev;
     unsigned long     *colHashNext;
+    unsigned long     *rowHashSent;  // Row hashes as of the last update
+    unsigned long     *newRowHashes; // Scratch space for scroll detection
+    unsigned long     *oldRowHashes;
+    unsigned long     *searchSums;   // Scratch space for move detection
+    TileHash          *tileHashSent; // Tile hashes as of the last update
+    BandDirt          *bandDirt;
+    unsigned char     *tileState;    // Scratch space for refining the dirty rects
 };
 
 static int row = 0;
-
-static VNCRect dirtyRect;
+static unsigned int rowsLeft;      // Rows left to hash in this scan
+static unsigned int startBand;     // Band at which this scan started
+static unsigned int priorityBands;
+static unsigned int priorityRows;
+static Boolean priorityChecked;
+static unsigned int dirtyRow;      // Top of the most recently reported dirt
+
+static Boolean gotDirt;
+static Boolean detectScrolls;
+static Boolean sentHashesValid;
 static HashCallbackPtr callback;
 
+static Boolean hasMicroseconds;
+static unsigned int rowsPerTick;
+static unsigned long usecPer16Rows;
+static unsigned long analysisBytes; // Bytes the analysis may still read
+static unsigned int tileRefill;     // Next tile to check for a missing hash
+static unsigned char quietScans;
+static unsigned char idleTicks;
+static unsigned char hotTicks;
+static unsigned int hotRow;
+
+static const unsigned long *scrnPtr;
+static unsigned long *scrnRowHashPtr;
+static unsigned long *scrnColHashPtr;
+
 static MonoHashData *data = NULL;
+static unsigned char *shadow = NULL;
 
 // Prototypes
 
 void unionRect(const VNCRect *a,VNCRect *b);
+void mergeRect(const VNCRect *a,VNCRect *rects,unsigned int &nRects);
 
 #define ALIGN_PAD 3
-#define ALIGN_LONG(PTR) (PTR) + (sizeof(unsigned long) - (unsigned long)(PTR) % sizeof(unsigned long))
+#define ALIGN_LONG(PTR) (PTR) + ((sizeof(unsigned long) - (unsigned long)(PTR) % sizeof(unsigned long)) % sizeof(unsigned long))
 
 OSErr VNCScreenHash::setup() {
     const size_t colHashSize = COL_HASH_SIZE;
     const size_t rowHashSize = ROW_HASH_SIZE;
-    const size_t dataSize = sizeof(MonoHashData) + (colHashSize + rowHashSize) * 2 * sizeof(unsigned long) + ALIGN_PAD;
+    const size_t numBands    = NUM_HASH_BANDS;
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    #ifdef VNC_BYTES_PER_LINE
+        const unsigned long fbStride = VNC_BYTES_PER_LINE;
+    #endif
+    #ifdef VNC_FB_HEIGHT
+        const unsigned int fbHeight = VNC_FB_HEIGHT;
+    #endif
+    const size_t numTiles    = (size_t)TILE_COLS * TILE_ROWS;
+    // Move detection is only possible at eight bits per pixel or more
+    const size_t searchSize  = (fbDepth >= 8) ? fbStride : 0;
+    const size_t dataSize = sizeof(MonoHashData) + (colHashSize * numBands + rowHashSize) * 2 * sizeof(unsigned long) +
+                            rowHashSize * 3 * sizeof(unsigned long) + searchSize * sizeof(unsigned long) +
+                            numTiles * sizeof(TileHash) + numBands * sizeof(BandDirt) + numTiles + ALIGN_PAD;
     data = (MonoHashData*) NewPtr(dataSize);
     if (MemError() != noErr)
         return MemError();
@@ -80,7 +243,14 @@ OSErr VNCScreenHash::setup() {
     data->rowHashPrev = (unsigned long*)hashPtr;
     data->rowHashNext = data->rowHashPrev + rowHashSize;
     data->colHashPrev = data->rowHashNext + rowHashSize;
-    data->colHashNext = data->colHashPrev + colHashSize;
+    data->colHashNext = data->colHashPrev + colHashSize * numBands;
+    data->rowHashSent = data->colHashNext + colHashSize * numBands;
+    data->newRowHashes = data->rowHashSent + rowHashSize;
+    data->oldRowHashes = data->newRowHashes + rowHashSize;
+    data->searchSums  = data->oldRowHashes + rowHashSize;
+    data->tileHashSent = (TileHash*)(data->searchSums + searchSize);
+    data->bandDirt    = (BandDirt*)(data->tileHashSent + numTiles);
+    data->tileState   = (unsigned char*)(data->bandDirt + numBands);
 
     // Setup the VBL task record
     evbl.ourA5 = SetCurrentA5();
@@ -90,23 +260,64 @@ OSErr VNCScreenHash::setup() {
     evbl.vblTask.vblCount = 0;
     evbl.vblTask.vblPhase = 0;
 
-    dirtyRect.x = 0;
-    dirtyRect.y = 0;
-    dirtyRect.w = 0;
-    dirtyRect.h = 0;
+    clearDirty();
+
+    for (size_t i = 0; i < numTiles; i++) {
+        data->tileState[i] = 0;
+    }
 
     callback = 0;
+    sentHashesValid = false;
+
+    hasMicroseconds = TrapAvailable(0xA193); // _Microseconds
+    rowsPerTick = fbHeight / 16;
+    usecPer16Rows = 0;
+    quietScans = 0;
+    idleTicks = 1;
+    hotTicks = 0;
+    dirtyRow = 0;
+
+    // Hash the whole screen once, to report the cost of hashing
+    // and to give the adaptive hashing budget a starting point
+    beginCompute();
+    if (hasMicroseconds) {
+        UnsignedWide start, end;
+        Microseconds(&start);
+        hashRows(fbHeight);
+        Microseconds(&end);
+        adaptRowsPerTick(fbHeight, end.lo - start.lo);
+        dprintf("Hashing takes %ld usec per 16 rows, will hash %d rows per tick\n", usecPer16Rows, rowsPerTick);
+    } else {
+        hashRows(fbHeight);
+    }
+    endCompute();
+
+    if (vncConfig.shadowDiff) {
+        const unsigned long shadowSize = (unsigned long)fbStride * fbHeight;
+        shadow = (unsigned char*) NewPtr(shadowSize);
+        if (MemError() != noErr) {
+            dprintf("Not enough memory for a shadow framebuffer, using hashes instead\n");
+            shadow = NULL;
+        } else {
+            dprintf("Reserved %ld bytes for shadow framebuffer\n", shadowSize);
+            BlockMove(VNCFrameBuffer::getBaseAddr(), shadow, shadowSize);
+        }
+    }
 
     OSErr err = makeVBLTaskPersistent(&evbl.vblTask);
 
     // Compute the first checksum
-    requestDirtyRect(0);
+    requestDirtyRect(0, false);
     return err;
 }
 
 OSErr VNCScreenHash::destroy() {
     DisposPtr((Ptr)data);
     data = NULL;
+    if (shadow) {
+        DisposPtr((Ptr)shadow);
+        shadow = NULL;
+    }
 
     VRemove((QElemPtr)&evbl.vblTask);
     callback = NULL;
@@ -132,6 +343,42 @@ void unionRect(const VNCRect *a,VNCRect *b) {
     }
 }
 
+/* Merges a rect into whichever rect of a list grows the least by taking
+ * it in, then folds any rect which the grown one now overlaps into it,
+ * so that a list of rects which do not overlap stays that way.
+ */
+
+void mergeRect(const VNCRect *a,VNCRect *rects,unsigned int &nRects) {
+    unsigned int i, best = 0;
+    unsigned long bestGrowth = 0xFFFFFFFF;
+    for (i = 0; i < nRects; i++) {
+        VNCRect grown = rects[i];
+        unionRect(a, &grown);
+        const unsigned long growth = (unsigned long) grown.w * grown.h - (unsigned long) rects[i].w * rects[i].h;
+        if (growth < bestGrowth) {
+            best = i;
+            bestGrowth = growth;
+        }
+    }
+    unionRect(a, &rects[best]);
+
+    // Each rect folded in grows the rect again, so check them all again
+    Boolean folded;
+    do {
+        folded = false;
+        for (i = 0; (i < nRects) && !folded; i++) {
+            const VNCRect &b = rects[best];
+            const VNCRect &r = rects[i];
+            if ((i == best) || (r.x >= b.x + b.w) || (b.x >= r.x + r.w) ||
+                               (r.y >= b.y + b.h) || (b.y >= r.y + r.h)) continue;
+            unionRect(&r, &rects[best]);
+            rects[i] = rects[--nRects];
+            if (best == nRects) best = i;
+            folded = true;
+        }
+    } while (folded);
+}
+
 /************************** VBL TASK ************************/
 
 // From Inside Macintosh: Process page 4-20, Using the Vertical Retrace Manager
@@ -174,12 +421,84 @@ asm pascal void VNCScreenHash::preVBLTask() {
     dc.w    0x0000
 }
 
-OSErr VNCScreenHash::requestDirtyRect(HashCallbackPtr func) {
+// Called by the server whenever it sends the client something other
+// than the dirty rects, as the client's screen will no longer match
+// the saved row hashes
+
+void VNCScreenHash::forgetSentHashes() {
+    sentHashesValid = false;
+}
+
+/* Called by the server once the rects have been sent. If any of those
+ * rows changed while they were being encoded, we cannot be sure what
+ * the client got, so the saved row hashes are discarded.
+ */
+
+void VNCScreenHash::confirmSentRows(const VNCRect *rects, unsigned int nRects) {
+    #ifdef VNC_BYTES_PER_LINE
+        const unsigned long fbStride = VNC_BYTES_PER_LINE;
+    #endif
+    if (shadow || !sentHashesValid) return;
+
+    // This runs at interrupt time, so if re-hashing the rows would take
+    // too long, it is cheaper to just forget the hashes
+    unsigned long rows = 0;
+    for (unsigned int i = 0; i < nRects; i++) {
+        rows += rects[i].h;
+    }
+    if (rows > (unsigned long) rowsPerTick * ANALYSIS_TICKS) {
+        sentHashesValid = false;
+        return;
+    }
+    for (unsigned int i = 0; (i < nRects) && sentHashesValid; i++) {
+        for (unsigned int y = rects[i].y; y < rects[i].y + rects[i].h; y++) {
+            if (hashRowRange(y, 0, fbStride) != data->rowHashSent[y]) {
+                sentHashesValid = false;
+                break;
+            }
+        }
+    }
+}
+
+/* Called by the server with dirt which it was handed but could not send,
+ * so that it is reported again by the next request. In shadow mode, the
+ * tiles are marked as well, as refineRects() would otherwise trim them.
+ */
+
+void VNCScreenHash::markDirty(const VNCRect &rect) {
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    if ((rect.w == 0) || (rect.h == 0)) return;
+
+    const unsigned int pixPerHash = sizeof(unsigned long) * 8 / fbDepth;
+    const unsigned int x1 = rect.x / pixPerHash;
+    const unsigned int x2 = (rect.x + rect.w + pixPerHash - 1) / pixPerHash;
+    const unsigned int y2 = rect.y + rect.h;
+    for (unsigned int band = rect.y / HASH_BAND_ROWS; band * HASH_BAND_ROWS < y2; band++) {
+        const unsigned int bandTop = band * HASH_BAND_ROWS;
+        mergeDirt(band, x1, x2, max(rect.y, bandTop), min(y2, bandTop + HASH_BAND_ROWS));
+    }
+
+    if (shadow) {
+        const unsigned int tileCols = TILE_COLS;
+        const unsigned int tx2 = min((rect.x + rect.w + TILE_SIZE - 1) / TILE_SIZE, tileCols);
+        const unsigned int ty2 = min((y2 + TILE_SIZE - 1) / TILE_SIZE, TILE_ROWS);
+        for (unsigned int ty = rect.y / TILE_SIZE; ty < ty2; ty++) {
+            for (unsigned int tx = rect.x / TILE_SIZE; tx < tx2; tx++) {
+                data->tileState[ty * tileCols + tx] = TileChanged;
+            }
+        }
+    }
+    gotDirt = true;
+}
+
+OSErr VNCScreenHash::requestDirtyRect(HashCallbackPtr func, Boolean detectScroll) {
     if(callback == NULL) {
         evbl.vblTask.vblCount = 1;
 
         callback = func;
-        row = 0;
+        detectScrolls = detectScroll;
         beginCompute();
 
         return VInstall((QElemPtr)&evbl.vblTask);
@@ -187,6 +506,13 @@ OSErr VNCScreenHash::requestDirtyRect(HashCallbackPtr func) {
     return requestAlreadyScheduled;
 }
 
+// Withdraws a request, keeping any dirt found so far for the next one
+
+void VNCScreenHash::cancelDirtyRect() {
+    VRemove((QElemPtr)&evbl.vblTask);
+    callback = NULL;
+}
+
 pascal void VNCScreenHash::myVBLTask(VBLTaskPtr theVBL) {
     #if defined(TEST_HASH)
         if(1) {
@@ -194,6 +520,7 @@ pascal void VNCScreenHash::myVBLTask(VBLTaskPtr theVBL) {
             computeHashesFast(VNC_FB_HEIGHT);
             endCompute();
             beginCompute();
+            ZERO_ANY (unsigned long, data->rowHashNext, ROW_HASH_SIZE);
             for(int i = 0; i < (VNC_BYTES_PER_LINE / 16); i++) {
                 computeHashesFastest(i);
             }
@@ -201,98 +528,1061 @@ pascal void VNCScreenHash::myVBLTask(VBLTaskPtr theVBL) {
             short colChk = memcmp(data->colHashPrev, data->colHashNext, 16);
             short rowChk = memcmp(data->rowHashPrev, data->rowHashNext, ROW_HASH_SIZE);
             dprintf("Col: %s Row: %s ", colChk ? "ne" : "eq", rowChk ? "ne" : "eq");
-            callback(0, 0, VNC_FB_WIDTH, VNC_FB_HEIGHT);
+            const VNCRect rect = {0, 0, VNC_FB_WIDTH, VNC_FB_HEIGHT};
+            callback(&rect, 1, NULL, 0);
             callback = NULL;
         }
     #else
         #ifdef VNC_FB_HEIGHT
             const unsigned int fbHeight = VNC_FB_HEIGHT;
         #endif
-        if(row < fbHeight) {
-            const unsigned int numRows = min(fbHeight - row, fbHeight/16);
-            computeHashesFast(numRows);
-            row += numRows;
+        // Following user input, check the bands around the pointer first
+        if (hotTicks) {
+            hotTicks--;
+            if (scanHotBands() && callback && reportDirt()) return;
+        }
+        if(rowsLeft) {
+            const unsigned int rowsHashed = min(rowsLeft, rowsPerTick);
+            UnsignedWide start, end;
+            if (hasMicroseconds) Microseconds(&start);
+            hashRows(rowsHashed);
+            if (hasMicroseconds) {
+                Microseconds(&end);
+                adaptRowsPerTick(rowsHashed, end.lo - start.lo);
+            }
+            // Report changes in the priority bands as soon as they are hashed
+            if (!priorityChecked && (fbHeight - rowsLeft >= priorityRows)) {
+                priorityChecked = true;
+                if (settleBands(startBand, startBand + priorityBands) && callback && reportDirt()) return;
+            }
             theVBL->vblCount = 1;
         }
     #endif
         else  {
-            endCompute();
-            VNCRect newDirt;
-            computeDirty(newDirt.x, newDirt.y, newDirt.w, newDirt.h);
+            // The shadow comparison is exact and merges the dirt as it
+            // goes, so it does not need a second scan to confirm it
+            const Boolean gotOldDirt = gotDirt;
 
-            Boolean gotOldDirt = dirtyRect.w && dirtyRect.h;
-            Boolean gotNewDirt = newDirt.w && newDirt.h;
+            if (!shadow) {
+                endCompute();
 
-            // Merge the two rectangles
-            unionRect(&newDirt, &dirtyRect);
+                // Merge the new dirt with the old
+                computeDirty(0, NUM_HASH_BANDS);
+            }
 
-            if(gotOldDirt) {
-                // Update and forfeit the rect
-                if(callback) {
-                    callback(dirtyRect.x, dirtyRect.y, dirtyRect.w, dirtyRect.h);
-                    callback = NULL;
-                }
-                dirtyRect.x = 0;
-                dirtyRect.y = 0;
-                dirtyRect.w = 0;
-                dirtyRect.h = 0;
+            // Scan quickly while the screen is changing, and back off
+            // gradually once it has been static for a while
+            if (gotDirt) {
+                quietScans = 0;
+                idleTicks = 1;
             } else {
+                if (quietScans < QUIET_SCANS) quietScans++;
+                idleTicks = min(idleTicks * 2, MAX_IDLE_TICKS);
+            }
+
+            if(!(gotOldDirt && reportDirt())) {
                 // Not enough dirt, so keep waiting
-                row = 0;
                 beginCompute();
-                theVBL->vblCount = 16;
+                theVBL->vblCount = idleTicks;
             }
         }
 }
 
 /************************** HASHING ************************/
 
-static const unsigned long *scrnPtr;
-static unsigned long *scrnRowHashPtr;
-static unsigned long *scrnColHashPtr;
+Boolean VNCScreenHash::reportDirt() {
+    #ifdef VNC_BYTES_PER_LINE
+        const unsigned long fbStride = VNC_BYTES_PER_LINE;
+    #endif
+    VNCRect rects[MAX_DIRTY_RECTS];
+    VNCFBUpdateCopyRect copyRects[MAX_COPY_RECTS];
+    unsigned int nRects = getDirtyRects(rects);
+    unsigned int nCopyRects = 0;
+
+    if(nRects) {
+        analysisBytes = (unsigned long) rowsPerTick * fbStride * ANALYSIS_TICKS;
+        if (callback && detectScrolls && !shadow) {
+            nCopyRects = findScrolls(rects, nRects, copyRects);
+            if (nCopyRects == 0) {
+                nCopyRects = findMove(rects, nRects, copyRects);
+            }
+        }
+
+        // Trim away tiles which the client already has, and
+        // remember what the client is about to be sent
+        if (sentHashesValid || shadow) {
+            refineRects(rects, nRects);
+        }
+        if (!shadow) {
+            snapshotTiles(copyRects, nCopyRects);
+        }
+        BlockMove(data->rowHashPrev, data->rowHashSent, ROW_HASH_SIZE * sizeof(unsigned long));
+        sentHashesValid = true;
+
+        // The next scan starts here, as this part of the screen is busy
+        for (unsigned int i = 0; i < nRects; i++) {
+            if (i == 0 || rects[i].y < dirtyRow) dirtyRow = rects[i].y;
+        }
+    }
+
+    // All the dirt may have been past the right edge of the screen,
+    // or in tiles which the client already has
+    clearDirty();
+
+    if(nRects || nCopyRects) {
+        // Update and forfeit the rects
+        if(callback) {
+            callback(rects, nRects, copyRects, nCopyRects);
+            callback = NULL;
+        }
+        return true;
+    }
+    return false;
+}
+
+void VNCScreenHash::inputReceived(unsigned int y) {
+    hotRow = y;
+    hotTicks = HOT_TICKS;
+    quietScans = 0;
+    idleTicks = 1;
+
+    // If the VBL task is waiting out an idle period, wake it up
+    if (callback) {
+        evbl.vblTask.vblCount = 1;
+    }
+}
+
+/* Hashes the band under the pointer and the bands on either side of it
+ * out of turn and merges any changes into the dirt. Returns true if
+ * anything changed in those bands.
+ */
+
+Boolean VNCScreenHash::scanHotBands() {
+    #ifdef VNC_FB_HEIGHT
+        const unsigned int fbHeight = VNC_FB_HEIGHT;
+    #endif
+    const unsigned int numBands = NUM_HASH_BANDS;
+    const unsigned int hotBand = min(hotRow, fbHeight - 1) / HASH_BAND_ROWS;
+    const unsigned int firstBand = hotBand ? hotBand - 1 : 0;
+    const unsigned int lastBand = min(hotBand + 2, numBands);
+    const unsigned int scanRow = row;
+    unsigned int band;
+
+    if (shadow) {
+        Boolean gotHotDirt = false;
+        for (band = firstBand; band < lastBand; band++) {
+            const unsigned int bandTop = band * HASH_BAND_ROWS;
+            if (diffRows(bandTop, min(HASH_BAND_ROWS, fbHeight - bandTop))) gotHotDirt = true;
+        }
+        return gotHotDirt;
+    }
+
+    for (band = firstBand; band < lastBand; band++) {
+        ZERO_ANY (unsigned long, data->colHashNext + band * COL_HASH_SIZE, COL_HASH_SIZE);
+        seekRow(band * HASH_BAND_ROWS);
+        scrnColHashPtr = data->colHashNext + band * COL_HASH_SIZE;
+        computeHashesFast(min(HASH_BAND_ROWS, fbHeight - row));
+    }
+
+    seekRow(scanRow);
+    const Boolean gotHotDirt = settleBands(firstBand, lastBand);
+
+    // If the full scan was part way through one of the hot bands,
+    // let it resume at the end of that band
+    band = row / HASH_BAND_ROWS;
+    if (rowsLeft && (row % HASH_BAND_ROWS) && (band >= firstBand) && (band < lastBand)) {
+        const unsigned int bandBottom = min((band + 1) * HASH_BAND_ROWS, fbHeight);
+        rowsLeft -= bandBottom - row;
+        seekRow(bandBottom % fbHeight);
+    }
+    return gotHotDirt;
+}
+
+/* Merges any changes in a range of bands into the dirt, then makes the
+ * fresh hashes of those bands the baseline, so the full scan will not
+ * see the same changes again. Returns true if anything changed.
+ */
+
+Boolean VNCScreenHash::settleBands(unsigned int firstBand, unsigned int lastBand) {
+    #ifdef VNC_FB_HEIGHT
+        const unsigned int fbHeight = VNC_FB_HEIGHT;
+    #endif
+    const size_t colHashSize = COL_HASH_SIZE;
+    const Boolean hadDirt = gotDirt;
+
+    if (shadow) {
+        // The dirt is already merged, so just look for it
+        for (unsigned int band = firstBand; band < lastBand; band++) {
+            if (data->bandDirt[band].x2) return true;
+        }
+        return false;
+    }
+
+    gotDirt = false;
+    computeDirty(firstBand, lastBand);
+    const Boolean gotNewDirt = gotDirt;
+    gotDirt = gotDirt || hadDirt;
+
+    for (unsigned int band = firstBand; band < lastBand; band++) {
+        const unsigned int bandTop = band * HASH_BAND_ROWS;
+        const unsigned int bandRows = min(HASH_BAND_ROWS, fbHeight - bandTop);
+        unsigned long *colHashNext = data->colHashNext + band * colHashSize;
+        BlockMove(colHashNext, data->colHashPrev + band * colHashSize, colHashSize * sizeof(unsigned long));
+        BlockMove(data->rowHashNext + bandTop, data->rowHashPrev + bandTop, bandRows * sizeof(unsigned long));
+
+        // A band which the full scan has yet to reach must start out clear
+        if (bandAhead(band)) {
+            ZERO_ANY (unsigned long, colHashNext, colHashSize);
+        }
+    }
+    return gotNewDirt;
+}
+
+// Returns true if the full scan has yet to start on a band
+
+Boolean VNCScreenHash::bandAhead(unsigned int band) {
+    const unsigned int numBands = NUM_HASH_BANDS;
+    if (rowsLeft == 0) return false;
+    const unsigned int pos    = (band + numBands - startBand) % numBands;
+    const unsigned int curPos = (row / HASH_BAND_ROWS + numBands - startBand) % numBands;
+    return (pos > curPos) || ((pos == curPos) && (row % HASH_BAND_ROWS == 0));
+}
+
+// Points the hashing routines at a row of the screen
+
+void VNCScreenHash::seekRow(unsigned int y) {
+    #ifdef VNC_BYTES_PER_LINE
+        const unsigned long fbStride = VNC_BYTES_PER_LINE;
+    #endif
+    row = y;
+    scrnPtr = (const unsigned long*) (VNCFrameBuffer::getBaseAddr() + (unsigned long) fbStride * y);
+    scrnRowHashPtr = data->rowHashNext + y;
+}
+
+// Hashes rows starting at the current row, one band at a time,
+// wrapping around to the top of the screen at the bottom
+
+void VNCScreenHash::hashRows(unsigned int numRows) {
+    #ifdef VNC_FB_HEIGHT
+        const unsigned int fbHeight = VNC_FB_HEIGHT;
+    #endif
+    const size_t colHashSize = COL_HASH_SIZE;
+    while (numRows) {
+        // Do not cross a band boundary, as each band has its own column hashes
+        const unsigned int bandRows = min(min(numRows, HASH_BAND_ROWS - row % HASH_BAND_ROWS), fbHeight - row);
+        if (shadow) {
+            diffRows(row, bandRows);
+        } else {
+            scrnColHashPtr = data->colHashNext + (row / HASH_BAND_ROWS) * colHashSize;
+            computeHashesFast(bandRows);
+        }
+        row += bandRows;
+        rowsLeft -= bandRows;
+        numRows -= bandRows;
+        if (row == fbHeight) seekRow(0);
+    }
+}
+
+/* Compares rows of the screen against the shadow, bringing the shadow
+ * up to date and marking the changed tiles. Returns true if anything
+ * changed.
+ */
+
+Boolean VNCScreenHash::diffRows(unsigned int y, unsigned int numRows) {
+    #ifdef VNC_BYTES_PER_LINE
+        const unsigned long fbStride = VNC_BYTES_PER_LINE;
+    #endif
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    const unsigned int wordsPerRow = fbStride / sizeof(unsigned short);
+    const unsigned int tileCols = TILE_COLS;
+    const unsigned int tileRows = TILE_ROWS;
+    Boolean changed = false;
+
+    for (; numRows--; y++) {
+        const unsigned short *src = (const unsigned short*) (VNCFrameBuffer::getBaseAddr() + fbStride * y);
+        unsigned short       *dst = (unsigned short*) (shadow + fbStride * y);
+
+        // Find the changed span and copy it into the shadow
+        unsigned int x1 = 0, x2 = wordsPerRow;
+        while ((x1 < x2) && (src[x1] == dst[x1])) x1++;
+        if (x1 == x2) continue;
+        while (src[x2 - 1] == dst[x2 - 1]) x2--;
+        BlockMove((Ptr)(src + x1), (Ptr)(dst + x1), (x2 - x1) * sizeof(unsigned short));
+
+        // Merge it into the dirt, in column hash units
+        mergeDirt(y / HASH_BAND_ROWS, x1 / 2, (x2 + 1) / 2, y, y + 1);
+
+        // Mark the tiles which the span touches
+        const unsigned int ty = y / TILE_SIZE;
+        if (ty < tileRows) {
+            const unsigned int tx1 = x1 * 16 / fbDepth / TILE_SIZE;
+            const unsigned int tx2 = min((x2 * 16 / fbDepth + TILE_SIZE - 1) / TILE_SIZE, tileCols);
+            for (unsigned int tx = tx1; tx < tx2; tx++) {
+                data->tileState[ty * tileCols + tx] = TileChanged;
+            }
+        }
+        changed = true;
+    }
+    if (changed) gotDirt = true;
+    return changed;
+}
+
+/* Keeps a running average of the time it takes to hash a row, and
+ * derives from it the number of rows which fit in this tick's budget.
+ */
+
+void VNCScreenHash::adaptRowsPerTick(unsigned int rowsHashed, unsigned long usec) {
+    #ifdef VNC_FB_HEIGHT
+        const unsigned int fbHeight = VNC_FB_HEIGHT;
+    #endif
+    if (rowsHashed == 0) return;
+
+    const unsigned long sample = usec * 16 / rowsHashed;
+    usecPer16Rows = usecPer16Rows ? (usecPer16Rows * 3 + sample) / 4 : sample;
+    if (usecPer16Rows == 0) return;
+
+    const unsigned long budget = (quietScans < QUIET_SCANS) ? HASH_BUSY_USEC : HASH_IDLE_USEC;
+    const unsigned long rows = budget * 16 / usecPer16Rows;
+    rowsPerTick = min(max(rows, MIN_ROWS_PER_TICK), fbHeight);
+}
 
 void VNCScreenHash::beginCompute() {
-    scrnPtr = (unsigned long*) VNCFrameBuffer::getBaseAddr();
-    scrnRowHashPtr = data->rowHashNext;
+    #ifdef VNC_FB_HEIGHT
+        const unsigned int fbHeight = VNC_FB_HEIGHT;
+    #endif
+    const unsigned int numBands = NUM_HASH_BANDS;
+
+    // Start with the bands around the pointer if there has been recent
+    // input, or else with the bands which changed last
+    const unsigned int firstRow = hotTicks ? max((int)hotRow - HASH_BAND_ROWS, 0) : dirtyRow;
+    startBand = min(firstRow, fbHeight - 1) / HASH_BAND_ROWS;
+    priorityBands = min(PRIORITY_BANDS, numBands - startBand);
+    priorityRows = min(priorityBands * HASH_BAND_ROWS, fbHeight - startBand * HASH_BAND_ROWS);
+    priorityChecked = false;
+    rowsLeft = fbHeight;
+    seekRow(startBand * HASH_BAND_ROWS);
     scrnColHashPtr = data->colHashNext;
 
     // Clear the next column buffer
-    ZERO_ANY (unsigned long, data->colHashNext, COL_HASH_SIZE);
+    ZERO_ANY (unsigned long, data->colHashNext, COL_HASH_SIZE * NUM_HASH_BANDS);
+}
+
+void VNCScreenHash::clearDirty() {
+    const size_t numBands = NUM_HASH_BANDS;
+    for (unsigned int band = 0; band < numBands; band++) {
+        BandDirt &dirt = data->bandDirt[band];
+        dirt.x1 = dirt.x2 = 0;
+        dirt.y1 = dirt.y2 = 0;
+    }
+    gotDirt = false;
 }
 
-void VNCScreenHash::computeDirty(int &x, int &y, int &w, int &h) {
+// Compares the hashes of each band and merges any changes into the band's dirt
+
+void VNCScreenHash::computeDirty(unsigned int firstBand, unsigned int lastBand) {
     const size_t colHashSize = COL_HASH_SIZE;
     const size_t rowHashSize = ROW_HASH_SIZE;
-    #ifdef VNC_FB_BITS_PER_PIX
-        const unsigned char pixPerByte = 8 / VNC_FB_BITS_PER_PIX;
-    #else
-        const unsigned char pixPerByte = 8 / fbDepth;
-    #endif
-    unsigned int x1 = 0;
-    unsigned int y1 = 0;
-    while((x1 < colHashSize) && (data->colHashNext[x1] == data->colHashPrev[x1])) x1++;
-    while((y1 < rowHashSize) && (data->rowHashNext[y1] == data->rowHashPrev[y1])) y1++;
-
-    unsigned int x2 = colHashSize-1;
-    unsigned int y2 = rowHashSize-1;
-    while((x2 > x1) && (data->colHashNext[x2] == data->colHashPrev[x2])) x2--;
-    while((y2 > y1) && (data->rowHashNext[y2] == data->rowHashPrev[y2])) y2--;
-    x2++;
-    y2++;
-    x1 *= 4 * pixPerByte;
-    x2 *= 4 * pixPerByte;
-
-    if(x2 > x1 && y2 > y1) {
-        x = x1;
-        y = y1;
-        w = x2 - x1;
-        h = y2 - y1;
+    for (unsigned int band = firstBand; band < lastBand; band++) {
+        const unsigned long *colHashNext = data->colHashNext + band * colHashSize;
+        const unsigned long *colHashPrev = data->colHashPrev + band * colHashSize;
+        const unsigned int bandTop    = band * HASH_BAND_ROWS;
+        const unsigned int bandBottom = min(bandTop + HASH_BAND_ROWS, rowHashSize);
+
+        unsigned int x1 = 0;
+        unsigned int y1 = bandTop;
+        while((x1 < colHashSize) && (colHashNext[x1] == colHashPrev[x1])) x1++;
+        while((y1 < bandBottom) && (data->rowHashNext[y1] == data->rowHashPrev[y1])) y1++;
+
+        if ((x1 == colHashSize) && (y1 == bandBottom)) continue;
+
+        unsigned int x2 = colHashSize;
+        unsigned int y2 = bandBottom;
+        while((x2 > x1) && (colHashNext[x2-1] == colHashPrev[x2-1])) x2--;
+        while((y2 > y1) && (data->rowHashNext[y2-1] == data->rowHashPrev[y2-1])) y2--;
+
+        // If only one of the hashes saw a change, assume the whole extent of the other
+        if (x1 == x2) {
+            x1 = 0;
+            x2 = colHashSize;
+        }
+        if (y1 == y2) {
+            y1 = bandTop;
+            y2 = bandBottom;
+        }
+
+        mergeDirt(band, x1, x2, y1, y2);
+        gotDirt = true;
+    }
+}
+
+// Merges a dirty area into a band's dirt, with columns in column hash units
+
+void VNCScreenHash::mergeDirt(unsigned int band, unsigned int x1, unsigned int x2, unsigned int y1, unsigned int y2) {
+    BandDirt &dirt = data->bandDirt[band];
+    if (dirt.x2) {
+        dirt.x1 = min(dirt.x1, x1);
+        dirt.x2 = max(dirt.x2, x2);
+        dirt.y1 = min(dirt.y1, y1);
+        dirt.y2 = max(dirt.y2, y2);
     } else {
-        x = 0;
-        y = 0;
-        w = 0;
-        h = 0;
+        dirt.x1 = x1;
+        dirt.x2 = x2;
+        dirt.y1 = y1;
+        dirt.y2 = y2;
+    }
+}
+
+/* Converts the dirt in each band into a list of rectangles. Dirt in
+ * adjacent bands is merged when it overlaps horizontally; if there
+ * are more than MAX_DIRTY_RECTS, the remainder is merged into the
+ * nearest rectangles by mergeRect(). The rectangles never overlap.
+ */
+
+unsigned int VNCScreenHash::getDirtyRects(VNCRect *rects) {
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    #ifdef VNC_FB_WIDTH
+        const unsigned int fbWidth = VNC_FB_WIDTH;
+    #endif
+    const size_t numBands = NUM_HASH_BANDS;
+    // At 32 bits per pixel, a column hash covers a single pixel
+    const unsigned int pixPerHash = sizeof(unsigned long) * 8 / fbDepth;
+    unsigned int nRects = 0;
+    for (unsigned int band = 0; band < numBands; band++) {
+        const BandDirt &dirt = data->bandDirt[band];
+        if (dirt.x2 == 0) continue;
+
+        const unsigned int x1 = dirt.x1 * pixPerHash;
+        const unsigned int x2 = min(dirt.x2 * pixPerHash, fbWidth);
+        if (x1 >= x2) continue; // Change is in the padding past the right edge
+
+        VNCRect rect;
+        rect.x = x1;
+        rect.y = dirt.y1;
+        rect.w = x2 - x1;
+        rect.h = dirt.y2 - dirt.y1;
+
+        if (nRects) {
+            VNCRect &last = rects[nRects - 1];
+            const Boolean isAdjacent = (last.y + last.h) == rect.y;
+            const Boolean isOverlap  = (rect.x <= last.x + last.w) && (last.x <= rect.x + rect.w);
+            if (isAdjacent && isOverlap) {
+                unionRect(&rect, &last);
+                continue;
+            }
+            if (nRects == MAX_DIRTY_RECTS) {
+                mergeRect(&rect, rects, nRects);
+                continue;
+            }
+        }
+        rects[nRects++] = rect;
+    }
+    return nRects;
+}
+
+/************************** SCROLL DETECTION ************************/
+
+// Hashes a range of bytes in a row of the screen, using hashRowBytes()
+
+unsigned long VNCScreenHash::hashRowRange(unsigned int y, unsigned int b1, unsigned int b2) {
+    #ifdef VNC_BYTES_PER_LINE
+        const unsigned long fbStride = VNC_BYTES_PER_LINE;
+    #endif
+    return hashRowBytes(VNCFrameBuffer::getBaseAddr() + fbStride * y, fbStride, b1, b2);
+}
+
+/* Looks for a vertical scroll within a dirty rectangle. Since only the
+ * pixels inside the rectangle changed since the last update, the hash
+ * of each row inside the rectangle prior to the change can be derived
+ * from the saved row hashes. A few distinctive rows are then looked
+ * up among the old hashes to vote on an offset, and the longest run of
+ * rows which match at that offset is returned.
+ */
+
+Boolean VNCScreenHash::findScroll(const VNCRect &rect, unsigned int &runStart, unsigned int &runLength, int &dy) {
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    #ifdef VNC_BYTES_PER_LINE
+        const unsigned long fbStride = VNC_BYTES_PER_LINE;
+    #endif
+    const unsigned int b1 = ((unsigned long)rect.x * fbDepth / 8) & ~3;
+    const unsigned int b2 = min((((unsigned long)(rect.x + rect.w) * fbDepth / 8) + 3) & ~3, fbStride);
+    const unsigned int h  = rect.h;
+    unsigned long *newSums = data->newRowHashes;
+    unsigned long *oldSums = data->oldRowHashes;
+
+    for (unsigned int i = 0; i < h; i++) {
+        const unsigned int y = rect.y + i;
+        newSums[i] = hashRowRange(y, b1, b2);
+        oldSums[i] = data->rowHashSent[y] - data->rowHashPrev[y] + newSums[i];
+    }
+
+    // Vote on the offset
+
+    int           candidates[SCROLL_ANCHORS * 2];
+    unsigned char votes[SCROLL_ANCHORS * 2];
+    unsigned char nCandidates = 0;
+    const unsigned int step = max(1, h / SCROLL_ANCHORS);
+    for (unsigned int anchor = 1; anchor < h; anchor += step) {
+        // Find a row which changed and differs from the one above it
+        unsigned int i = anchor;
+        while ((i < h) && ((newSums[i] == newSums[i-1]) || (newSums[i] == oldSums[i]))) i++;
+        if (i == h) break;
+
+        for (unsigned int j = 0; j < h; j++) {
+            if ((j == i) || (oldSums[j] != newSums[i])) continue;
+            const int offset = (int)j - (int)i;
+            unsigned char c;
+            for (c = 0; (c < nCandidates) && (candidates[c] != offset); c++);
+            if (c == nCandidates) {
+                if (nCandidates == sizeof(votes)) continue;
+                candidates[c] = offset;
+                votes[c] = 0;
+                nCandidates++;
+            }
+            votes[c]++;
+        }
+    }
+
+    unsigned char best = 0;
+    for (unsigned char c = 1; c < nCandidates; c++) {
+        if (votes[c] > votes[best]) best = c;
+    }
+    if ((nCandidates == 0) || (votes[best] < 2)) return false;
+    dy = candidates[best];
+
+    // Find the longest run of rows that match at this offset
+
+    unsigned int bestStart = 0, bestLength = 0, start = 0, length = 0;
+    for (unsigned int i = 0; i < h; i++) {
+        const int j = (int)i + dy;
+        if ((j >= 0) && (j < (int)h) && (newSums[i] == oldSums[j])) {
+            if (length++ == 0) start = i;
+            if (length > bestLength) {
+                bestStart  = start;
+                bestLength = length;
+            }
+        } else {
+            length = 0;
+        }
+    }
+
+    unsigned int distinct = 0;
+    for (unsigned int i = bestStart + 1; i < bestStart + bestLength; i++) {
+        if (newSums[i] != newSums[i-1]) distinct++;
     }
+    if ((bestLength < MIN_SCROLL_ROWS) || (distinct < MIN_DISTINCT_ROWS)) return false;
+
+    runStart  = rect.y + bestStart;
+    runLength = bestLength;
+    return true;
+}
+
+// Returns the number of bytes of the screen a rect covers
+
+unsigned long VNCScreenHash::rectBytes(const VNCRect &rect) {
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    return ((unsigned long) rect.w * fbDepth + 7) / 8 * rect.h;
+}
+
+// Takes bytes from the analysis budget, if there are enough left
+
+Boolean VNCScreenHash::spendAnalysis(unsigned long bytes) {
+    if (bytes > analysisBytes) return false;
+    analysisBytes -= bytes;
+    return true;
+}
+
+/* Replaces the scrolled portions of the dirty rects with CopyRects,
+ * leaving only the newly exposed strips to be encoded. This may split
+ * a dirty rect in two.
+ */
+
+unsigned int VNCScreenHash::findScrolls(VNCRect *rects, unsigned int &nRects, VNCFBUpdateCopyRect *copyRects) {
+    unsigned int nCopyRects = 0;
+    if (!sentHashesValid) return 0;
+
+    const unsigned int nDirtyRects = nRects;
+    for (unsigned int i = 0; (i < nDirtyRects) && (nCopyRects < MAX_COPY_RECTS); i++) {
+        VNCRect &rect = rects[i];
+        unsigned int runStart, runLength;
+        int dy;
+        if (rect.h < MIN_SCROLL_ROWS) continue;
+        if (!spendAnalysis(rectBytes(rect))) continue;
+        if (!findScroll(rect, runStart, runLength, dy)) continue;
+
+        const unsigned int above = runStart - rect.y;
+        const unsigned int below = rect.y + rect.h - runStart - runLength;
+        if (above && below && (nRects == MAX_DIRTY_RECTS)) continue;
+
+        dprintf("Found scroll of %d rows\n", dy);
+
+        VNCFBUpdateCopyRect &copy = copyRects[nCopyRects++];
+        copy.rect.x = rect.x;
+        copy.rect.y = runStart;
+        copy.rect.w = rect.w;
+        copy.rect.h = runLength;
+        copy.encodingType = mCopyRectEncoding;
+        copy.srcX = rect.x;
+        copy.srcY = runStart + dy;
+
+        if (above && below) {
+            VNCRect &lower = rects[nRects++];
+            lower.x = rect.x;
+            lower.y = runStart + runLength;
+            lower.w = rect.w;
+            lower.h = below;
+            rect.h = above;
+        } else if (above) {
+            rect.h = above;
+        } else if (below) {
+            rect.y = runStart + runLength;
+            rect.h = below;
+        } else {
+            rect.h = 0;
+        }
+    }
+
+    // Remove any rects which were entirely replaced by CopyRects
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < nRects; i++) {
+        if (rects[i].h) rects[n++] = rects[i];
+    }
+    nRects = n;
+    return nCopyRects;
+}
+
+/************************** MOVE DETECTION ************************/
+
+void VNCScreenHash::hashTile(const unsigned char *src, TileHash &hash) {
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    #ifdef VNC_BYTES_PER_LINE
+        const unsigned long fbStride = VNC_BYTES_PER_LINE;
+    #endif
+    const unsigned int tileBytes = TILE_SIZE * fbDepth / 8;
+    unsigned long sum = 0, mix = 0;
+    for (unsigned int y = 0; y < TILE_SIZE; y++) {
+        for (unsigned int x = 0; x < tileBytes; x++) {
+            const unsigned char b = src[x];
+            sum += b;
+            mix = ((mix << 5) | (mix >> 27)) ^ b;
+        }
+        src += fbStride;
+    }
+    hash.sum = sum;
+    hash.mix = mix;
+}
+
+// Marks the tiles under a rect as not yet hashed
+
+void VNCScreenHash::dropTiles(const VNCRect &rect) {
+    const unsigned int tileCols = TILE_COLS;
+    const unsigned int tx2 = min((rect.x + rect.w + TILE_SIZE - 1) / TILE_SIZE, tileCols);
+    const unsigned int ty2 = min((rect.y + rect.h + TILE_SIZE - 1) / TILE_SIZE, TILE_ROWS);
+    for (unsigned int ty = rect.y / TILE_SIZE; ty < ty2; ty++) {
+        for (unsigned int tx = rect.x / TILE_SIZE; tx < tx2; tx++) {
+            data->tileHashSent[ty * tileCols + tx].sum = TILE_HASH_INVALID;
+        }
+    }
+}
+
+/* Drops the tile hashes for the destination of the CopyRects, or for
+ * all the tiles if the saved hashes were discarded, then hashes as many
+ * of the dropped tiles as the analysis budget allows. The tiles in the
+ * dirty rects are hashed by refineRects().
+ */
+
+void VNCScreenHash::snapshotTiles(const VNCFBUpdateCopyRect *copyRects, unsigned int nCopyRects) {
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    const unsigned int tileCols = TILE_COLS;
+    const unsigned int tileRows = TILE_ROWS;
+    const unsigned int numTiles = tileCols * tileRows;
+    unsigned int i;
+    if (!sentHashesValid) {
+        for (i = 0; i < numTiles; i++) {
+            data->tileHashSent[i].sum = TILE_HASH_INVALID;
+        }
+        tileRefill = 0;
+    }
+    for (i = 0; i < nCopyRects; i++) {
+        dropTiles(copyRects[i].rect);
+    }
+
+    // Hash the dropped tiles, picking up where the last report left off
+    const unsigned long tileBytes = (unsigned long) TILE_SIZE * TILE_SIZE * fbDepth / 8;
+    for (i = 0; i < numTiles; i++) {
+        if (tileRefill >= numTiles) tileRefill = 0;
+        TileHash &sent = data->tileHashSent[tileRefill];
+        if (sent.sum == TILE_HASH_INVALID) {
+            if (!spendAnalysis(tileBytes)) break;
+            const unsigned int tx = tileRefill % tileCols;
+            const unsigned int ty = tileRefill / tileCols;
+            hashTile(VNCFrameBuffer::getPixelAddr(tx * TILE_SIZE, ty * TILE_SIZE), sent);
+        }
+        tileRefill++;
+    }
+}
+
+/* Compares the tiles in the dirty rects against the tiles the client
+ * was last sent, and shrinks or splits the rects to leave out the rows
+ * of tiles which did not change. The band hashes only know which
+ * columns changed somewhere within a band, so this helps whenever a
+ * rect encloses several small, separate changes. The new hashes are
+ * saved as they are computed, so each tile's result is recorded in
+ * tileState for rects that share a tile.
+ */
+
+Boolean VNCScreenHash::tileChanged(unsigned int tx, unsigned int ty) {
+    const unsigned int tileCols = TILE_COLS;
+    if ((tx >= tileCols) || (ty >= TILE_ROWS)) {
+        // Partial tiles at the edges of the screen are not hashed
+        return true;
+    }
+    const unsigned int i = ty * tileCols + tx;
+    if (shadow) {
+        // The shadow comparison marks the changed tiles as it goes
+        return data->tileState[i] == TileChanged;
+    }
+    if (data->tileState[i] == TileUnknown) {
+        TileHash hash;
+        hashTile(VNCFrameBuffer::getPixelAddr(tx * TILE_SIZE, ty * TILE_SIZE), hash);
+        TileHash &sent = data->tileHashSent[i];
+        data->tileState[i] = ((hash.sum == sent.sum) && (hash.mix == sent.mix)) ? TileSame : TileChanged;
+        sent = hash;
+    }
+    return data->tileState[i] == TileChanged;
+}
+
+// Splits a rect along rows or columns of tiles which are unchanged
+
+void VNCScreenHash::splitRect(const VNCRect &rect, Boolean byRows, VNCRect *out, unsigned int &nOut) {
+    const unsigned int rx2 = rect.x + rect.w;
+    const unsigned int ry2 = rect.y + rect.h;
+    const unsigned int tx1 = rect.x / TILE_SIZE, tx2 = (rx2 + TILE_SIZE - 1) / TILE_SIZE;
+    const unsigned int ty1 = rect.y / TILE_SIZE, ty2 = (ry2 + TILE_SIZE - 1) / TILE_SIZE;
+    const unsigned int n1 = byRows ? ty1 : tx1, n2 = byRows ? ty2 : tx2;
+    const unsigned int m1 = byRows ? tx1 : ty1, m2 = byRows ? tx2 : ty2;
+
+    Boolean open = false;
+    unsigned int a1, a2, b1, b2; // Extent of the open rect, in tiles
+    for (unsigned int n = n1; n <= n2; n++) {
+        // Find the changed span in this row (or column) of tiles
+        unsigned int c1 = m2, c2 = m1;
+        for (unsigned int m = m1; (n < n2) && (m < m2); m++) {
+            if (byRows ? tileChanged(m, n) : tileChanged(n, m)) {
+                if (m < c1) c1 = m;
+                c2 = m + 1;
+            }
+        }
+        if (c1 < c2) {
+            if (!open) {
+                a1 = n;
+                b1 = c1;
+                b2 = c2;
+                open = true;
+            }
+            a2 = n + 1;
+            b1 = min(b1, c1);
+            b2 = max(b2, c2);
+        } else if (open) {
+            // A row (or column) of unchanged tiles ends the rect
+            const unsigned int x1 = max(rect.x, (byRows ? b1 : a1) * TILE_SIZE);
+            const unsigned int x2 = min(rx2,    (byRows ? b2 : a2) * TILE_SIZE);
+            const unsigned int y1 = max(rect.y, (byRows ? a1 : b1) * TILE_SIZE);
+            const unsigned int y2 = min(ry2,    (byRows ? a2 : b2) * TILE_SIZE);
+            VNCRect r;
+            r.x = x1; r.w = x2 - x1;
+            r.y = y1; r.h = y2 - y1;
+            if (nOut == MAX_DIRTY_RECTS) {
+                // No room, so grow the nearest one
+                mergeRect(&r, out, nOut);
+            } else {
+                out[nOut++] = r;
+            }
+            open = false;
+        }
+    }
+}
+
+void VNCScreenHash::refineRects(VNCRect *rects, unsigned int &nRects) {
+    VNCRect byRows[MAX_DIRTY_RECTS];
+    unsigned int i, nByRows = 0, nRefined = 0;
+
+    // Hashing the tiles reads all of the rects, so if that is more than
+    // the analysis budget allows, the rects are sent as they are and the
+    // tiles are hashed later by snapshotTiles()
+    if (!shadow) {
+        unsigned long bytes = 0;
+        for (i = 0; i < nRects; i++) {
+            bytes += rectBytes(rects[i]);
+        }
+        if (!spendAnalysis(bytes)) {
+            for (i = 0; i < nRects; i++) {
+                dropTiles(rects[i]);
+            }
+            return;
+        }
+    }
+
+    // Split the rects into horizontal strips, then split the strips into columns
+    for (i = 0; i < nRects; i++) {
+        splitRect(rects[i], true, byRows, nByRows);
+    }
+    VNCRect refined[MAX_DIRTY_RECTS];
+    for (i = 0; i < nByRows; i++) {
+        splitRect(byRows[i], false, refined, nRefined);
+    }
+
+    // Forget the results, so the tiles will be checked again next time
+    const unsigned int tileCols = TILE_COLS;
+    for (i = 0; i < nRects; i++) {
+        const VNCRect &rect = rects[i];
+        const unsigned int tx2 = min((rect.x + rect.w + TILE_SIZE - 1) / TILE_SIZE, tileCols);
+        const unsigned int ty2 = min((rect.y + rect.h + TILE_SIZE - 1) / TILE_SIZE, TILE_ROWS);
+        for (unsigned int ty = rect.y / TILE_SIZE; ty < ty2; ty++) {
+            for (unsigned int tx = rect.x / TILE_SIZE; tx < tx2; tx++) {
+                data->tileState[ty * tileCols + tx] = TileUnknown;
+            }
+        }
+    }
+
+    #if LOG_COMPRESSION_STATS
+        if (nRefined != nRects) {
+            dprintf("Refined %d dirty rects into %d\n", nRects, nRefined);
+        }
+    #endif
+
+    for (i = 0; i < nRefined; i++) {
+        rects[i] = refined[i];
+    }
+    nRects = nRefined;
+}
+
+/* Searches an area of the screen for a tile, at any pixel position. The
+ * byte sums of every tile-sized block are computed incrementally, and
+ * the blocks whose sum matches are then fully hashed.
+ */
+
+Boolean VNCScreenHash::searchTile(const VNCRect &area, const TileHash &target, unsigned int &px, unsigned int &py) {
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    #ifdef VNC_BYTES_PER_LINE
+        const unsigned long fbStride = VNC_BYTES_PER_LINE;
+    #endif
+    if ((area.w < TILE_SIZE) || (area.h < TILE_SIZE)) return false;
+
+    const unsigned int pixBytes  = fbDepth / 8;
+    const unsigned int tileBytes = TILE_SIZE * pixBytes;
+    const unsigned int areaBytes = area.w * pixBytes;
+    unsigned long *colSums = data->searchSums;
+    unsigned int checks = 0;
+
+    // Sum the first rows of each byte column
+    const unsigned char *top = VNCFrameBuffer::getPixelAddr(area.x, area.y);
+    const unsigned char *bottom = top;
+    for (unsigned int x = 0; x < areaBytes; x++) {
+        colSums[x] = 0;
+    }
+    for (unsigned int y = 0; y < TILE_SIZE - 1; y++, bottom += fbStride) {
+        for (unsigned int x = 0; x < areaBytes; x++) {
+            colSums[x] += bottom[x];
+        }
+    }
+
+    for (unsigned int y = area.y; y + TILE_SIZE <= area.y + area.h; y++, top += fbStride, bottom += fbStride) {
+        unsigned int x;
+        for (x = 0; x < areaBytes; x++) {
+            colSums[x] += bottom[x];
+        }
+
+        // Slide a tile-sized window across the column sums
+        unsigned long sum = 0;
+        for (x = 0; x < tileBytes; x++) {
+            sum += colSums[x];
+        }
+        for (x = 0;; x += pixBytes) {
+            if (sum == target.sum) {
+                TileHash hash;
+                hashTile(top + x, hash);
+                if (hash.mix == target.mix) {
+                    px = area.x + x / pixBytes;
+                    py = y;
+                    return true;
+                }
+                if (++checks == MAX_TILE_CHECKS) return false;
+            }
+            if (x + tileBytes + pixBytes > areaBytes) break;
+            for (unsigned int i = 0; i < pixBytes; i++) {
+                sum += colSums[x + tileBytes + i] - colSums[x + i];
+            }
+        }
+
+        for (x = 0; x < areaBytes; x++) {
+            colSums[x] -= top[x];
+        }
+    }
+    return false;
+}
+
+// Checks whether a tile the client has can now be found at an offset
+
+Boolean VNCScreenHash::tileMovedTo(unsigned int tx, unsigned int ty, int dx, int dy) {
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    #ifdef VNC_FB_WIDTH
+        const unsigned int fbWidth  = VNC_FB_WIDTH;
+        const unsigned int fbHeight = VNC_FB_HEIGHT;
+    #endif
+    const int x = (int)(tx * TILE_SIZE) + dx;
+    const int y = (int)(ty * TILE_SIZE) + dy;
+    if ((x < 0) || (y < 0) || (x + TILE_SIZE > fbWidth) || (y + TILE_SIZE > fbHeight)) return false;
+
+    const TileHash &old = data->tileHashSent[ty * TILE_COLS + tx];
+    if (old.sum == TILE_HASH_INVALID) return false;
+    if (!spendAnalysis((unsigned long) TILE_SIZE * TILE_SIZE * fbDepth / 8)) return false;
+    TileHash hash;
+    hashTile(VNCFrameBuffer::getPixelAddr(x, y), hash);
+    return (hash.sum == old.sum) && (hash.mix == old.mix);
+}
+
+// Removes a rectangle from the list of dirty rects, splitting them as needed
+
+void VNCScreenHash::excludeRect(VNCRect *rects, unsigned int &nRects, const VNCRect &hole) {
+    const unsigned int n = nRects;
+    for (unsigned int i = 0; i < n; i++) {
+        VNCRect &rect = rects[i];
+        const unsigned int x1 = max(rect.x, hole.x);
+        const unsigned int y1 = max(rect.y, hole.y);
+        const unsigned int x2 = min(rect.x + rect.w, hole.x + hole.w);
+        const unsigned int y2 = min(rect.y + rect.h, hole.y + hole.h);
+        if ((x1 >= x2) || (y1 >= y2)) continue;
+
+        // Split into strips above, below, left and right of the hole
+        VNCRect strips[4];
+        unsigned int nStrips = 0;
+        if (y1 > rect.y) {
+            strips[nStrips].x = rect.x; strips[nStrips].w = rect.w;
+            strips[nStrips].y = rect.y; strips[nStrips].h = y1 - rect.y;
+            nStrips++;
+        }
+        if (y2 < rect.y + rect.h) {
+            strips[nStrips].x = rect.x; strips[nStrips].w = rect.w;
+            strips[nStrips].y = y2;     strips[nStrips].h = rect.y + rect.h - y2;
+            nStrips++;
+        }
+        if (x1 > rect.x) {
+            strips[nStrips].x = rect.x; strips[nStrips].w = x1 - rect.x;
+            strips[nStrips].y = y1;     strips[nStrips].h = y2 - y1;
+            nStrips++;
+        }
+        if (x2 < rect.x + rect.w) {
+            strips[nStrips].x = x2;     strips[nStrips].w = rect.x + rect.w - x2;
+            strips[nStrips].y = y1;     strips[nStrips].h = y2 - y1;
+            nStrips++;
+        }
+
+        // If there is no room to split the rect, it is sent as is
+        if (nRects + nStrips > MAX_DIRTY_RECTS + 1) continue;
+
+        if (nStrips == 0) {
+            rect.w = rect.h = 0;
+        } else {
+            rect = strips[0];
+            for (unsigned int j = 1; j < nStrips; j++) {
+                rects[nRects++] = strips[j];
+            }
+        }
+    }
+
+    // Remove any rects which were entirely covered
+    unsigned int n2 = 0;
+    for (unsigned int j = 0; j < nRects; j++) {
+        if (rects[j].h) rects[n2++] = rects[j];
+    }
+    nRects = n2;
+}
+
+unsigned int VNCScreenHash::findMove(VNCRect *rects, unsigned int &nRects, VNCFBUpdateCopyRect *copyRects) {
+    #ifdef VNC_FB_BITS_PER_PIX
+        const unsigned char fbDepth = VNC_FB_BITS_PER_PIX;
+    #endif
+    if ((fbDepth < 8) || !sentHashesValid) return 0;
+
+    const unsigned int tileCols = TILE_COLS;
+    const unsigned int tileRows = TILE_ROWS;
+    unsigned int anchors = 0;
+
+    for (unsigned int i = 0; i < nRects; i++) {
+        const VNCRect &rect = rects[i];
+        const unsigned int tx2 = min((rect.x + rect.w) / TILE_SIZE, tileCols);
+        const unsigned int ty2 = min((rect.y + rect.h) / TILE_SIZE, tileRows);
+        for (unsigned int ty = (rect.y + TILE_SIZE - 1) / TILE_SIZE; ty < ty2; ty++) {
+            for (unsigned int tx = (rect.x + TILE_SIZE - 1) / TILE_SIZE; tx < tx2; tx++) {
+                // Look for a tile which differs from its neighbors and which is no longer in place
+                const TileHash *old = data->tileHashSent + ty * tileCols + tx;
+                if (old->sum == TILE_HASH_INVALID) continue;
+                if ((tx > 0)            && (old[-1].sum        == old->sum)) continue;
+                if ((tx < tileCols - 1) && (old[1].sum         == old->sum)) continue;
+                if ((ty > 0)            && (old[-tileCols].sum == old->sum)) continue;
+                if (tileMovedTo(tx, ty, 0, 0)) continue;
+
+                for (unsigned int j = 0; j < nRects; j++) {
+                    unsigned int px, py;
+                    if (!spendAnalysis(rectBytes(rects[j]))) return 0;
+                    if (!searchTile(rects[j], *old, px, py)) continue;
+                    const int dx = (int)px - (int)(tx * TILE_SIZE);
+                    const int dy = (int)py - (int)(ty * TILE_SIZE);
+
+                    // Grow a block of tiles around the anchor which moved by the same amount
+                    unsigned int bx1 = tx, by1 = ty, bx2 = tx + 1, by2 = ty + 1;
+                    Boolean grew;
+                    do {
+                        unsigned int k;
+                        grew = false;
+                        for (k = by1; (bx1 > 0) && (k < by2) && tileMovedTo(bx1 - 1, k, dx, dy); k++);
+                        if ((bx1 > 0) && (k == by2)) {bx1--; grew = true;}
+                        for (k = by1; (bx2 < tileCols) && (k < by2) && tileMovedTo(bx2, k, dx, dy); k++);
+                        if ((bx2 < tileCols) && (k == by2)) {bx2++; grew = true;}
+                        for (k = bx1; (by1 > 0) && (k < bx2) && tileMovedTo(k, by1 - 1, dx, dy); k++);
+                        if ((by1 > 0) && (k == bx2)) {by1--; grew = true;}
+                        for (k = bx1; (by2 < tileRows) && (k < bx2) && tileMovedTo(k, by2, dx, dy); k++);
+                        if ((by2 < tileRows) && (k == bx2)) {by2++; grew = true;}
+                    } while (grew);
+
+                    if ((bx2 - bx1) * (by2 - by1) >= MIN_MOVE_TILES) {
+                        dprintf("Found move of %d,%d\n", dx, dy);
+
+                        VNCFBUpdateCopyRect &copy = copyRects[0];
+                        copy.rect.x = bx1 * TILE_SIZE + dx;
+                        copy.rect.y = by1 * TILE_SIZE + dy;
+                        copy.rect.w = (bx2 - bx1) * TILE_SIZE;
+                        copy.rect.h = (by2 - by1) * TILE_SIZE;
+                        copy.encodingType = mCopyRectEncoding;
+                        copy.srcX = bx1 * TILE_SIZE;
+                        copy.srcY = by1 * TILE_SIZE;
+
+                        excludeRect(rects, nRects, copy.rect);
+                        return 1;
+                    }
+                    break;
+                }
+                if (++anchors == MOVE_ANCHORS) return 0;
+            }
+        }
+    }
+    return 0;
 }
 
 // Prepare the hashes so that we can start processing a new screen
@@ -308,16 +1598,23 @@ void VNCScreenHash::endCompute() {
 /* This is the C++ implementation of computeHashes(). It was optimized
  * by looking at the disassembly and using temporary variables to try
  * to force the compiler to use register variables inside the loop.
+ *
+ * Plain sums of the pixels miss swapped words and changes that cancel
+ * out, so each long is instead mixed into the hash with HASH_MIX(), which
+ * makes the hash depend on the position of each long. The row hash mixes
+ * once per long across the row, while each column hash mixes once per
+ * row down the band.
  */
+
 void VNCScreenHash::computeHashes(unsigned int rows) {
     const unsigned long *l = scrnPtr;
 
-    #define PROCESS_CHUNK(col) pix = *l++; rowHash += pix; *colHash++ = *colHash + pix;
+    #define PROCESS_CHUNK(col) pix = *l++; HASH_MIX(rowHash, pix); HASH_MIX(*colHash, pix); colHash++;
 
     //HideCursor();
     for(;rows--;) {
         unsigned long  rowHash = 0;
-        unsigned long *colHash = data->colHashNext;
+        unsigned long *colHash = scrnColHashPtr;
         unsigned long  pix;
         PROCESS_CHUNK(0);
         PROCESS_CHUNK(1);
@@ -349,7 +1646,13 @@ void VNCScreenHash::computeHashes(unsigned int rows) {
 
 /* An optimized version of computeHashes() with half as many instruction
  * words, which is estimated to reduce total memory access by 25%. This
- * is done by using movem.l to read either 20 and 24 bytes at a time.
+ * is done by using movem.l to read 16 bytes at a time.
+ *
+ * On the 68000, each long costs 8 cycles to load with movem.l, 38 cycles
+ * to mix into the row hash and 64 cycles to mix into the column hash, or
+ * 110 cycles in all, where the plain sums took 36. At 512x342, this comes
+ * to about 1800 cycles per row, or 80 ms per screen at 7.8 MHz, which
+ * adaptRowsPerTick() spreads out over as many ticks as needed.
  */
 asm void VNCScreenHash::computeHashesFast(unsigned int rows) {
     /*
@@ -357,17 +1660,19 @@ asm void VNCScreenHash::computeHashesFast(unsigned int rows) {
      *   A0                     : Source ptr
      *   A1                     : Col hash ptr
      *   A2                     : Row hash ptr
-     *   A3                     : Line sum
+     *   A3                     : Temporary for mixing the row hash
      *   A4, A5                 : Unused
      *   A6                     : Link for debugger
      *   A7                     : Stack ptr
      *   D0                     : Line count from argument rows
-     *   D1,D2,D3,D4,D5,D6      : Source pixels (up to 192 at a time)
-     *   D7                     : Unused
+     *   D1,D2,D3,D4            : Source pixels (up to 128 at a time)
+     *   D5                     : Chunk count
+     *   D6                     : Col hash
+     *   D7                     : Row hash
      */
 
     link    a6,#0000           // Link for debugger
-    movem.l d3-d6/a2-a3,-(a7)  // Save registers
+    movem.l d3-d7/a2-a3,-(a7)  // Save registers
 
     //_HideCursor
 
@@ -379,51 +1684,166 @@ asm void VNCScreenHash::computeHashesFast(unsigned int rows) {
     bra sumLine
 sumLoop:
     movea.l scrnColHashPtr, a1;// Set pointer to column hashes
-    movea.l #0,a3              // Clear the line sum
+    moveq   #0,d7              // Clear the row hash
 
     #if (VNC_FB_WIDTH == 512) && (VNC_FB_BITS_PER_PIX == 1)
         // Use the fewest overall instructions since we are on the 68000 w/o a instruction cache
 
-        // Columns 1 through 160
-        movem.l (a0)+,d1-d5        // Load 160 pixels
-        adda.l  d1,a3              // Add to row sum
-        adda.l  d2,a3
-        adda.l  d3,a3
-        adda.l  d4,a3
-        adda.l  d5,a3
-        add.l   d1,(a1)+           // Add to col sum
-        add.l   d2,(a1)+
-        add.l   d3,(a1)+
-        add.l   d4,(a1)+
-        add.l   d5,(a1)+
-
-        // Columns 161 through 320
-        movem.l (a0)+,d1-d5        // Load 160 pixels
-        adda.l  d1,a3              // Add to row sum
-        adda.l  d2,a3
-        adda.l  d3,a3
-        adda.l  d4,a3
-        adda.l  d5,a3
-        add.l   d1,(a1)+           // Add to col sum
-        add.l   d2,(a1)+
-        add.l   d3,(a1)+
-        add.l   d4,(a1)+
-        add.l   d5,(a1)+
-
-        // Columns 321 through 512
-        movem.l (a0)+,d1-d6        // Load 192 pixels
-        adda.l  d1,a3              // Add to row sum
-        adda.l  d2,a3
-        adda.l  d3,a3
-        adda.l  d4,a3
-        adda.l  d5,a3
-        adda.l  d6,a3
-        add.l   d1,(a1)+           // Add to col sum
-        add.l   d2,(a1)+
-        add.l   d3,(a1)+
-        add.l   d4,(a1)+
-        add.l   d5,(a1)+
-        add.l   d6,(a1)+
+        // Columns 1 through 128
+        movem.l (a0)+,d1-d4        // Load 128 pixels
+        move.l  d7,a3              // Mix into row hash
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d1,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d2,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d3,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d4,d7
+        move.l  (a1),d6            // Mix into column hashes
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d1,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d2,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d3,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d4,d6
+        move.l  d6,(a1)+
+
+        // Columns 129 through 256
+        movem.l (a0)+,d1-d4        // Load 128 pixels
+        move.l  d7,a3              // Mix into row hash
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d1,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d2,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d3,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d4,d7
+        move.l  (a1),d6            // Mix into column hashes
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d1,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d2,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d3,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d4,d6
+        move.l  d6,(a1)+
+
+        // Columns 257 through 384
+        movem.l (a0)+,d1-d4        // Load 128 pixels
+        move.l  d7,a3              // Mix into row hash
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d1,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d2,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d3,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d4,d7
+        move.l  (a1),d6            // Mix into column hashes
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d1,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d2,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d3,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d4,d6
+        move.l  d6,(a1)+
+
+        // Columns 385 through 512
+        movem.l (a0)+,d1-d4        // Load 128 pixels
+        move.l  d7,a3              // Mix into row hash
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d1,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d2,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d3,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d4,d7
+        move.l  (a1),d6            // Mix into column hashes
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d1,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d2,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d3,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d4,d6
+        move.l  d6,(a1)+
     #else
         // We might have differing pixel depths or a resolution of either 512 or 640,
         // so transfer 16 bytes at time as this divides cleanly into all possibilities.
@@ -439,14 +1859,42 @@ sumLoop:
     chunkLoop:
         // Transfer 16 bytes at a time using four registers
         movem.l (a0)+,d1-d4        // Load 128 pixels
-        adda.l  d1,a3              // Add to line sum
-        adda.l  d2,a3
-        adda.l  d3,a3
-        adda.l  d4,a3
-        add.l   d1,(a1)+           // Add to values to column hashes
-        add.l   d2,(a1)+
-        add.l   d3,(a1)+
-        add.l   d4,(a1)+
+        move.l  d7,a3              // Mix into row hash
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d1,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d2,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d3,d7
+        move.l  d7,a3
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d4,d7
+        move.l  (a1),d6            // Mix into column hashes
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d1,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d2,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d3,d6
+        move.l  d6,(a1)+
+        move.l  (a1),d6
+        lsl.l   #5,d6
+        add.l   (a1),d6
+        add.l   d4,d6
+        move.l  d6,(a1)+
 
     transferChunk:
         dbra d5, chunkLoop
@@ -465,15 +1913,23 @@ sumLoop:
         bra transferWords
     wordLoop:
         // Transfer two bytes at a time using one register
-        move.w (a0)+,d1            // Load 16 pixels
-        adda.w  d1,a3              // Add to line sum
-        add.w   d1,(a1)+           // Add to values to column hashes
+        moveq   #0,d1
+        move.w  (a0)+,d1           // Load 16 pixels
+        move.l  d7,a3              // Mix into row hash
+        lsl.l   #5,d7
+        add.l   a3,d7
+        add.l   d1,d7
+        move.w  (a1),d6            // Mix into column hashes
+        lsl.w   #5,d6
+        add.w   (a1),d6
+        add.w   d1,d6
+        move.w  d6,(a1)+
 
     transferWords:
         dbra d5, wordLoop
     #endif
 
-    move.l a3,(a2)+            // Write the line sum
+    move.l d7,(a2)+            // Write the row hash
 
 sumLine:
     dbra d0, sumLoop
@@ -484,87 +1940,129 @@ sumLine:
     //_ShowCursor
 
 noRows:
-    movem.l (a7)+,d3-d6/a2-a3  // Restore registers
+    movem.l (a7)+,d3-d7/a2-a3  // Restore registers
     unlk    a6
     rts                        // Return
 }
 
+/* This version works down one column of 16 bytes per call. Each call
+ * adds its share of every row hash, multiplied by 33 once for each long
+ * and word to its right, so the row hashes must be cleared beforehand.
+ */
 asm void VNCScreenHash::computeHashesFastest(unsigned int column) {
     /*
      * Register Assignments:
      *   A0                      : Source ptr
      *   A1                      : Row hash ptr
+     *   A2                      : Col hash ptr
+     *   A3                      : Temporary for mixing the row hash
      *   A5                      : Application globals
      *   A6                      : Link for debugger
      *   A7                      : Stack ptr
-     *   D0                      : Starting column offset
+     *   D0                      : Longs and words to the right
      *   D1                      : Rows in screen
      *   D2,D3,D4,D5             : Source pixels (up to 128 at a time)
-     *   A2,A3,A4,D6             : Column sums
+     *   D6                      : Col hash
      *   D7                      : Linestride
      */
 
     link    a6,#0000           // Link for debugger
-    movem.l d3-d7/a2-a5,-(a7)  // Save registers
+    movem.l d3-d7/a2-a3,-(a7)  // Save registers
 
     //_HideCursor
 
     movea.l scrnPtr,a0
     movea.l scrnRowHashPtr,a1
+    movea.l scrnColHashPtr,a2  // Set pointer to column hashes
 
     // Compute offset to starting column
     move.w  8(a6),d0           // Load the starting column
     lsl.w   #4,d0              // Multiply by 16
     adda.w  d0, a0             // Offset to starting column
+    adda.w  d0, a2
+    lsr.w   #2,d0              // Index of the first long in the row
 
-    // Compute linestride and rows
+    // Compute the multiplier count, linestride and rows
 
     #ifndef VNC_BYTES_PER_LINE
-        move.w fbStride,d7
-        sub.w #16,d7
+        move.w  fbStride,d6
+        move.w  d6,d7
+        and.w   #15,d7
+        lsr.w   #1,d7          // Words in the row
+        and.w   #~15,d6
+        lsr.w   #2,d6          // Longs in the row
+        add.w   d7,d6
+        move.w  fbStride,d7
+        sub.w   #16,d7
     #else
+        move.w  #(VNC_BYTES_PER_LINE & ~15) / 4 + (VNC_BYTES_PER_LINE & 15) / 2,d6
         move.w  #VNC_BYTES_PER_LINE-16,d7
     #endif
+    subq.w  #4,d6
+    sub.w   d0,d6              // Longs and words to the right of this column
+    move.w  d6,d0
     #ifndef VNC_FB_HEIGHT
         move.w  fbHeight,d1
     #else
         move.w  #VNC_FB_HEIGHT,d1
     #endif
 
-    clr.l   d2                 // Clear column sums
-    movea.l d2, a2
-    movea.l d2, a3
-    movea.l d2, a4
-    move.l  d2, d6
-
     bra nextRow
 rowLoop:
     movem.l (a0)+,d2-d5        // Load 128 pixels
     adda.l  d7, a0             // Move to next row
 
-    adda.l  d2, a2             // Add to column sums
-    adda.l  d3, a3
-    adda.l  d4, a4
-    add.l   d5, d6
-
-    add.l   d2, d3             // Add to row sum
-    add.l   d3, d4
-    add.l   d4, d5
-    add.l   d5, (a1)+
+    move.l  (a2),d6            // Mix into column hashes
+    lsl.l   #5,d6
+    add.l   (a2),d6
+    add.l   d2,d6
+    move.l  d6,(a2)+
+    move.l  (a2),d6
+    lsl.l   #5,d6
+    add.l   (a2),d6
+    add.l   d3,d6
+    move.l  d6,(a2)+
+    move.l  (a2),d6
+    lsl.l   #5,d6
+    add.l   (a2),d6
+    add.l   d4,d6
+    move.l  d6,(a2)+
+    move.l  (a2),d6
+    lsl.l   #5,d6
+    add.l   (a2),d6
+    add.l   d5,d6
+    move.l  d6,(a2)+
+    suba.w  #16,a2
+
+    move.l  d2,a3              // Combine as the row hash would
+    lsl.l   #5,d2
+    add.l   a3,d2
+    add.l   d3,d2
+    move.l  d2,a3
+    lsl.l   #5,d2
+    add.l   a3,d2
+    add.l   d4,d2
+    move.l  d2,a3
+    lsl.l   #5,d2
+    add.l   a3,d2
+    add.l   d5,d2
+
+    move.w  d0,d6              // Multiply into position
+    bra     nextMix
+mixLoop:
+    move.l  d2,a3
+    lsl.l   #5,d2
+    add.l   a3,d2
+nextMix:
+    dbra    d6, mixLoop
+    add.l   d2,(a1)+           // Add into row hash
 
 nextRow:
     dbra d1, rowLoop           // Are we on the last row?
 
-    movea.l scrnColHashPtr,a1  // Set pointer to column hashes
-    adda.w  d0, a1             // Offset to starting column
-    move.l  a2,(a1)+           // Write column sums
-    move.l  a3,(a1)+
-    move.l  a4,(a1)+
-    move.l  d6,(a1)+
-
     //_ShowCursor
 
-    movem.l (a7)+,d3-d7/a2-a5  // Restore registers
+    movem.l (a7)+,d3-d7/a2-a3  // Restore registers
     unlk    a6
     rts                        // Return
 }
\ No newline at end of file
@@ -22,7 +22,58 @@
 
 #define requestAlreadyScheduled -999
 
-typedef pascal void (*HashCallbackPtr)(int x, int y, int w, int h);
+#define MAX_DIRTY_RECTS 8
+#define MAX_COPY_RECTS  4
+
+/* The screen hashes multiply by 33 and add each long, so that the hash
+ * depends on the position of each long and does not repeat across a row
+ * or a band. Unlike a rotate and XOR, inverting a long changes the hash
+ * by an amount which depends on the long, so inverting an even number of
+ * longs does not cancel out. Since the hash is linear, the hashes of the
+ * parts of a row can be combined with a multiply and add.
+ */
+#define HASH_MIX(HASH,PIX) HASH = (HASH << 5) + HASH + (PIX);
+
+// Returns 33 to the power of n, which is what a hash is multiplied by
+// when n longs or words are mixed in after it
+
+inline unsigned long hashMixPower(unsigned int n) {
+    unsigned long result = 1, base = 33;
+    for (; n; n >>= 1) {
+        if (n & 1) result *= base;
+        base *= base;
+    }
+    return result;
+}
+
+/* Hashes a range of bytes in a row, in the same manner as the row hashes.
+ * The generic hashing code handles bytes past the last multiple of sixteen
+ * as words, so we must do the same. The hash of the range is multiplied by
+ * 33 once for each long or word to its right, so that the hashes of the
+ * ranges of a row can be added up to give the row hash.
+ */
+
+inline unsigned long hashRowBytes(const unsigned char *rowPtr, unsigned int stride, unsigned int b1, unsigned int b2) {
+    const unsigned int chunkEnd = stride & ~15;
+    const unsigned int longEnd = (b2 < chunkEnd) ? b2 : chunkEnd;
+    unsigned long hash = 0;
+    unsigned int b = b1;
+    for (const unsigned long *l = (const unsigned long*)(rowPtr + b); b < longEnd; b += 4) {
+        HASH_MIX(hash, *l++);
+    }
+    for (const unsigned short *w = (const unsigned short*)(rowPtr + b); b < b2; b += 2) {
+        HASH_MIX(hash, *w++);
+    }
+
+    // Multiply by the number of longs and words to the right of the range
+    const unsigned int unitsInRow = chunkEnd / 4 + (stride - chunkEnd) / 2;
+    const unsigned int unitsToEnd = (b2 <= chunkEnd) ? b2 / 4 : chunkEnd / 4 + (b2 - chunkEnd) / 2;
+    return hash * hashMixPower(unitsInRow - unitsToEnd);
+}
+
+struct TileHash;
+
+typedef pascal void (*HashCallbackPtr)(const VNCRect *rects, unsigned int nRects, const VNCFBUpdateCopyRect *copyRects, unsigned int nCopyRects);
 
 class VNCScreenHash {
     private:
@@ -35,14 +86,45 @@ class VNCScreenHash {
         static OSErr destroyVBLTask();
         static OSErr runVBLTask();
 
+        static void adaptRowsPerTick(unsigned int rowsHashed, unsigned long usec);
         static void beginCompute();
+        static void hashRows(unsigned int numRows);
+        static Boolean diffRows(unsigned int y, unsigned int numRows);
         static void computeHashes(unsigned int rows);
         static void computeHashesFast(unsigned int rows);
         static void computeHashesFastest(unsigned int rows);
-        static void computeDirty(int &x, int &y, int &w, int &h);
+        static void computeDirty(unsigned int firstBand, unsigned int lastBand);
+        static void mergeDirt(unsigned int band, unsigned int x1, unsigned int x2, unsigned int y1, unsigned int y2);
+        static Boolean scanHotBands();
+        static Boolean settleBands(unsigned int firstBand, unsigned int lastBand);
+        static Boolean bandAhead(unsigned int band);
+        static void seekRow(unsigned int y);
+        static Boolean reportDirt();
+        static void clearDirty();
+        static unsigned int getDirtyRects(VNCRect *rects);
+        static unsigned long rectBytes(const VNCRect &rect);
+        static Boolean spendAnalysis(unsigned long bytes);
+        static unsigned int findScrolls(VNCRect *rects, unsigned int &nRects, VNCFBUpdateCopyRect *copyRects);
+        static Boolean findScroll(const VNCRect &rect, unsigned int &runStart, unsigned int &runLength, int &dy);
+        static unsigned long hashRowRange(unsigned int y, unsigned int b1, unsigned int b2);
+        static unsigned int findMove(VNCRect *rects, unsigned int &nRects, VNCFBUpdateCopyRect *copyRects);
+        static Boolean searchTile(const VNCRect &area, const TileHash &target, unsigned int &px, unsigned int &py);
+        static Boolean tileMovedTo(unsigned int tx, unsigned int ty, int dx, int dy);
+        static void hashTile(const unsigned char *src, TileHash &hash);
+        static void dropTiles(const VNCRect &rect);
+        static void snapshotTiles(const VNCFBUpdateCopyRect *copyRects, unsigned int nCopyRects);
+        static Boolean tileChanged(unsigned int tx, unsigned int ty);
+        static void splitRect(const VNCRect &rect, Boolean byRows, VNCRect *out, unsigned int &nOut);
+        static void refineRects(VNCRect *rects, unsigned int &nRects);
+        static void excludeRect(VNCRect *rects, unsigned int &nRects, const VNCRect &hole);
         static void endCompute();
     public:
         static OSErr setup();
         static OSErr destroy();
-        static OSErr requestDirtyRect(HashCallbackPtr);
+        static OSErr requestDirtyRect(HashCallbackPtr, Boolean detectScrolls);
+        static void forgetSentHashes();
+        static void confirmSentRows(const VNCRect *rects, unsigned int nRects);
+        static void markDirty(const VNCRect &rect);
+        static void cancelDirtyRect();
+        static void inputReceived(unsigned int y);
 };
\ No newline at end of file
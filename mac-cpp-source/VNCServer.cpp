@@ -45,6 +45,8 @@
 #define kReadTimeout 10
 
 static asm void PreCompletion(TCPiopb *pb);
+static asm unsigned short vncMaskInterrupts();
+static asm void vncRestoreInterrupts(unsigned short sr);
 
 pascal void tcpStreamCreated(TCPiopb *pb);
 pascal void tcpStreamClosed(TCPiopb *pb);
@@ -75,13 +77,14 @@ void vncSendFBUpdate(Boolean incremental);
 void vncEnableContUpdates(const VNCEnableContUpdates &contUpdt);
 void vncClientFence(const VNCFenceMessage &fence);
 
-pascal void vncGotDirtyRect(int x, int y, int w, int h);
+pascal void vncGotDirtyRect(const VNCRect *rects, unsigned int nRects, const VNCFBUpdateCopyRect *copyRects, unsigned int nCopyRects);
 pascal void vncPrepareForFBUpdate();
 pascal void vncSendFBUpdateColorMap();
 pascal void vncSendFBUpdateHeader(TCPiopb *pb);
 pascal void vncFBUpdateEncodeCursor(TCPiopb *pb);
 pascal void vncStartFBUpdate(TCPiopb *pb);
 pascal void vncFBUpdateChunk(TCPiopb *pb);
+pascal void vncFBUpdateLastRect(TCPiopb *pb);
 pascal void vncFinishFBUpdate(TCPiopb *pb);
 pascal void vncStatusAvailable(TCPiopb *pb);
 pascal void vncDeferredDataReady();
@@ -127,8 +130,24 @@ wdsEntry           myWDS[3];
 rdsEntry           myRDS[kNumRDS + 1];
 
 VNCRect            fbUpdateRect;
+VNCRect            fbUpdateRects[MAX_DIRTY_RECTS];
+unsigned char      fbUpdateRectCount = 0;
+VNCFBUpdateCopyRect fbCopyRects[MAX_COPY_RECTS];
+unsigned char      fbCopyRectCount = 0;
 #if LOG_COMPRESSION_STATS
     unsigned long      fbUpdateStartTicks;
+    unsigned long      fbUpdateBytes;
+    unsigned long      fbStatsStartTicks;
+    unsigned long      fbStatsFrames;
+    unsigned long      fbStatsBytes;
+
+    // Tallies the bytes put on the wire for the current update
+
+    static void vncCountBytesSent(const wdsEntry *wds) {
+        for (; wds->length; wds++) {
+            fbUpdateBytes += wds->length;
+        }
+    }
 #endif
 
 VNCState vncState = VNC_STOPPED;
@@ -492,19 +511,7 @@ pascal void tcpSendServerInit(TCPiopb *pb) {
             vncServerMessage.init.format.blueShift = 0;
 
         #else
-            vncServerMessage.init.format.trueColor = 0;
-            vncServerMessage.init.format.bitsPerPixel = 8;
-            #ifdef VNC_FB_BITS_PER_PIX
-                vncServerMessage.init.format.depth = VNC_FB_BITS_PER_PIX;
-            #else
-                vncServerMessage.init.format.depth = fbDepth;
-            #endif
-            vncServerMessage.init.format.redMax = 3;    // 2 bits
-            vncServerMessage.init.format.greenMax = 7;  // 3 bits
-            vncServerMessage.init.format.blueMax = 3;   // 2 bits
-            vncServerMessage.init.format.redShift = 5;
-            vncServerMessage.init.format.greenShift = 2;
-            vncServerMessage.init.format.blueShift = 0;
+            VNCPalette::getNativeFormat(vncServerMessage.init.format);
         #endif
 
         VNCPalette::beginNewSession(vncServerMessage.init.format);
@@ -516,6 +523,8 @@ pascal void tcpSendServerInit(TCPiopb *pb) {
         fbUpdateRect.y = 0;
         fbUpdateRect.w = 0;
         fbUpdateRect.h = 0;
+        fbUpdateRectCount = 0;
+        fbCopyRectCount = 0;
 
         VNCEncoder::clear();
         VNCEncodeCursor::clear();
@@ -824,7 +833,7 @@ void vncSetPixelFormat(const VNCSetPixFormat &pixFormat) {
     );
     if (format.trueColor) {
         VNCPalette::setPixelFormat(format);
-    } else if (format.depth != fbDepth) {
+    } else if ((format.depth != fbDepth) || (fbDepth > 8)) {
         dprintf("Client requested an incompatible color depth of %d\n", format.depth);
         vncState = VNC_ERROR;
     }
@@ -833,6 +842,9 @@ void vncSetPixelFormat(const VNCSetPixFormat &pixFormat) {
 void vncKeyEvent(const VNCKeyEvent &keyEvent) {
     if (vncConfig.allowControl) {
         VNCKeyboard::PressKey(keyEvent.key, keyEvent.down);
+
+        // The screen is likely to change near the pointer, so look there first
+        VNCScreenHash::inputReceived(vncLastMousePosition.v);
     }
 }
 
@@ -858,6 +870,7 @@ void vncPointerEvent(const VNCPointerEvent &pointerEvent) {
         LMSetCursorNew(LMGetCrsrCouple());
 
         vncLastMousePosition = newMousePosition;
+        VNCScreenHash::inputReceived(newMousePosition.v);
 
         // On the Mac Plus, it is necessary to prevent the VBL task from
         // over-writing the button state by keeping MBTicks ahead of Ticks
@@ -971,19 +984,102 @@ void vncFBUpdateRequest(const VNCFBUpdateReq &fbUpdateReq) {
     }
 }
 
+void mergeRect(const VNCRect *a,VNCRect *rects,unsigned int &nRects);
+
+// Fixes up a dirty rect for the encoders
+
+static void vncAlignRect(VNCRect &rect) {
+    #ifdef VNC_FB_WIDTH
+        const unsigned int fbWidth = VNC_FB_WIDTH;
+    #endif
+    // Make sure x falls on a byte boundary
+    unsigned char dx = rect.x & 7;
+    rect.x -= dx;
+    rect.w += dx;
+
+    // Make sure width is a multiple of 16
+    //rect.w = (rect.w + 15) & ~15;
+
+    if((rect.x + rect.w) > fbWidth) {
+        rect.x = fbWidth - rect.w;
+    }
+}
+
+/* When the client takes LastRect, the number of rects is left open in the
+ * update header, so rects which the VBL task finds while the update is
+ * being encoded can be added to the end of it. CopyRects cannot be sent
+ * at this point, as the client's screen no longer matches what the VBL
+ * task expects, so their destinations are sent as ordinary rects.
+ *
+ * The rects already in the update may be in the middle of being encoded,
+ * so they are never grown; rects which do not fit are merged into the
+ * nearest of the new ones. The new rects may overlap rects already in the
+ * update, which is harmless, as the client draws them in order. They are
+ * published to the encoder with interrupts masked, so the completion
+ * routines see either all of them or none, and cannot close the update
+ * in between.
+ */
+
+static Boolean vncAppendDirtyRects(const VNCRect *rects, unsigned int nRects, const VNCFBUpdateCopyRect *copyRects, unsigned int nCopyRects) {
+    const unsigned int room = MAX_DIRTY_RECTS - fbUpdateRectCount;
+    if (room == 0) return false;
+
+    VNCRect added[MAX_DIRTY_RECTS];
+    unsigned int nAdded = 0;
+    for (unsigned int i = 0; i < nRects + nCopyRects; i++) {
+        VNCRect rect = (i < nRects) ? rects[i] : copyRects[i - nRects].rect;
+        vncAlignRect(rect);
+        dprintf("Adding dirty rect: %d,%d,%d,%d\n", rect.x, rect.y, rect.w, rect.h);
+        if (nAdded == room) {
+            // No room, so grow the nearest new one
+            mergeRect(&rect, added, nAdded);
+        } else {
+            added[nAdded++] = rect;
+        }
+    }
+
+    const unsigned short sr = vncMaskInterrupts();
+    const Boolean accepted = vncFlags.fbUpdateInProgress && vncFlags.fbUpdateAcceptsRects;
+    if (accepted) {
+        for (unsigned int j = 0; j < nAdded; j++) {
+            fbUpdateRects[fbUpdateRectCount + j] = added[j];
+        }
+        fbUpdateRectCount += nAdded;
+        VNCEncoder::setRects(fbUpdateRects, fbUpdateRectCount);
+    }
+    vncRestoreInterrupts(sr);
+    return accepted;
+}
+
 // Callback for the VBL task
-pascal void vncGotDirtyRect(int x, int y, int w, int h) {
+pascal void vncGotDirtyRect(const VNCRect *rects, unsigned int nRects, const VNCFBUpdateCopyRect *copyRects, unsigned int nCopyRects) {
     if (vncFlags.fbUpdateInProgress) {
+        if (vncFlags.fbUpdateAcceptsRects && vncAppendDirtyRects(rects, nRects, copyRects, nCopyRects)) {
+            return;
+        }
+        // The VBL task has already forgotten this dirt, so hand it back
+        // to be reported again once the update is done
         dprintf("Got dirty rect while busy\n");
+        VNCScreenHash::forgetSentHashes();
+        for (unsigned int i = 0; i < nRects + nCopyRects; i++) {
+            VNCScreenHash::markDirty((i < nRects) ? rects[i] : copyRects[i - nRects].rect);
+        }
         return;
     }
     if (vncState == VNC_RUNNING) {
-        dprintf("Got dirty rect: %d,%d,%d,%d\n",x,y,w,h);
-        fbUpdateRect.x = x;
-        fbUpdateRect.y = y;
-        fbUpdateRect.w = w;
-        fbUpdateRect.h = h;
+        for (unsigned int i = 0; i < nRects; i++) {
+            dprintf("Got dirty rect: %d,%d,%d,%d\n", rects[i].x, rects[i].y, rects[i].w, rects[i].h);
+            fbUpdateRects[i] = rects[i];
+        }
+        fbUpdateRectCount = nRects;
+        for (unsigned int j = 0; j < nCopyRects; j++) {
+            dprintf("Got copy rect: %d,%d,%d,%d from %d,%d\n", copyRects[j].rect.x, copyRects[j].rect.y, copyRects[j].rect.w, copyRects[j].rect.h, copyRects[j].srcX, copyRects[j].srcY);
+            fbCopyRects[j] = copyRects[j];
+        }
+        fbCopyRectCount = nCopyRects;
         vncPrepareForFBUpdate();
+    } else {
+        VNCScreenHash::forgetSentHashes();
     }
 }
 
@@ -991,12 +1087,17 @@ void vncSendFBUpdate(Boolean incremental) {
     if (incremental && !VNCPalette::hasChangesPending()) {
         // Ask the VBL task to determine what needs to be updated
         dprintf("Requesting dirty rect\n");
-        OSErr err = VNCScreenHash::requestDirtyRect(vncGotDirtyRect);
+        OSErr err = VNCScreenHash::requestDirtyRect(vncGotDirtyRect, vncFlags.clientTakesCopyRect);
         if((err != noErr) && (err != requestAlreadyScheduled)) {
             dprintf("Failed to request update (OSErr:%d)\n", err);
             vncError = err;
         }
     } else {
+        // The client's screen will no longer match what the VBL task last saw
+        VNCScreenHash::forgetSentHashes();
+        fbUpdateRects[0] = fbUpdateRect;
+        fbUpdateRectCount = 1;
+        fbCopyRectCount = 0;
         vncPrepareForFBUpdate();
     }
 }
@@ -1004,25 +1105,22 @@ void vncSendFBUpdate(Boolean incremental) {
 pascal void vncPrepareForFBUpdate() {
     #if LOG_COMPRESSION_STATS
         fbUpdateStartTicks = TickCount();
+        fbUpdateBytes = 0;
+        if (fbStatsFrames == 0) {
+            fbStatsStartTicks = fbUpdateStartTicks;
+        }
     #endif
     vncFlags.fbUpdateInProgress = true;
     vncFlags.fbUpdatePending = false;
 
-    // Make sure x falls on a byte boundary
-    unsigned char dx = fbUpdateRect.x & 7;
-    fbUpdateRect.x -= dx;
-    fbUpdateRect.w += dx;
-
-    // Make sure width is a multiple of 16
-    //fbUpdateRect.w = (fbUpdateRect.w + 15) & ~15;
-
-    #ifdef VNC_FB_WIDTH
-        const unsigned int fbWidth = VNC_FB_WIDTH;
-    #endif
-    if((fbUpdateRect.x + fbUpdateRect.w) > fbWidth) {
-        fbUpdateRect.x = fbWidth - fbUpdateRect.w;
+    for (unsigned char i = 0; i < fbUpdateRectCount; i++) {
+        vncAlignRect(fbUpdateRects[i]);
     }
 
+    // The encoder streams through the rectangles one after the other. There
+    // may be none, if everything that changed can be sent as CopyRects
+    VNCEncoder::setRects(fbUpdateRects, fbUpdateRectCount);
+
     // If a new color palette is available, let the main
     // thread handle it before continuing with the update.
     const Boolean needDefer = VNCPalette::hasChangesPending();
@@ -1077,6 +1175,9 @@ pascal void vncSendFBUpdateColorMap() {
         myWDS[1].length = nColors * sizeof(VNCColor);
         myWDS[2].ptr = 0;
         myWDS[2].length = 0;
+        #if LOG_COMPRESSION_STATS
+            vncCountBytesSent(myWDS);
+        #endif
         tcp.then(pb, vncSendFBUpdateHeader);
         tcp.send(pb, stream, myWDS, kTimeOut,true);
     } else {
@@ -1095,15 +1196,31 @@ pascal void vncSendFBUpdateHeader(TCPiopb *pb) {
 
         vncServerMessage.fbUpdate.message = mFBUpdate;
         vncServerMessage.fbUpdate.padding = 0;
+        unsigned int numRects = VNCEncoder::numOfRects() + fbCopyRectCount;
+        if (vncFlags.clientTakesLastRect) {
+            // Leave the count open and start looking for more dirt right
+            // away, so it can be sent as part of this update. The scan may
+            // outlast the update, so it looks for scrolls and moves as the
+            // request from the client would; any found in the meantime are
+            // sent as ordinary rects by vncAppendDirtyRects()
+            numRects = 0xFFFF;
+            vncFlags.fbUpdateAcceptsRects = true;
+            if (vncConfig.allowIncremental) {
+                VNCScreenHash::requestDirtyRect(vncGotDirtyRect, vncFlags.clientTakesCopyRect);
+            }
+        }
         if(vncFlags.clientTakesCursor && VNCEncodeCursor::needsUpdate()) {
-            // If we have a cursor update pending, we send two rects, a
+            // If we have a cursor update pending, we send an extra rect, a
             // pseudo-encoding for the cursor, followed by the screen update
-            vncServerMessage.fbUpdate.numRects = VNCEncoder::numOfSubrects() + 1;
+            vncServerMessage.fbUpdate.numRects = vncFlags.clientTakesLastRect ? numRects : numRects + 1;
             tcp.then(pb, vncFBUpdateEncodeCursor);
         } else {
-            vncServerMessage.fbUpdate.numRects = VNCEncoder::numOfSubrects();
+            vncServerMessage.fbUpdate.numRects = numRects;
             tcp.then(pb, vncStartFBUpdate);
         }
+        #if LOG_COMPRESSION_STATS
+            vncCountBytesSent(myWDS);
+        #endif
         tcp.send(pb, stream, myWDS, kTimeOut, false);
     }
 }
@@ -1117,13 +1234,37 @@ pascal void vncFBUpdateEncodeCursor(TCPiopb *pb) {
 
         // Get cursor data from the encoder
         VNCEncodeCursor::getChunk(myWDS);
+        #if LOG_COMPRESSION_STATS
+            vncCountBytesSent(myWDS);
+        #endif
         tcp.then(pb, vncStartFBUpdate);
         tcp.send(pb, stream, myWDS, kTimeOut, false);
     }
 }
 
 pascal void vncStartFBUpdate(TCPiopb *pb) {
-    vncFBUpdateChunk(pb);
+    if (fbCopyRectCount) {
+        if (tcpSuccess(pb)) {
+            // The CopyRects go ahead of any rects which may overwrite their source
+            myWDS[0].ptr = (Ptr) fbCopyRects;
+            myWDS[0].length = fbCopyRectCount * sizeof(VNCFBUpdateCopyRect);
+            myWDS[1].ptr = 0;
+            myWDS[1].length = 0;
+            fbCopyRectCount = 0;
+
+            #if LOG_COMPRESSION_STATS
+                vncCountBytesSent(myWDS);
+            #endif
+            tcp.then(pb, vncStartFBUpdate);
+            tcp.send(pb, stream, myWDS, kTimeOut, false);
+        }
+    } else if (fbUpdateRectCount) {
+        vncFBUpdateChunk(pb);
+    } else if (vncFlags.clientTakesLastRect) {
+        vncFBUpdateLastRect(pb);
+    } else {
+        vncFinishFBUpdate(pb);
+    }
 }
 
 pascal void vncFBUpdateChunk(TCPiopb *pb) {
@@ -1148,20 +1289,76 @@ pascal void vncFBUpdateChunk(TCPiopb *pb) {
         const Boolean gotMore = VNCEncoder::getChunk(chunkWDS);
         if(gotMore) {
             tcp.then(pb, vncFBUpdateChunk);
+        } else if (vncFlags.clientTakesLastRect) {
+            tcp.then(pb, vncFBUpdateLastRect);
         } else {
-            fbUpdateRect.w = fbUpdateRect.h = 0;
             tcp.then(pb, vncFinishFBUpdate);
         }
+        #if LOG_COMPRESSION_STATS
+            vncCountBytesSent(myWDS);
+        #endif
+        tcp.send(pb, stream, myWDS, kTimeOut, true);
+    }
+}
+
+pascal void vncFBUpdateLastRect(TCPiopb *pb) {
+    if (tcpSuccess(pb)) {
+        // Rects found after this point must wait for the next update,
+        // and once this is clear, any rects added beforehand are in place
+        const unsigned short sr = vncMaskInterrupts();
+        vncFlags.fbUpdateAcceptsRects = false;
+        vncRestoreInterrupts(sr);
+        if (VNCEncoder::nextRect()) {
+            // Rects were added while the last chunk was being sent
+            dprintf("Continuing update with added rects\n");
+            vncFlags.fbUpdateAcceptsRects = true;
+            vncFBUpdateChunk(pb);
+            return;
+        }
+
+        // Close the update with a LastRect pseudo-rectangle
+        vncServerMessage.fbUpdateRect.rect.x = 0;
+        vncServerMessage.fbUpdateRect.rect.y = 0;
+        vncServerMessage.fbUpdateRect.rect.w = 0;
+        vncServerMessage.fbUpdateRect.rect.h = 0;
+        vncServerMessage.fbUpdateRect.encodingType = mLastRectEncoding;
+
+        myWDS[0].ptr = (Ptr) &vncServerMessage;
+        myWDS[0].length = sizeof(VNCFBUpdateRect);
+        myWDS[1].ptr = 0;
+        myWDS[1].length = 0;
+        #if LOG_COMPRESSION_STATS
+            vncCountBytesSent(myWDS);
+        #endif
+        tcp.then(pb, vncFinishFBUpdate);
         tcp.send(pb, stream, myWDS, kTimeOut, true);
     }
 }
 
 pascal void vncFinishFBUpdate(TCPiopb *pb) {
     #if LOG_COMPRESSION_STATS
-        const float elapsedTime = TickCount() - fbUpdateStartTicks;
-        dprintf("Update done in %.1f s\n", elapsedTime / 60);
+        const unsigned long now = TickCount();
+        const float elapsedTime = now - fbUpdateStartTicks;
+        dprintf("Update done in %.1f s (%ld bytes)\n", elapsedTime / 60, fbUpdateBytes);
+
+        // Report the throughput every ten seconds
+        fbStatsFrames++;
+        fbStatsBytes += fbUpdateBytes;
+        if ((now - fbStatsStartTicks) >= 600) {
+            const float seconds = (now - fbStatsStartTicks) / 60.0;
+            dprintf("Throughput: %.2f frames/s, %.0f bytes/s\n", fbStatsFrames / seconds, fbStatsBytes / seconds);
+            fbStatsFrames = 0;
+            fbStatsBytes = 0;
+        }
     #endif
+    VNCScreenHash::confirmSentRows(fbUpdateRects, fbUpdateRectCount);
+    VNCEncoder::endUpdate();
     vncFlags.fbUpdateInProgress = false;
+    vncFlags.fbUpdateAcceptsRects = false;
+    if (vncFlags.clientTakesLastRect && !vncFlags.fbUpdatePending && !vncFlags.fbUpdateContinuous) {
+        // The client has not asked for another update yet
+        VNCScreenHash::cancelDirtyRect();
+    }
     if(vncFlags.fbUpdatePending) {
         vncSendFBUpdate(true);
     }
@@ -1204,4 +1401,20 @@ static asm void PreCompletion(TCPiopb *pb) {
     rts                          // Return
     dc.b    0x8D,"PreCompletion"
     dc.w    0x0000
+}
+
+/* Masks interrupts while the VBL task and the completion routines share
+ * the list of rects in an update, as either may interrupt the other.
+ * Returns the previous status register for vncRestoreInterrupts().
+ */
+
+static asm unsigned short vncMaskInterrupts() {
+    move.w  sr,d0                // Return the previous status register
+    ori.w   #0x0700,sr           // Mask all interrupts
+    rts                          // Return
+}
+
+static asm void vncRestoreInterrupts(unsigned short sr) {
+    move.w  4(sp),sr             // Restore the status register
+    rts                          // Return
 }
\ No newline at end of file
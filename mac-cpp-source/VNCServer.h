@@ -48,6 +48,11 @@ struct VNCFlags {
     unsigned short clientTakesTightAuth : 1;
     unsigned short forceVNCAuth : 1;
     unsigned short zLibLoaded : 1;
+    unsigned short clientTakesCopyRect : 1;
+    unsigned short clientTakesLastRect : 1;
+    unsigned short fbUpdateAcceptsRects : 1;
+    unsigned short clientTakesTightPNG : 1;
+    unsigned short clientTakesZHextile : 1;
 };
 
 #define VNC_FLAGS_DEFAULTS { \
@@ -62,9 +67,15 @@ struct VNCFlags {
     false, /* clientTakesCursor */ \
     false, /* clientTakesContUpdt */ \
     false, /* clientTakesFence */ \
+    false, /* clientTakesTightEnc */ \
     false, /* clientTakesTightAuth */ \
     false, /* forceVNCAuth */ \
-    false  /* zLibLoaded */ \
+    false, /* zLibLoaded */ \
+    false, /* clientTakesCopyRect */ \
+    false, /* clientTakesLastRect */ \
+    false, /* fbUpdateAcceptsRects */ \
+    false, /* clientTakesTightPNG */ \
+    false  /* clientTakesZHextile */ \
 }
 
 Boolean _tcpSuccess(TCPiopb *pb, unsigned int line);
@@ -201,6 +201,13 @@ struct VNCFBUpdateRect {
     long encodingType;
 };
 
+struct VNCFBUpdateCopyRect {
+    VNCRect rect;
+    long encodingType;
+    unsigned short srcX;
+    unsigned short srcY;
+};
+
 struct VNCKeyEvent {
     unsigned char  message;
     unsigned char down;
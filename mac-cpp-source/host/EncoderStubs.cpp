@@ -0,0 +1,49 @@
+/****************************************************************************
+ *   MiniVNC (c) 2022-2024 Marcio Teixeira                                  *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+#include "VNCServer.h"
+#include "VNCFrameBuffer.h"
+#include "VNCEncoder.h"
+
+/**
+ * Stands in for the server and the encoder framework, which the host
+ * build leaves out, so that the tile encoders and the palette can be
+ * linked into TileBench. Nothing is compressed, so ZlibHex tiles are
+ * sent as plain Hextile.
+ */
+
+short             hasColorQD = 2;
+VNCState          vncState = VNC_RUNNING;
+VNCFlags          vncFlags = VNC_FLAGS_DEFAULTS;
+long              selectedEncoder = -1;
+BitMap            vncBits;
+
+// The palette writes the colors for an indexed client here
+static VNCColor   hostColors[256];
+unsigned char    *fbUpdateBuffer = (unsigned char*) hostColors;
+
+unsigned char VNCEncoder::getStream(unsigned char preferred) {
+    return 0xFF;
+}
+
+unsigned long VNCEncoder::compressBound(unsigned long len) {
+    return len + len / 1000 + 12;
+}
+
+unsigned long VNCEncoder::compressStream(unsigned char stream, const unsigned char *src, unsigned long srcLen, unsigned char *dst, unsigned long dstLen) {
+    return 0;
+}
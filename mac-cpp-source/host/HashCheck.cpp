@@ -0,0 +1,245 @@
+/****************************************************************************
+ *   MiniVNC (c) 2022-2024 Marcio Teixeira                                  *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+#include "VNCScreenHash.h"
+
+#include "HostSupport.h"
+
+/**
+ * Checks the properties of the screen hashes which VNCScreenHash relies
+ * on: the hash of a row is the same whether it is computed all at once,
+ * as computeHashes() does, or as the sum of the hashes of the parts of
+ * the row, as findScroll() does; and changes which a plain sum would miss,
+ * such as swapped or inverted longs, change the hash. The row widths are
+ * those of the fixed builds, some of which end in words rather than in a
+ * multiple of sixteen bytes.
+ *
+ * The cost of hashing each row is also timed at the screen sizes and
+ * depths which TileBench uses, hashing a band at a time as hashRows()
+ * does. Passing "-q" leaves out the timings.
+ */
+
+#define MAX_STRIDE     1024
+#define HASH_BAND_ROWS 32    // As in "VNCScreenHash.cpp"
+#define TIMED_PASSES   20
+
+static Boolean quiet;
+
+static void randomRow(unsigned char *row, unsigned int stride) {
+    for (unsigned int i = 0; i < stride; i++) {
+        row[i] = hostRandom();
+    }
+}
+
+// Hashes a row one long at a time, as computeHashes() does
+
+static unsigned long hashLongs(const unsigned char *row, unsigned int stride) {
+    unsigned long hash = 0;
+    for (unsigned int b = 0; b < stride; b += 4) {
+        unsigned long pix;
+        memcpy(&pix, row + b, sizeof(pix));
+        HASH_MIX(hash, pix);
+    }
+    return hash;
+}
+
+/* A C version of the generic path of computeHashesFast(), which hashes
+ * each row of a band sixteen bytes at a time and the bytes left over as
+ * words. The column hashes of the words are kept as words, as the asm
+ * version does.
+ */
+
+static void hashBand(const unsigned char *src, unsigned int stride, unsigned int rows, unsigned long *rowHash, unsigned long *colHash) {
+    const unsigned int chunks = stride / 16;
+    const unsigned int words  = (stride & 15) / 2;
+
+    for (; rows--; src += stride) {
+        const unsigned long *l = (const unsigned long*) src;
+        unsigned long *col = colHash;
+        unsigned long hash = 0;
+        for (unsigned int i = chunks * 4; i--; l++, col++) {
+            HASH_MIX(hash, *l);
+            HASH_MIX(*col, *l);
+        }
+        const unsigned short *w = (const unsigned short*) l;
+        unsigned short *colWord = (unsigned short*) col;
+        for (unsigned int i = words; i--; w++, colWord++) {
+            HASH_MIX(hash, *w);
+            HASH_MIX(*colWord, *w);
+        }
+        *rowHash++ = hash;
+    }
+}
+
+// Returns a random multiple of four from lo to hi, or hi if it is the end of the row
+
+static unsigned int randomBoundary(unsigned int lo, unsigned int hi, unsigned int stride) {
+    if (hi == stride) hi = (stride + 3) & ~3;
+    const unsigned int b = lo + (hostRandom() % ((hi - lo) / 4 + 1)) * 4;
+    return min(b, stride);
+}
+
+static void checkStride(unsigned int stride) {
+    unsigned char row[MAX_STRIDE], copy[MAX_STRIDE];
+    char what[200];
+
+    for (unsigned int trial = 0; trial < 200; trial++) {
+        randomRow(row, stride);
+        const unsigned long full = hashRowBytes(row, stride, 0, stride);
+
+        // The fixed builds which are a multiple of sixteen bytes wide hash only longs
+
+        if ((stride % 16) == 0) {
+            sprintf(what, "row hash at stride %u", stride);
+            hostCheck(full == hashLongs(row, stride), what);
+        }
+
+        // The hashes of three parts of the row add up to the row hash
+
+        const unsigned int a = randomBoundary(0, stride, stride);
+        const unsigned int b = randomBoundary(a, stride, stride);
+        const unsigned long sum = hashRowBytes(row, stride, 0, a) + hashRowBytes(row, stride, a, b) + hashRowBytes(row, stride, b, stride);
+        sprintf(what, "sum of ranges at stride %u (%u, %u)", stride, a, b);
+        hostCheck(sum == full, what);
+
+        // Changing the bytes of a range changes the row hash by the change
+        // in the hash of the range, which findScroll() uses to recover the
+        // hashes of rows before a change
+
+        if (a < b) {
+            memcpy(copy, row, stride);
+            for (unsigned int i = a; i < b; i++) copy[i] = hostRandom();
+            const unsigned long derived = full - hashRowBytes(row, stride, a, b) + hashRowBytes(copy, stride, a, b);
+            sprintf(what, "changed range at stride %u (%u, %u)", stride, a, b);
+            hostCheck(derived == hashRowBytes(copy, stride, 0, stride), what);
+        }
+
+        // Swapping two longs which differ, or inverting two longs which are
+        // equal, changes the hash. The longs are made to differ by an odd
+        // amount, as a difference by a high power of two can cancel out.
+
+        const unsigned int longs = (stride & ~15) / 4;
+        if (longs >= 2) {
+            const unsigned int i = hostRandom() % longs;
+            const unsigned int j = (i + 1 + hostRandom() % (longs - 1)) % longs;
+            unsigned long li, lj;
+
+            memcpy(copy, row, stride);
+            memcpy(&li, copy + i * 4, 4);
+            lj = li ^ 1;
+            memcpy(copy + j * 4, &lj, 4);
+            const unsigned long before = hashRowBytes(copy, stride, 0, stride);
+            memcpy(copy + i * 4, &lj, 4);
+            memcpy(copy + j * 4, &li, 4);
+            sprintf(what, "swapped longs at stride %u (%u, %u)", stride, i, j);
+            hostCheck(hashRowBytes(copy, stride, 0, stride) != before, what);
+
+            memcpy(copy + j * 4, &li, 4);
+            memcpy(copy + i * 4, &li, 4);
+            const unsigned long equal = hashRowBytes(copy, stride, 0, stride);
+            li = ~li;
+            memcpy(copy + i * 4, &li, 4);
+            memcpy(copy + j * 4, &li, 4);
+            sprintf(what, "inverted longs at stride %u (%u, %u)", stride, i, j);
+            hostCheck(hashRowBytes(copy, stride, 0, stride) != equal, what);
+        }
+    }
+}
+
+/* Hashes a screen of random bytes a band at a time, checks the row hashes
+ * against hashRowBytes() and reports the time it took per row.
+ */
+
+static void timeScreen(unsigned int width, unsigned int height, unsigned char depth) {
+    const unsigned int stride = width * depth / 8;
+    const unsigned int colHashSize = (stride + 3) / 4;
+    unsigned char *screen  = (unsigned char*) malloc((unsigned long)stride * height);
+    unsigned long *rowHash = (unsigned long*) malloc(height * sizeof(unsigned long));
+    unsigned long *colHash = (unsigned long*) malloc(colHashSize * sizeof(unsigned long));
+    char what[100];
+
+    for (unsigned long i = 0; i < (unsigned long)stride * height; i++) {
+        screen[i] = hostRandom();
+    }
+
+    const unsigned long start = hostMicroseconds();
+    for (unsigned int pass = 0; pass < TIMED_PASSES; pass++) {
+        for (unsigned int y = 0; y < height; y += HASH_BAND_ROWS) {
+            memset(colHash, 0, colHashSize * sizeof(unsigned long));
+            hashBand(screen + (unsigned long)stride * y, stride, min(HASH_BAND_ROWS, height - y), rowHash + y, colHash);
+        }
+    }
+    const unsigned long micros = hostMicroseconds() - start;
+
+    Boolean same = true;
+    for (unsigned int y = 0; y < height; y++) {
+        same = same && (rowHash[y] == hashRowBytes(screen + (unsigned long)stride * y, stride, 0, stride));
+    }
+    sprintf(what, "hashBand() at %u x %u, %u-bit", width, height, depth);
+    hostCheck(same, what);
+
+    if (!quiet) {
+        const unsigned long rows = (unsigned long)height * TIMED_PASSES;
+        printf("  %4u x %3u, %2u-bit: %6u ns/row (%u bytes/row)\n", width, height, depth, (micros * 1000) / rows, stride);
+    }
+
+    free(screen);
+    free(rowHash);
+    free(colHash);
+}
+
+int main(int argc, char *argv[]) {
+    char what[100];
+
+    quiet = (argc > 1) && (strcmp(argv[1], "-q") == 0);
+
+    // hashMixPower() against repeated multiplication
+
+    unsigned long power = 1;
+    for (unsigned int n = 0; n < 1000; n++) {
+        sprintf(what, "hashMixPower(%u)", n);
+        hostCheck(hashMixPower(n) == power, what);
+        power *= 33;
+    }
+
+    // A row of identical longs does not hash to the same value as a
+    // shorter or longer one, as it would with a rotate and XOR
+
+    unsigned char row[MAX_STRIDE];
+    memset(row, 0xFF, sizeof(row));
+    hostCheck(hashRowBytes(row, 64, 0, 64) != hashRowBytes(row, 128, 0, 128), "row of ones");
+
+    // The bytes per row of the fixed builds, and of some generic ones
+
+    const unsigned int strides[] = {64, 76, 90, 128, 160, 240, 320, 640, 1024};
+    hostSeedRandom(1);
+    for (unsigned int s = 0; s < sizeof(strides) / sizeof(strides[0]); s++) {
+        checkStride(strides[s]);
+    }
+
+    // The screen sizes and depths which TileBench uses
+
+    const unsigned int sizes[][2] = {{512, 342}, {512, 384}, {640, 480}, {832, 624}, {1024, 768}, {608, 431}};
+    const unsigned char depths[] = {1, 2, 4, 8, 16, 32};
+    if (!quiet) printf("Row hashing:\n");
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (unsigned int d = 0; d < sizeof(depths); d++) {
+            timeScreen(sizes[s][0], sizes[s][1], depths[d]);
+        }
+    }
+    return hostFinish("HashCheck");
+}
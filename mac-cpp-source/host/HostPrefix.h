@@ -0,0 +1,149 @@
+/****************************************************************************
+ *   MiniVNC (c) 2022-2024 Marcio Teixeira                                  *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+/**
+ * This header is included ahead of every file in the host build, in place
+ * of the Mac headers which CodeWarrior includes through its prefix file.
+ * It declares just enough of the Toolbox for the tile routines, the tile
+ * encoders, the palette and the screen hash to compile, and makes the host
+ * look like the 68000 to them: a long is 32 bits, and longs are read and
+ * written with the most significant byte first.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef unsigned char   Boolean;
+typedef short           OSErr;
+typedef char           *Ptr;
+typedef Ptr            *Handle;
+typedef unsigned char   Str255[256];
+
+struct Rect {
+    short top, left, bottom, right;
+};
+
+struct Point {
+    short v, h;
+};
+
+struct BitMap {
+    Ptr   baseAddr;
+    short rowBytes;
+    Rect  bounds;
+};
+
+enum {
+    noErr = 0
+};
+
+#define pascal
+#define asm
+
+inline uint32_t hostGetLong(const void *ptr) {
+    const unsigned char *p = (const unsigned char*) ptr;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+inline void hostPutLong(void *ptr, uint32_t val) {
+    unsigned char *p = (unsigned char*) ptr;
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+#define GET_LONG(PTR)     hostGetLong(PTR)
+#define PUT_LONG(PTR,VAL) hostPutLong(PTR,VAL)
+
+// Must come last, as the system headers need the real long and size_t.
+// As in the Mac headers, size_t is an unsigned long, which VNCTypes.h
+// declares again.
+
+#define long int
+#define size_t mac_size_t
+
+typedef unsigned long size_t;
+typedef long          Size;
+
+inline void BlockMove(const void *srcPtr, void *destPtr, Size byteCount) {
+    memmove(destPtr, srcPtr, byteCount);
+}
+
+typedef unsigned long OSType;
+
+Ptr   NewPtr(Size byteCount);
+void  DisposePtr(Ptr p);
+OSErr MemError();
+
+/**
+ * Enough of Color QuickDraw for the palette to read the colors of the
+ * main screen, which the host gives a gray ramp at the current depth
+ */
+
+struct RGBColor {
+    unsigned short red, green, blue;
+};
+
+struct ColorSpec {
+    short    value;
+    RGBColor rgb;
+};
+
+struct ColorTable {
+    long      ctSeed;
+    short     ctFlags;
+    short     ctSize;
+    ColorSpec ctTable[256];
+};
+
+typedef ColorTable  *CTabPtr;
+typedef CTabPtr     *CTabHandle;
+
+struct PixMap {
+    CTabHandle pmTable;
+};
+
+typedef PixMap      *PixMapPtr;
+typedef PixMapPtr   *PixMapHandle;
+
+struct GDevice {
+    PixMapHandle gdPMap;
+};
+
+typedef GDevice     *GDPtr;
+typedef GDPtr       *GDHandle;
+
+struct GrafPort;
+typedef GrafPort    *GrafPtr;
+
+struct CGrafPort {
+    long fgColor;
+    long bkColor;
+};
+
+GDHandle GetMainDevice();
+void     GetPort(GrafPtr *port);
+void     SetPort(GrafPtr port);
+void     OpenCPort(CGrafPort *port);
+void     CloseCPort(CGrafPort *port);
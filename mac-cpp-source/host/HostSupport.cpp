@@ -0,0 +1,141 @@
+/****************************************************************************
+ *   MiniVNC (c) 2022-2024 Marcio Teixeira                                  *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+#include "VNCConfig.h"
+#include "VNCFrameBuffer.h"
+#include "DebugLog.h"
+
+#include "HostSupport.h"
+
+/**
+ * The host build is a generic build, so the geometry of the framebuffer
+ * is held in variables which each test sets as it goes.
+ */
+
+unsigned int  fbStride;
+unsigned int  fbWidth;
+unsigned int  fbHeight;
+unsigned long fbDepth;
+
+VNCConfig vncConfig;
+
+void _dprintf(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+void _do_deferred_output() {
+}
+
+static unsigned long hostSeed;
+
+void hostSeedRandom(unsigned long seed) {
+    hostSeed = seed;
+}
+
+unsigned short hostRandom() {
+    hostSeed = hostSeed * 1103515245 + 12345;
+    return hostSeed >> 16;
+}
+
+unsigned long hostMicroseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static unsigned int failures;
+
+void hostCheck(Boolean ok, const char *what) {
+    if (!ok) {
+        if (failures < 20) printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+int hostFinish(const char *name) {
+    if (failures) {
+        printf("%s: %u checks failed\n", name, failures);
+        return 1;
+    }
+    printf("%s: all checks passed\n", name);
+    return 0;
+}
+
+/**
+ * The Toolbox calls made by the palette. NewPtr() reports a failure
+ * through MemError(), as on the Mac.
+ */
+
+static OSErr hostMemErr;
+
+Ptr NewPtr(Size byteCount) {
+    Ptr p = (Ptr) calloc(1, byteCount);
+    hostMemErr = p ? noErr : -108; // memFullErr
+    return p;
+}
+
+void DisposePtr(Ptr p) {
+    free(p);
+}
+
+OSErr MemError() {
+    return hostMemErr;
+}
+
+static ColorTable  hostColorTable;
+static CTabPtr     hostColorTablePtr = &hostColorTable;
+static PixMap      hostPixMap = {&hostColorTablePtr};
+static PixMapPtr   hostPixMapPtr = &hostPixMap;
+static GDevice     hostDevice = {&hostPixMapPtr};
+static GDPtr       hostDevicePtr = &hostDevice;
+
+GDHandle GetMainDevice() {
+    // A gray ramp from white to black, as on a Mac with a grayscale
+    // monitor, with a new seed whenever the depth changes
+    const unsigned int nColors = (fbDepth <= 8) ? (1 << fbDepth) : 256;
+    if (hostColorTable.ctSize != (short)(nColors - 1)) {
+        hostColorTable.ctSeed++;
+        hostColorTable.ctSize = nColors - 1;
+        for (unsigned int i = 0; i < nColors; i++) {
+            const unsigned short level = 0xFFFF - i * 0xFFFF / (nColors - 1);
+            hostColorTable.ctTable[i].value = i;
+            hostColorTable.ctTable[i].rgb.red   = level;
+            hostColorTable.ctTable[i].rgb.green = level;
+            hostColorTable.ctTable[i].rgb.blue  = level;
+        }
+    }
+    return &hostDevicePtr;
+}
+
+void GetPort(GrafPtr *port) {
+    *port = 0;
+}
+
+void SetPort(GrafPtr port) {
+}
+
+void OpenCPort(CGrafPort *port) {
+    // Black on white, as the last and first entries of the color table
+    port->fgColor = hostColorTable.ctSize;
+    port->bkColor = 0;
+}
+
+void CloseCPort(CGrafPort *port) {
+}
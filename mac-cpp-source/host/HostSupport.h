@@ -0,0 +1,34 @@
+/****************************************************************************
+ *   MiniVNC (c) 2022-2024 Marcio Teixeira                                  *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+#pragma once
+
+// As in "VNCServer.h", which the host build leaves out
+
+#define min(A,B) ((A) < (B) ? (A) : (B))
+#define max(A,B) ((A) > (B) ? (A) : (B))
+
+/**
+ * Helpers shared by the host tests. Each check which fails is reported,
+ * and hostFinish() returns the exit status for ctest.
+ */
+
+void           hostSeedRandom(unsigned long seed);
+unsigned short hostRandom();
+unsigned long  hostMicroseconds();
+void           hostCheck(Boolean ok, const char *what);
+int            hostFinish(const char *name);
@@ -0,0 +1,746 @@
+/****************************************************************************
+ *   MiniVNC (c) 2022-2024 Marcio Teixeira                                  *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+#include "VNCConfig.h"
+#include "VNCFrameBuffer.h"
+#include "VNCPalette.h"
+#include "VNCEncoder.h"
+#include "VNCEncodeTiles.h"
+#include "VNCEncodeTRLE.h"
+#include "VNCEncodeHextile.h"
+
+#include "HostSupport.h"
+
+/**
+ * Times the C versions of the tile routines, and the TRLE and Hextile
+ * encoders built on them, on synthetic framebuffers at the common screen
+ * sizes and depths. For each, the time and output per tile is reported,
+ * and for the encoders, a histogram of the tile types, which is the first
+ * byte of each tile. The output of each routine is also checked against a
+ * simple model, which works one pixel at a time, and the output of the
+ * encoders is decoded and compared with the screen. The program fails if
+ * any of them differ. Passing "-q" leaves out the timings.
+ */
+
+#define TILE_SIZE        16
+#define ZRLE_TILE_SIZE   64
+#define NATIVE_SIZE     260  // Native bytes per 16x16 tile, plus padding
+#define OUT_SIZE       2048
+#define OUT_STOP       1536  // Leaves room for nativeToRle() to overshoot the stop
+#define ENCODED_SIZE   (ZRLE_TILE_SIZE * ZRLE_TILE_SIZE * 4 + 16)  // A raw 64x64 tile at 32 bits, plus slack
+#define SENTINEL       0xEE  // Fill for output bytes which are not written
+
+extern unsigned long *vncTrueColors;
+
+enum {
+    PatternSolid,
+    PatternDither,
+    PatternText,
+    PatternGradient,
+    PatternNoise,
+    NumPatterns
+};
+
+static const char *patternNames[NumPatterns] = {"solid", "dither", "text", "gradient", "noise"};
+
+struct Geometry {
+    unsigned int width, height, stride;
+    unsigned char depth;
+};
+
+struct Timing {
+    unsigned long micros;
+    unsigned long bytes;
+    unsigned int  tiles;
+};
+
+static Boolean quiet;
+
+/**
+ * The patterns approximate the kinds of content found on a Mac desktop.
+ * Noise is the worst case for every encoder, while solid fills are the
+ * best case.
+ */
+
+static unsigned long patternColor(unsigned char pattern, unsigned int x, unsigned int y, unsigned char depth) {
+    const unsigned long maxColor = (depth == 32) ? 0xFFFFFF : (depth == 16) ? 0x7FFF : (1 << depth) - 1;
+    switch (pattern) {
+        case PatternSolid:
+            return 0;
+        case PatternDither:
+            return ((x ^ y) & 1) ? maxColor : 0;
+        case PatternText: {
+            // Lines of 8x12 character cells, with every ninth line highlighted
+            const unsigned int cx = x / 8, cy = y / 12;
+            const unsigned int gx = x % 8, gy = y % 12;
+            const unsigned long paper = ((cy % 9) == 4) ? maxColor / 2 : 0;
+            if ((gx > 5) || (gy > 8) || ((cx % 11) == 10)) return paper;
+            unsigned long h = (cx * 2654435761UL) ^ (cy * 40503UL) ^ (gx * 97 + gy * 13);
+            h ^= h >> 13;
+            h *= 0x5BD1E995UL;
+            h ^= h >> 15;
+            return ((h & 3) == 0) ? maxColor : paper;
+        }
+        case PatternGradient:
+            return ((x + y) / 8) & maxColor;
+        default:
+            return ((unsigned long)hostRandom() << 16 | hostRandom()) & maxColor;
+    }
+}
+
+static void fillFramebuffer(unsigned char *fb, const Geometry &geo, unsigned char pattern) {
+    hostSeedRandom(1);
+    for (unsigned int y = 0; y < geo.height; y++) {
+        unsigned char *dst = fb + (unsigned long)geo.stride * y;
+        if (geo.depth == 16) {
+            for (unsigned int x = 0; x < geo.width; x++) {
+                // Set the unused top bit at random, as it should be ignored
+                ((unsigned short*)dst)[x] = patternColor(pattern, x, y, 16) | (hostRandom() & 0x8000);
+            }
+        } else if (geo.depth == 32) {
+            for (unsigned int x = 0; x < geo.width; x++) {
+                ((unsigned long*)dst)[x] = patternColor(pattern, x, y, 32) | ((unsigned long)hostRandom() << 24);
+            }
+        } else {
+            const unsigned char pixPerByte = 8 / geo.depth;
+            for (unsigned int x = 0; x < geo.width; x += pixPerByte) {
+                unsigned char packed = 0;
+                for (unsigned char i = 0; i < pixPerByte; i++) {
+                    packed = (packed << geo.depth) | patternColor(pattern, x + i, y, geo.depth);
+                }
+                *dst++ = packed;
+            }
+        }
+    }
+}
+
+// Returns pixel i of data packed at "depth" bits per pixel, leftmost first
+
+static unsigned char getPixel(const unsigned char *data, unsigned int i, unsigned char depth) {
+    const unsigned int bit = i * depth;
+    return (data[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1);
+}
+
+static void putPixel(unsigned char *data, unsigned int i, unsigned char depth, unsigned char color) {
+    const unsigned int bit = i * depth;
+    const unsigned char shift = 8 - depth - bit % 8;
+    data[bit / 8] = (data[bit / 8] & ~(((1 << depth) - 1) << shift)) | (color << shift);
+}
+
+static unsigned int numOfTiles(const Geometry &geo, unsigned int tileSize = TILE_SIZE) {
+    return ((geo.width + tileSize - 1) / tileSize) * ((geo.height + tileSize - 1) / tileSize);
+}
+
+static const unsigned char *getTile(const unsigned char *fb, const Geometry &geo, unsigned int i, short &rows, short &cols, unsigned int tileSize = TILE_SIZE) {
+    const unsigned int tilesPerRow = (geo.width + tileSize - 1) / tileSize;
+    const unsigned int x = (i % tilesPerRow) * tileSize;
+    const unsigned int y = (i / tilesPerRow) * tileSize;
+    cols = min(tileSize, geo.width  - x);
+    rows = min(tileSize, geo.height - y);
+    return fb + (unsigned long)geo.stride * y + x * geo.depth / 8;
+}
+
+static void printTiming(const char *name, const Timing &t) {
+    if (quiet) return;
+    if (t.tiles) {
+        const unsigned long nsPerTile = (t.micros * 1000) / t.tiles;
+        printf("  %-18s %8u ns/tile %6u bytes/tile (%u tiles)\n", name, nsPerTile, t.bytes / t.tiles, t.tiles);
+    } else {
+        printf("  %-18s      n/a\n", name);
+    }
+}
+
+static void printHistogram(const unsigned int *histogram) {
+    if (quiet) return;
+    printf("  %-18s", "  tile types");
+    for (unsigned int i = 0; i < 256; i++) {
+        if (histogram[i]) printf(" %u:%u", i, histogram[i]);
+    }
+    printf("\n");
+}
+
+/**
+ * The models of the routines. The palette of a tile lists its colors
+ * in ascending order, and the runs of a tile are found in the order of
+ * the pixels, across each row and then down.
+ */
+
+static unsigned int modelPalette(const unsigned char *native, unsigned int nPixels, unsigned char depth, unsigned char *pal, unsigned char *map) {
+    Boolean seen[256] = {false};
+    for (unsigned int i = 0; i < nPixels; i++) {
+        seen[getPixel(native, i, depth)] = true;
+    }
+    unsigned int nColors = 0;
+    for (unsigned int c = 0; c < 256; c++) {
+        if (seen[c]) {
+            if (nColors < 127) pal[nColors] = c;
+            map[c] = nColors & 0x7F;
+            nColors++;
+        }
+    }
+    return nColors;
+}
+
+static unsigned int modelRle(const unsigned char *native, unsigned int nPixels, unsigned char depth, const ColorInfo &info, unsigned char *dst, unsigned int &runsOfOne) {
+    const Boolean mapColors = info.nColors < (1u << depth);
+    unsigned char *start = dst;
+    runsOfOne = 0;
+    for (unsigned int i = 0; i < nPixels;) {
+        const unsigned char color = getPixel(native, i, depth);
+        unsigned int len = 1;
+        while ((i + len < nPixels) && (getPixel(native, i + len, depth) == color)) len++;
+        i += len;
+
+        const unsigned char mapped = mapColors ? info.colorMap[color] : color;
+        if (info.packRuns && (len == 1)) {
+            *dst++ = mapped;
+            runsOfOne++;
+            continue;
+        }
+        *dst = (info.packRuns ? 0x80 : 0) | mapped;
+        dst += info.colorSize;
+        for (len--; len >= 255; len -= 255) *dst++ = 255;
+        *dst++ = len;
+    }
+    return dst - start;
+}
+
+static unsigned int modelPacked(const unsigned char *native, unsigned int nPixels, unsigned char inDepth, unsigned char outDepth, const ColorInfo &info, unsigned char *dst) {
+    const unsigned int len = (nPixels * outDepth + 7) / 8;
+    memset(dst, 0, len);
+    for (unsigned int i = 0; i < nPixels; i++) {
+        putPixel(dst, i, outDepth, info.colorMap[getPixel(native, i, inDepth)]);
+    }
+    return len;
+}
+
+static unsigned char packedDepth(unsigned int nColors) {
+    return (nColors <= 2) ? 1 : (nColors <= 4) ? 2 : 4;
+}
+
+/**
+ * Checks the output of each routine for one tile, including the
+ * variants that the timing loop does not use
+ */
+
+static void checkTile(const unsigned char *src, short rows, short cols, const Geometry &geo, const char *where) {
+    unsigned char native[NATIVE_SIZE], model[NATIVE_SIZE];
+    unsigned char out[OUT_SIZE], expected[OUT_SIZE];
+    char what[200];
+
+    const unsigned int nativeLen = rows * cols * geo.depth / 8;
+    const unsigned int nPixels = rows * cols;
+    for (short y = 0; y < rows; y++) {
+        memcpy(model + y * cols * geo.depth / 8, src + (unsigned long)geo.stride * y, cols * geo.depth / 8);
+    }
+
+    // screenToNative(), without and then with the tally of colors
+
+    ColorInfo info, modelInfo;
+    memset(&modelInfo, 0, sizeof(modelInfo));
+    memset(native, SENTINEL, sizeof(native));
+    unsigned int len = screenToNative(src, native, rows, cols, 0);
+    sprintf(what, "screenToNative %s", where);
+    hostCheck((len == nativeLen) && (memcmp(native, model, nativeLen) == 0), what);
+
+    const unsigned int nColors = modelPalette(model, nPixels, geo.depth, modelInfo.colorPal, modelInfo.colorMap);
+    memset(native, SENTINEL, sizeof(native));
+    screenToNative(src, native, rows, cols, &info);
+    if (nColors < 128) {
+        sprintf(what, "screenToNative colors %s", where);
+        hostCheck((info.nColors == nColors) && (memcmp(info.colorPal, modelInfo.colorPal, nColors) == 0), what);
+    }
+
+    // nativeToColors(), after padding the tile as VNCEncodeTRLE does
+
+    memset(&info, 0, sizeof(info));
+    unsigned char *adjustedEnd = native + nativeLen;
+    if ((nativeLen % 4) == 2) {
+        adjustedEnd[0] = adjustedEnd[-1];
+        adjustedEnd[1] = adjustedEnd[-1];
+        adjustedEnd += 2;
+    }
+    nativeToColors(native, adjustedEnd, &info);
+    // Past 127 colors, the palette is not used and only the count matters
+
+    Boolean palOk = true;
+    for (unsigned int c = 0; (c < nColors) && (nColors <= 127); c++) {
+        if ((info.colorPal[c] != modelInfo.colorPal[c]) || (info.colorMap[modelInfo.colorPal[c]] != c)) palOk = false;
+    }
+    sprintf(what, "nativeToColors %s (%u colors, got %u)", where, nColors, info.nColors);
+    hostCheck((info.nColors == nColors) && palOk, what);
+
+    // nativeToRle(), packed with a palette and plain at one and three bytes per color
+
+    for (unsigned char variant = 0; variant < 3; variant++) {
+        if ((variant == 0) && (nColors > 127)) continue;
+        info.packRuns  = (variant == 0);
+        info.colorSize = (variant == 2) ? 3 : 1;
+        info.nColors   = (variant == 0) ? nColors : (1 << geo.depth);
+        memset(out, SENTINEL, sizeof(out));
+        memset(expected, SENTINEL, sizeof(expected));
+        unsigned int runsOfOne;
+        const unsigned int modelLen = modelRle(model, nPixels, geo.depth, info, expected, runsOfOne);
+        len = nativeToRle(native, native + nativeLen, out, out + OUT_STOP, geo.depth, &info);
+        sprintf(what, "nativeToRle %s (packRuns %d, colorSize %d, length %u, expected %u)", where, info.packRuns, info.colorSize, len, modelLen);
+        hostCheck((len == modelLen) && (memcmp(out, expected, modelLen) == 0), what);
+        if (info.packRuns) {
+            sprintf(what, "nativeToRle runsOfOne %s (%u, expected %u)", where, info.runsOfOne, runsOfOne);
+            hostCheck(info.runsOfOne == runsOfOne, what);
+        }
+    }
+
+    // nativeToPacked(), for tiles with a small enough palette
+
+    if ((nColors > 1) && (nColors <= 16)) {
+        const unsigned char outDepth = packedDepth(nColors);
+        const unsigned int modelLen = modelPacked(model, nPixels, geo.depth, outDepth, modelInfo, expected);
+        len = nativeToPacked(native, out, native + nativeLen, geo.depth, outDepth, &modelInfo);
+        sprintf(what, "nativeToPacked %s (%d bits)", where, outDepth);
+        hostCheck((len == modelLen) && (memcmp(out, expected, modelLen) == 0), what);
+    }
+}
+
+/**
+ * Times the tile routines as VNCEncodeTRLE::encodeTile() uses them. The
+ * results of each stage are kept so they can be used as the input to
+ * the next stage.
+ */
+
+static void benchKernels(const unsigned char *fb, const Geometry &geo, unsigned char *native, ColorInfo *infos, unsigned char *out) {
+    const unsigned int tiles = numOfTiles(geo);
+    unsigned short *nativeLen = (unsigned short*) malloc(tiles * sizeof(unsigned short));
+    Timing t;
+    short rows, cols;
+    unsigned long start;
+
+    // Convert tiles from the framebuffer into native tiles
+
+    t.tiles = tiles;
+    t.bytes = 0;
+    start = hostMicroseconds();
+    for (unsigned int i = 0; i < tiles; i++) {
+        const unsigned char *src = getTile(fb, geo, i, rows, cols);
+        nativeLen[i] = screenToNative(src, native + i * NATIVE_SIZE, rows, cols, 0);
+    }
+    t.micros = hostMicroseconds() - start;
+    for (unsigned int i = 0; i < tiles; i++) t.bytes += nativeLen[i];
+    printTiming("screenToNative", t);
+
+    // Pad the native tiles as VNCEncodeTRLE::encodeTile() does
+
+    for (unsigned int i = 0; i < tiles; i++) {
+        unsigned char *nativeEnd = native + i * NATIVE_SIZE + nativeLen[i];
+        if ((nativeLen[i] % 4) == 2) {
+            nativeEnd[0] = nativeEnd[-1];
+            nativeEnd[1] = nativeEnd[-1];
+        }
+    }
+
+    // Count the colors in each tile
+
+    start = hostMicroseconds();
+    for (unsigned int i = 0; i < tiles; i++) {
+        unsigned char *nativeTile = native + i * NATIVE_SIZE;
+        nativeToColors(nativeTile, nativeTile + ((nativeLen[i] + 3) & ~3), &infos[i]);
+    }
+    t.micros = hostMicroseconds() - start;
+    t.bytes = 0;
+    printTiming("nativeToColors", t);
+
+    // Run length encode the tiles
+
+    t.bytes = 0;
+    start = hostMicroseconds();
+    for (unsigned int i = 0; i < tiles; i++) {
+        unsigned char *nativeTile = native + i * NATIVE_SIZE;
+        infos[i].colorSize = 1;
+        infos[i].packRuns  = infos[i].nColors <= 127;
+        t.bytes += nativeToRle(nativeTile, nativeTile + nativeLen[i], out, out + OUT_STOP, geo.depth, &infos[i]);
+    }
+    t.micros = hostMicroseconds() - start;
+    printTiming("nativeToRle", t);
+
+    // Pack the tiles which have a small enough palette
+
+    t.tiles = 0;
+    t.bytes = 0;
+    t.micros = 0;
+    for (unsigned int i = 0; i < tiles; i++) {
+        if ((infos[i].nColors > 1) && (infos[i].nColors <= 16)) {
+            unsigned char *nativeTile = native + i * NATIVE_SIZE;
+            start = hostMicroseconds();
+            t.bytes += nativeToPacked(nativeTile, out, nativeTile + nativeLen[i], geo.depth, packedDepth(infos[i].nColors), &infos[i]);
+            t.micros += hostMicroseconds() - start;
+            t.tiles++;
+        }
+    }
+    printTiming("nativeToPacked", t);
+    free(nativeLen);
+}
+
+/**
+ * Checks nativeToDirectColors() and findDirectColor() on a tile at
+ * thousands or millions of colors, as used by VNCEncodeTRLE
+ */
+
+static void checkDirectTile(const unsigned char *src, short rows, short cols, const Geometry &geo, const char *where) {
+    const Boolean is16 = (geo.depth == 16);
+    unsigned long pal[128];
+    unsigned int nColors = 0, nRuns = 0, runsOfOne = 0, countBytes = 0;
+    unsigned long runColor = 0;
+    unsigned int runLen = 0;
+    char what[200];
+
+    for (short y = 0; y < rows; y++) {
+        for (short x = 0; x <= cols; x++) {
+            const Boolean last = (x == cols);
+            if (last && (y != rows - 1)) break;
+            const unsigned char *pix = src + (unsigned long)geo.stride * y + x * geo.depth / 8;
+            unsigned short pix16 = 0;
+            unsigned long  pix32 = 0;
+            if (!last) memcpy(is16 ? (void*)&pix16 : (void*)&pix32, pix, geo.depth / 8);
+            const unsigned long color = is16 ? pix16 & 0x7FFF : pix32 & 0xFFFFFF;
+            if (!last && runLen && (color == runColor)) {
+                runLen++;
+                continue;
+            }
+            if (runLen) {
+                nRuns++;
+                if (runLen == 1) runsOfOne++;
+                for (unsigned int n = runLen - 1; n >= 255; n -= 255) countBytes++;
+                countBytes++;
+            }
+            if (last) break;
+            runColor = color;
+            runLen = 1;
+            unsigned int c;
+            for (c = 0; (c < nColors) && (c < 127) && (pal[c] != color); c++);
+            if (c == nColors) {
+                if (nColors < 127) pal[nColors] = color;
+                nColors++;
+            }
+        }
+    }
+
+    DirectColorInfo info;
+    nativeToDirectColors(src, geo.stride, rows, cols, &info);
+    sprintf(what, "nativeToDirectColors %s", where);
+    hostCheck((info.nColors == min(nColors, 128)) && (info.nRuns == nRuns) && (info.runsOfOne == runsOfOne) && (info.countBytes == countBytes), what);
+    for (unsigned int c = 0; c < min(nColors, 127); c++) {
+        sprintf(what, "findDirectColor %s (color %u)", where, c);
+        hostCheck((info.colorPal[c] == pal[c]) && (findDirectColor(&info, pal[c]) == c), what);
+    }
+}
+
+/**
+ * The encoders are set up as VNCEncoder::encoderSetup() does, and each
+ * tile is passed to the encoder that VNCEncoder would choose for it. At
+ * thousands or millions of colors, every encoder sends TRLE tiles.
+ */
+
+static void beginEncoder(long encoder) {
+    selectedEncoder = encoder;
+    VNCPalette::prepareTileRoutines(encoder != mHextileEncoding);
+    if (encoder == mHextileEncoding) {
+        VNCEncodeHextile::begin();
+    } else {
+        VNCEncodeTRLE::begin();
+    }
+}
+
+static unsigned long encodeTile(const EncoderPB &epb) {
+    if (fbDepth > 8) {
+        return VNCEncodeTRLE::encodeDirectTile(epb);
+    } else if (selectedEncoder == mHextileEncoding) {
+        return VNCEncodeHextile::encodeTile(epb);
+    } else {
+        return VNCEncodeTRLE::encodeTile(epb);
+    }
+}
+
+static const unsigned char *getEncoderTile(EncoderPB &epb, const unsigned char *fb, const Geometry &geo, unsigned int i, unsigned int tileSize, unsigned char *encoded) {
+    short rows, cols;
+    const unsigned char *src = getTile(fb, geo, i, rows, cols, tileSize);
+    epb.rows = rows;
+    epb.cols = cols;
+    epb.src = (unsigned char*) src;
+    epb.dst = encoded;
+    epb.bytesAvail = ENCODED_SIZE;
+    epb.bytesWritten = 0;
+    return src;
+}
+
+// Sets up the palette for a client which has just connected
+
+static void useFormat(const VNCPixelFormat &format) {
+    VNCPalette::beginNewSession(format);
+    VNCPalette::updateColorTable();
+}
+
+/**
+ * Decoders for the tiles sent to a client which takes indexed color,
+ * which write the color of each pixel in the tile, one byte per pixel.
+ * Each returns the length of the tile, or zero if it is not valid. The
+ * TRLE decoder keeps the last palette, and the Hextile decoder keeps the
+ * last colors, for the tiles which reuse them.
+ */
+
+static unsigned int decodeTRLE(const unsigned char *in, short rows, short cols, unsigned char *pixels, unsigned char *palette, unsigned int &paletteSize) {
+    const unsigned int nPixels = rows * cols;
+    const unsigned char *p = in;
+    const unsigned char type = *p++;
+    if (type == 0) {
+        // Raw
+        memcpy(pixels, p, nPixels);
+        p += nPixels;
+    } else if (type == 1) {
+        // Solid
+        memset(pixels, *p++, nPixels);
+    } else if ((type <= 16) || (type == 127)) {
+        // Packed palette, which may be the last palette
+        if (type != 127) {
+            paletteSize = type;
+            memcpy(palette, p, paletteSize);
+            p += paletteSize;
+        }
+        const unsigned char depth = packedDepth(paletteSize);
+        for (short y = 0; y < rows; y++) {
+            for (short x = 0; x < cols; x++) {
+                *pixels++ = palette[getPixel(p, x, depth)];
+            }
+            p += (cols * depth + 7) / 8;
+        }
+    } else if (type >= 128) {
+        // Plain RLE, or palette RLE with the last or a new palette
+        const Boolean withPalette = (type != 128);
+        if (type >= 130) {
+            paletteSize = type - 128;
+            memcpy(palette, p, paletteSize);
+            p += paletteSize;
+        }
+        for (unsigned int i = 0; i < nPixels;) {
+            unsigned char color = *p++;
+            unsigned int len = 1;
+            if (!withPalette || (color & 0x80)) {
+                do {len += *p;} while (*p++ == 255);
+            }
+            if (withPalette) {
+                color = palette[color & 0x7F];
+            }
+            if (i + len > nPixels) return 0;
+            memset(pixels + i, color, len);
+            i += len;
+        }
+    } else {
+        return 0;
+    }
+    return p - in;
+}
+
+enum {
+    HextileRaw             = 1,
+    HextileBackground      = 2,
+    HextileForeground      = 4,
+    HextileAnySubrects     = 8,
+    HextileSubrectsColored = 16
+};
+
+static unsigned int decodeHextile(const unsigned char *in, short rows, short cols, unsigned char *pixels, unsigned char &bg, unsigned char &fg) {
+    const unsigned char *p = in;
+    const unsigned char type = *p++;
+    if (type & HextileRaw) {
+        memcpy(pixels, p, rows * cols);
+        return 1 + rows * cols;
+    }
+    if (type & HextileBackground) bg = *p++;
+    if (type & HextileForeground) fg = *p++;
+    memset(pixels, bg, rows * cols);
+    if (type & HextileAnySubrects) {
+        for (unsigned char n = *p++; n; n--) {
+            const unsigned char color = (type & HextileSubrectsColored) ? *p++ : fg;
+            const unsigned char x = p[0] >> 4, y = p[0] & 15;
+            const unsigned char w = (p[1] >> 4) + 1, h = (p[1] & 15) + 1;
+            p += 2;
+            if ((x + w > cols) || (y + h > rows)) return 0;
+            for (unsigned char j = y; j < y + h; j++) {
+                memset(pixels + j * cols + x, color, w);
+            }
+        }
+    }
+    return p - in;
+}
+
+/**
+ * Encodes each tile for a client which takes indexed color, and checks
+ * that it decodes to the pixels on the screen
+ */
+
+static void checkEncoder(const char *name, long encoder, unsigned int tileSize, const unsigned char *fb, const Geometry &geo, unsigned char *encoded, const char *where) {
+    unsigned char pixels[ZRLE_TILE_SIZE * ZRLE_TILE_SIZE], decoded[ZRLE_TILE_SIZE * ZRLE_TILE_SIZE];
+    unsigned char palette[128];
+    unsigned int paletteSize = 0;
+    unsigned char bg = 0, fg = 0;
+    char what[200];
+
+    beginEncoder(encoder);
+    const unsigned int tiles = numOfTiles(geo, tileSize);
+    for (unsigned int i = 0; i < tiles; i++) {
+        EncoderPB epb;
+        const unsigned char *src = getEncoderTile(epb, fb, geo, i, tileSize, encoded);
+        for (unsigned int y = 0; y < epb.rows; y++) {
+            for (unsigned int x = 0; x < epb.cols; x++) {
+                pixels[y * epb.cols + x] = getPixel(src + (unsigned long)geo.stride * y, x, geo.depth);
+            }
+        }
+        const unsigned long len = encodeTile(epb);
+        memset(decoded, SENTINEL, sizeof(decoded));
+        const unsigned int decodedLen = (encoder == mHextileEncoding) ?
+            decodeHextile(encoded, epb.rows, epb.cols, decoded, bg, fg) :
+            decodeTRLE(encoded, epb.rows, epb.cols, decoded, palette, paletteSize);
+        sprintf(what, "%s %s, tile %u (type %u, length %lu, decoded %u)", name, where, i, encoded[0], len, decodedLen);
+        hostCheck(len && (decodedLen == len) && (memcmp(decoded, pixels, epb.rows * epb.cols) == 0), what);
+    }
+}
+
+/**
+ * Times one of the encoders, and tallies the tile types it chose. At true
+ * color, the colors are only written in the client's byte order on the
+ * Mac, so only the lengths of the tiles are meaningful.
+ */
+
+static void benchEncoder(const char *name, long encoder, unsigned int tileSize, const unsigned char *fb, const Geometry &geo, unsigned char *encoded, const char *where) {
+    const unsigned int tiles = numOfTiles(geo, tileSize);
+    unsigned int histogram[256] = {0};
+    unsigned int unsent = 0;
+    Timing t;
+    char what[200];
+
+    beginEncoder(encoder);
+    t.tiles = tiles;
+    t.bytes = 0;
+    const unsigned long start = hostMicroseconds();
+    for (unsigned int i = 0; i < tiles; i++) {
+        EncoderPB epb;
+        getEncoderTile(epb, fb, geo, i, tileSize, encoded);
+        const unsigned long len = encodeTile(epb);
+        if (len) {
+            histogram[encoded[0]]++;
+        } else {
+            unsent++;
+        }
+        t.bytes += len;
+    }
+    t.micros = hostMicroseconds() - start;
+    printTiming(name, t);
+    printHistogram(histogram);
+    sprintf(what, "%s %s (%u tiles not encoded)", name, where, unsent);
+    hostCheck(unsent == 0, what);
+}
+
+static void benchEncoders(const unsigned char *fb, const Geometry &geo, unsigned char *encoded, const char *where) {
+    // Pixel formats for a client that takes indexed color and one that takes true color
+
+    const VNCPixelFormat indexedFormat   = {8,  8, 1, 0,   0,   0,   0,  0, 0, 0};
+    const VNCPixelFormat trueColorFormat = {32, 24, 1, 1, 255, 255, 255, 16, 8, 0};
+
+    if (geo.depth <= 8) {
+        useFormat(indexedFormat);
+        checkEncoder("TRLE",       mTRLEEncoding,    TILE_SIZE,      fb, geo, encoded, where);
+        checkEncoder("ZRLE tiles", mZRLEEncoding,    ZRLE_TILE_SIZE, fb, geo, encoded, where);
+        checkEncoder("Hextile",    mHextileEncoding, TILE_SIZE,      fb, geo, encoded, where);
+        benchEncoder("TRLE",       mTRLEEncoding,    TILE_SIZE,      fb, geo, encoded, where);
+        benchEncoder("ZRLE tiles", mZRLEEncoding,    ZRLE_TILE_SIZE, fb, geo, encoded, where);
+        benchEncoder("Hextile",    mHextileEncoding, TILE_SIZE,      fb, geo, encoded, where);
+    }
+
+    useFormat(trueColorFormat);
+    benchEncoder("TRLE 24-bit",       mTRLEEncoding, TILE_SIZE,      fb, geo, encoded, where);
+    benchEncoder("ZRLE tiles 24-bit", mZRLEEncoding, ZRLE_TILE_SIZE, fb, geo, encoded, where);
+    if (geo.depth <= 8) {
+        benchEncoder("Hextile 32-bit", mHextileEncoding, TILE_SIZE, fb, geo, encoded, where);
+    }
+}
+
+static void runGeometry(const Geometry &geo, unsigned char *native, ColorInfo *infos, unsigned char *out, unsigned char *encoded) {
+    const unsigned long fbSize = (unsigned long)geo.stride * geo.height;
+    unsigned char *fb = (unsigned char*) malloc(fbSize);
+    char where[100];
+
+    fbWidth  = geo.width;
+    fbHeight = geo.height;
+    fbStride = geo.stride;
+    fbDepth  = geo.depth;
+
+    // The color tables are sized for the depth, so are made again, as
+    // when the screen changes
+    VNCPalette::destroy();
+
+    for (unsigned char pattern = 0; pattern < NumPatterns; pattern++) {
+        fillFramebuffer(fb, geo, pattern);
+        if (!quiet) printf("\n%u x %u, %u-bit, %s:\n", geo.width, geo.height, geo.depth, patternNames[pattern]);
+
+        const unsigned int tiles = numOfTiles(geo);
+        for (unsigned int i = 0; i < tiles; i++) {
+            short rows, cols;
+            const unsigned char *src = getTile(fb, geo, i, rows, cols);
+            sprintf(where, "at %u-bit, %s, tile %u", geo.depth, patternNames[pattern], i);
+            if (geo.depth > 8) {
+                checkDirectTile(src, rows, cols, geo, where);
+            } else {
+                checkTile(src, rows, cols, geo, where);
+            }
+        }
+        if (geo.depth <= 8) benchKernels(fb, geo, native, infos, out);
+        sprintf(where, "at %u x %u, %u-bit, %s", geo.width, geo.height, geo.depth, patternNames[pattern]);
+        benchEncoders(fb, geo, encoded, where);
+    }
+    free(fb);
+}
+
+int main(int argc, char *argv[]) {
+    quiet = (argc > 1) && (strcmp(argv[1], "-q") == 0);
+
+    // The last size has tiles of odd heights at the bottom, which
+    // nativeToRle() must pad at one bit per pixel
+
+    const unsigned int sizes[][2] = {{512, 342}, {512, 384}, {640, 480}, {832, 624}, {1024, 768}, {608, 431}};
+    const unsigned char depths[] = {1, 2, 4, 8, 16, 32};
+    const unsigned int maxTiles = (1024 / TILE_SIZE) * (768 / TILE_SIZE);
+
+    unsigned char *native  = (unsigned char*) malloc(maxTiles * NATIVE_SIZE);
+    ColorInfo     *infos   = (ColorInfo*)     malloc(maxTiles * sizeof(ColorInfo));
+    unsigned char *out     = (unsigned char*) malloc(OUT_SIZE);
+    unsigned char *encoded = (unsigned char*) malloc(ENCODED_SIZE);
+
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (unsigned int d = 0; d < sizeof(depths); d++) {
+            Geometry geo;
+            geo.width  = sizes[s][0];
+            geo.height = sizes[s][1];
+            geo.depth  = depths[d];
+            geo.stride = geo.width * geo.depth / 8;
+            runGeometry(geo, native, infos, out, encoded);
+        }
+    }
+
+    free(native);
+    free(infos);
+    free(out);
+    free(encoded);
+    return hostFinish("TileBench");
+}
@@ -0,0 +1,46 @@
+/****************************************************************************
+ *   MiniVNC (c) 2022-2024 Marcio Teixeira                                  *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+/**
+ * Stands in for the MacTCP header in the host build. The encoders only
+ * need the shape of the write data structure; the parameter block is
+ * declared so that "VNCServer.h" compiles, but nothing is ever sent.
+ */
+
+#pragma once
+
+typedef unsigned char   Byte;
+typedef unsigned long   ip_addr;
+typedef unsigned short  tcp_port;
+typedef Ptr             StreamPtr;
+
+struct wdsEntry {
+    unsigned short length;
+    Ptr            ptr;
+};
+
+struct rdsEntry {
+    unsigned short length;
+    Ptr            ptr;
+};
+
+struct TCPiopb {
+    OSErr          ioResult;
+    StreamPtr      tcpStream;
+};
+
+typedef pascal void (*TCPNotifyProcPtr)(StreamPtr tcpStream, unsigned short eventCode, Ptr userDataPtr, unsigned short terminReason, struct ICMPReport *icmpMsg);